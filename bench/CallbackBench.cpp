@@ -0,0 +1,191 @@
+/*
+  CallbackBench.cpp - Host-native micro-benchmark of the MQTT callback
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+
+  Feeds the firmware callback() with the messages Home Assistant sends on every wake and reports heap
+  allocations and CPU cycles per message. Allocations are counted by wrapping the glibc malloc,
+  cycles come from the TSC on x86 and from the monotonic clock (nanoseconds) elsewhere.
+  Then it calls the functions that send the station messages and reports the simulated time every
+  send takes, the 10ms delay() after the publish and the UART time of the log lines included, with
+  an idle UART and with a UART whose FIFO is full, like it is after the Wi-Fi and MQTT connection logs.
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <Arduino.h>
+#include "SimWorld.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+void callback(char* topic, byte* payload, unsigned int length);
+void buildDeviceId();
+const char* stationTopic(const char* topic);
+void sendOnOffState(String cmd, uint16_t seq);
+void sendSensorStateNotTimed(uint16_t seq);
+void sendWaterPumpPowerStateOn();
+void sendWaterPumpPowerStateOff();
+void sendWaterPumpActiveStateOff();
+
+static bool countAllocations = false;
+static unsigned long allocations = 0;
+
+#if defined(__GLIBC__)
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+
+extern "C" void* malloc(size_t size) {
+
+  if (countAllocations) {
+    allocations++;
+  }
+  return __libc_malloc(size);
+
+}
+
+extern "C" void* calloc(size_t count, size_t size) {
+
+  if (countAllocations) {
+    allocations++;
+  }
+  return __libc_calloc(count, size);
+
+}
+
+extern "C" void* realloc(void* ptr, size_t size) {
+
+  if (countAllocations) {
+    allocations++;
+  }
+  return __libc_realloc(ptr, size);
+
+}
+#endif
+
+static uint64_t cycles() {
+
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+
+}
+
+struct BenchMessage {
+  const char* name;
+  const char* topic;
+  const char* payload;
+};
+
+static const BenchMessage MESSAGES[] = {
+  {"config", "stat/+/CONFIG", "{\"time\":\"2026-10-17 21:30:00\", \"upload_mode\":\"off\",\"esp_sleep_time_minutes\":\"10.0\", "
+                                         "\"pump_active\":\"off\",\"pump_seconds\":\"15.0\",\"batch_wakes\":\"1\",\"config_tag\":\"off|off|15.0|10.0|1\"}"},
+  // every key, four zones and the longest time and config_tag the RTC config keeps
+  {"largest config", "stat/+/CONFIG", "{\"time\":\"2026-10-17T21:30:00.123456+02:00\",\"upload_mode\":\"off\",\"esp_sleep_time_minutes\":\"10.0\","
+                                      "\"pump_active\":\"on\",\"pump_seconds\":\"65535\",\"pump_ml\":\"65535\",\"batch_wakes\":\"255\","
+                                      "\"sleep_min_minutes\":\"5\",\"sleep_max_minutes\":\"60\",\"water_defer_hours\":\"12\",\"water_time\":\"21:30\","
+                                      "\"zones\":[{\"seconds\":\"65535\",\"ml\":\"65534\"},{\"seconds\":\"65533\",\"ml\":\"65532\"},"
+                                      "{\"seconds\":\"65531\",\"ml\":\"65530\"},{\"seconds\":\"65529\",\"ml\":\"65528\"}],"
+                                      "\"config_tag\":\"on|off|65535|65535|10.0|255|5|60|12|21:30|65535|65534|6553\"}"},
+  // cut by the broker or the client buffer, it's dropped instead of zeroing the config
+  {"truncated config", "stat/+/CONFIG", "{\"time\":\"2026-10-17 21:30:00\", \"upload_mode\":\"off\",\"esp_sleep_time_minutes\":\"10.0\", \"pump_"},
+  {"ack json", "stat/+/ACK", "{\"value\":\"sendSensorState\",\"seq\":1795}"},
+  {"ack plain", "stat/+/ACK", "sendWaterPumpPowerStateOff"},
+  {"upload mode", "cmnd/+/UPLOAD_MODE", "OFF"},
+  {"other topic", "cmnd/+/PUMP_ACTIVE", "ON"},
+  {"other station", "stat/solar_station_5ccf7f/ACK", "{\"value\":\"sendSensorState\",\"seq\":1795}"},
+};
+
+const int CALLBACK_ITERATIONS = 10000;
+
+struct BenchSend {
+  const char* name;
+  void (*send)();
+};
+
+static const BenchSend SENDS[] = {
+  {"on state", [] { sendOnOffState("ON", 1); }},
+  {"sensor state", [] { sendSensorStateNotTimed(2); }},
+  {"pump power on", sendWaterPumpPowerStateOn},
+  {"pump power off", sendWaterPumpPowerStateOff},
+  {"pump active off", sendWaterPumpActiveStateOff},
+  {"off state", [] { sendOnOffState("OFF", 3); }},
+};
+
+const int SEND_ITERATIONS = 1000;
+
+// runs in the parent process, firmware globals have never been touched by setup()
+void runCallbackBench() {
+
+  static const SimScenario scenario = {"callback", 950, false, 15, 1, false, 10, 1, 2500, 400, 300, 150, 0, LINK_UP, 0, 0, 0, 0, REASON_DEFAULT_RST};
+  static SimPersistentState persistent;
+  static SimResult result;
+  SimWorld::begin(scenario, REASON_DEEP_SLEEP_AWAKE, &persistent, &result);
+  buildDeviceId();
+
+  printf("\n%-20s %14s %16s\n", "message", "allocs_per_msg", "cycles_per_msg");
+  for (const BenchMessage& message : MESSAGES) {
+    char topic[64];
+    uint8_t payload[512];
+    size_t length = strlen(message.payload);
+    // "+" is the ID of this station
+    snprintf(topic, sizeof(topic), "%s", strchr(message.topic, '+') != nullptr ? stationTopic(message.topic) : message.topic);
+    // warm up, the first message can size buffers that are reused later
+    memcpy(payload, message.payload, length);
+    callback(topic, payload, length);
+    allocations = 0;
+    uint64_t total = 0;
+    for (int i = 0; i < CALLBACK_ITERATIONS; i++) {
+      // the MQTT client buffer is rewritten on every message
+      memcpy(payload, message.payload, length);
+      countAllocations = true;
+      uint64_t start = cycles();
+      callback(topic, payload, length);
+      total += cycles() - start;
+      countAllocations = false;
+    }
+    printf("%-20s %14.2f %16llu\n", message.name, static_cast<double>(allocations) / CALLBACK_ITERATIONS,
+           static_cast<unsigned long long>(total / CALLBACK_ITERATIONS));
+  }
+
+  // back to back, the way the handshake window sends them
+  static const char fullFifo[128] = {};
+  printf("\n%-20s %14s %14s %16s\n", "send", "sim_us_per_msg", "sim_us_busy", "cycles_per_msg");
+  for (const BenchSend& send : SENDS) {
+    uint64_t simStart = SimWorld::now();
+    uint64_t total = 0;
+    for (int i = 0; i < SEND_ITERATIONS; i++) {
+      uint64_t start = cycles();
+      send.send();
+      total += cycles() - start;
+    }
+    uint64_t idleMicros = SimWorld::now() - simStart;
+    uint64_t busyMicros = 0;
+    for (int i = 0; i < SEND_ITERATIONS; i++) {
+      Serial.write(fullFifo, sizeof(fullFifo));
+      uint64_t start = SimWorld::now();
+      send.send();
+      busyMicros += SimWorld::now() - start;
+    }
+    printf("%-20s %14llu %14llu %16llu\n", send.name, static_cast<unsigned long long>(idleMicros / SEND_ITERATIONS),
+           static_cast<unsigned long long>(busyMicros / SEND_ITERATIONS), static_cast<unsigned long long>(total / SEND_ITERATIONS));
+  }
+
+}
@@ -0,0 +1,108 @@
+/*
+  FaultInjectionBench.cpp - Wake cycles of the Solar Station firmware on a faulty link
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+
+  The broker stand-in of SimWorld drops, duplicates, reorders and delays the messages between the station and the
+  Home Assistant replica (CONFIG publisher and ACK responder). Every link profile runs the same wakes and reports the
+  distribution of the awake time, the retransmissions of the ACK handshake, the wakes that ran out of connection
+  budget with the state they were stuck in, and the wakes that never reached deep sleep (they fail the benchmark).
+*/
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+#include <sys/mman.h>
+#include <Arduino.h>
+#include "SimWorld.h"
+
+extern uint8_t handshakeWindow;
+SimResult runWakeCycle(const SimScenario& scenario, uint8_t window, uint32_t resetReason, SimSharedMemory* shared);
+
+// same order as the WakeState enum
+static const char* WAKE_STATE_NAMES[] = {"boot", "config", "upload", "report", "pump_start", "pump_run", "sleep"};
+
+// routine timer wakes after a power on wake, or power on wakes that water every time
+static const SimScenario ROUTINE = {"routine", 950, false, 15, 1, false, 10, 1, 2500, 400, 300, 150, 30000, LINK_UP, 0, 0, 0, 0, REASON_DEFAULT_RST};
+static const SimScenario WATERING = {"watering", 950, true, 15, 1, false, 10, 1, 2500, 400, 300, 150, 30000, LINK_UP, 0, 0, 0, 0, REASON_DEFAULT_RST};
+
+static const SimFaults PROFILES[] = {
+  {"perfect link", 0, 0, 0, 0},
+  {"5% loss", 5, 0, 0, 0},
+  {"20% loss", 20, 0, 0, 0},
+  {"20% duplicated", 0, 20, 0, 0},
+  {"20% reordered", 0, 0, 20, 0},
+  {"2s jitter", 0, 0, 0, 2000},
+  {"bad link", 10, 10, 10, 1000},
+  {"awful link", 30, 10, 20, 3000},
+};
+
+const int FAULT_WAKES = 100;
+
+static unsigned long percentile(const std::vector<unsigned long>& sorted, int percent) {
+
+  return sorted.empty() ? 0 : sorted[(sorted.size() - 1) * percent / 100];
+
+}
+
+// returns the number of wakes that never slept
+int runFaultInjectionBench() {
+
+  int neverSlept = 0;
+  printf("\n%-10s %-16s %8s %8s %8s %8s %9s %8s %10s %7s %s\n", "wakes", "link", "p50_ms", "p90_ms", "p99_ms", "max_ms",
+         "retx_avg", "retx_max", "out_budget", "stuck", "stuck_in");
+  for (const SimScenario* scenario : {&ROUTINE, &WATERING}) {
+    for (const SimFaults& profile : PROFILES) {
+      SimWorld::setFaults(profile);
+      SimSharedMemory* shared = static_cast<SimSharedMemory*>(mmap(nullptr, sizeof(SimSharedMemory), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+      *shared = SimSharedMemory();
+      std::vector<unsigned long> awake;
+      unsigned long retransmits = 0;
+      int maxRetransmits = 0;
+      int outOfBudget = 0;
+      int stuck = 0;
+      int stuckIn[sizeof(WAKE_STATE_NAMES) / sizeof(WAKE_STATE_NAMES[0])] = {};
+      for (int wake = 0; wake < FAULT_WAKES; wake++) {
+        bool powerOn = wake == 0 || scenario->pumpActive;
+        shared->persistent.haPumpActive = scenario->pumpActive;
+        SimResult result = runWakeCycle(*scenario, handshakeWindow, powerOn ? REASON_DEFAULT_RST : REASON_DEEP_SLEEP_AWAKE, shared);
+        awake.push_back(result.awakeMs);
+        retransmits += result.numberOfAttemps;
+        maxRetransmits = std::max(maxRetransmits, result.numberOfAttemps);
+        if (!result.slept) {
+          stuck++;
+        }
+        if (result.backedOff || !result.slept) {
+          outOfBudget += result.slept ? 1 : 0;
+          if (result.wakeState < sizeof(WAKE_STATE_NAMES) / sizeof(WAKE_STATE_NAMES[0])) {
+            stuckIn[result.wakeState]++;
+          }
+        }
+      }
+      munmap(shared, sizeof(SimSharedMemory));
+      std::sort(awake.begin(), awake.end());
+      const int* worst = std::max_element(std::begin(stuckIn), std::end(stuckIn));
+      printf("%-10s %-16s %8lu %8lu %8lu %8lu %9.2f %8d %10d %7d %s\n", scenario->name, profile.name,
+             percentile(awake, 50), percentile(awake, 90), percentile(awake, 99), awake.back(),
+             static_cast<double>(retransmits) / FAULT_WAKES, maxRetransmits, outOfBudget, stuck,
+             *worst > 0 ? WAKE_STATE_NAMES[worst - stuckIn] : "-");
+      neverSlept += stuck;
+    }
+  }
+  SimWorld::setFaults(PROFILES[0]);
+  return neverSlept;
+
+}
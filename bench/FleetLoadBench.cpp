@@ -0,0 +1,95 @@
+/*
+  FleetLoadBench.cpp - Fleet of Solar Stations waking at the same time on one broker and one HA
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+
+  Every station of the fleet has its own MAC address, so its own topics, and they all wake at the same time: the
+  power on wake at 0 and the timer wakes one sleep later. One set of HA automations answers all of them, one run at
+  a time (see SimFleet in SimWorld.h). A fleet fails the benchmark if a station receives a message meant for another
+  station, if a station never sleeps or if the slowest wakes go over budget. Powering on the whole fleet at the same
+  millisecond is the worst case, the boot jitter of the firmware spreads the stations over BOOT_JITTER_MS and the
+  awake time reported includes it.
+*/
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+#include <sys/mman.h>
+#include <Arduino.h>
+#include "SimWorld.h"
+
+extern uint8_t handshakeWindow;
+SimResult runWakeCycle(const SimScenario& scenario, uint8_t window, uint32_t resetReason, SimSharedMemory* shared);
+
+static const SimScenario STATION = {"station", 950, false, 15, 1, false, 10, 1, 2500, 400, 300, 150, 10000, LINK_UP, 0, 0, 0, 0, REASON_DEFAULT_RST};
+static const int FLEET_SIZES[] = {1, 10, 100};
+// HA on a Raspberry Pi, trigger, template rendering and mqtt.publish of one automation
+const unsigned long FLEET_AUTOMATION_MS = 10;
+const int FLEET_TIMER_WAKES = 2;
+
+static unsigned long percentile(const std::vector<unsigned long>& sorted, int percent) {
+
+  return sorted.empty() ? 0 : sorted[(sorted.size() - 1) * percent / 100];
+
+}
+
+// returns the number of fleet wakes that failed
+int runFleetLoadBench() {
+
+  int regressions = 0;
+  printf("\n%-8s %6s %8s %8s %8s %8s %9s %10s %7s %s\n", "stations", "wake", "p50_ms", "p90_ms", "p99_ms", "max_ms",
+         "retx_avg", "cross_talk", "stuck", "result");
+  for (int size : FLEET_SIZES) {
+    SimFleet* fleet = static_cast<SimFleet*>(mmap(nullptr, sizeof(SimFleet), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+    SimSharedMemory* stations = static_cast<SimSharedMemory*>(mmap(nullptr, sizeof(SimSharedMemory) * size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+    fleet->automationMs = FLEET_AUTOMATION_MS;
+    for (int i = 0; i < size; i++) {
+      stations[i] = SimSharedMemory();
+      stations[i].persistent.haPumpActive = STATION.pumpActive;
+    }
+    for (int wake = 0; wake <= FLEET_TIMER_WAKES; wake++) {
+      std::vector<unsigned long> awake;
+      unsigned long retransmits = 0;
+      unsigned int crossTalk = 0;
+      int stuck = 0;
+      for (int i = 0; i < size; i++) {
+        SimWorld::setStation(i, fleet);
+        SimResult result = runWakeCycle(STATION, handshakeWindow, wake == 0 ? REASON_DEFAULT_RST : REASON_DEEP_SLEEP_AWAKE, &stations[i]);
+        awake.push_back(result.awakeMs);
+        retransmits += result.numberOfAttemps;
+        crossTalk += result.crossTalk;
+        stuck += result.slept ? 0 : 1;
+      }
+      std::sort(awake.begin(), awake.end());
+      const char* verdict = "OK";
+      if (stuck > 0) {
+        verdict = "NEVER SLEPT";
+      } else if (crossTalk > 0) {
+        verdict = "CROSS TALK";
+      } else if (percentile(awake, 99) > STATION.budgetMs) {
+        verdict = "OVER BUDGET";
+      }
+      regressions += strcmp(verdict, "OK") == 0 ? 0 : 1;
+      printf("%-8d %6s %8lu %8lu %8lu %8lu %9.2f %10u %7d %s\n", size, wake == 0 ? "boot" : "timer", percentile(awake, 50),
+             percentile(awake, 90), percentile(awake, 99), awake.back(), static_cast<double>(retransmits) / size, crossTalk, stuck, verdict);
+    }
+    munmap(stations, sizeof(SimSharedMemory) * size);
+    munmap(fleet, sizeof(SimFleet));
+  }
+  SimWorld::setStation(0, nullptr);
+  return regressions;
+
+}
@@ -0,0 +1,98 @@
+/*
+  HistoryBench.cpp - Months of wakes through the on-device history log
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+
+  A station wakes every hour and sends its telemetry once every six wakes, for a week, a month, four months and a year.
+  Then someone presses the button and a script asks for the whole history with cmnd/<id>/HISTORY. Every row reports
+  the flash the log takes at the end, the bytes written since the first wake downsampling included, the mounts of the
+  file system and the records received by resolution. The benchmark fails if the answer doesn't end with the last
+  chunk, if a record is not newer than the one before it or if the records don't account for every wake.
+*/
+
+#include <cstdio>
+#include <string>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <Arduino.h>
+#include "SimWorld.h"
+
+void setup();
+void loop();
+void buildDeviceId();
+extern char deviceId[];
+extern uint8_t handshakeWindow;
+SimResult runWakeCycle(const SimScenario& scenario, uint8_t window, uint32_t resetReason, SimSharedMemory* shared);
+
+static const SimScenario HOURLY = {"hourly", 950, false, 15, 1, false, 60, 6, 2500, 400, 300, 150, 10000, LINK_UP, 0, 0, 0, 0, REASON_DEFAULT_RST};
+static const int HISTORY_DAYS[] = {7, 30, 120, 365};
+
+// button wake, the request is on the broker before the station connects
+static SimResult runQueryWake(SimSharedMemory* shared) {
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    SimWorld::begin(HOURLY, REASON_EXT_SYS_RST, &shared->persistent, &shared->result);
+    buildDeviceId();
+    SimWorld::command((std::string("cmnd/") + deviceId + "/HISTORY").c_str(), "{}");
+    setup();
+    for (;;) {
+      loop();
+    }
+  }
+  waitpid(pid, nullptr, 0);
+  return shared->result;
+
+}
+
+// returns the number of queries that didn't get the whole history back
+int runHistoryBench() {
+
+  int regressions = 0;
+  printf("\n%-8s %6s %6s %9s %11s %7s %10s %10s %9s %7s %11s %s\n", "history", "days", "wakes", "flash_kb", "written_kb", "mounts",
+         "wake_recs", "hour_recs", "day_recs", "chunks", "wakes_back", "result");
+  for (int days : HISTORY_DAYS) {
+    SimSharedMemory* shared = static_cast<SimSharedMemory*>(mmap(nullptr, sizeof(SimSharedMemory), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+    *shared = SimSharedMemory();
+    int wakes = days * 24;
+    for (int wake = 0; wake < wakes; wake++) {
+      runWakeCycle(HOURLY, handshakeWindow, wake == 0 ? REASON_DEFAULT_RST : REASON_DEEP_SLEEP_AWAKE, shared);
+    }
+    SimResult result = runQueryWake(shared);
+    const SimFlash& flash = shared->persistent.flash;
+    unsigned long flashBytes = 0;
+    for (const SimFlashFile& file : flash.files) {
+      flashBytes += file.path[0] != '\0' ? file.size : 0;
+    }
+    const char* verdict = "OK";
+    if (!result.historyLast) {
+      verdict = "INCOMPLETE";
+    } else if (result.historyDisorder > 0) {
+      verdict = "DISORDER";
+    } else if (result.historyWakes != static_cast<unsigned long>(wakes)) {
+      verdict = "WAKES LOST";
+    }
+    if (strcmp(verdict, "OK") != 0) {
+      regressions++;
+    }
+    printf("%-8s %6d %6d %9.1f %11.1f %7u %10u %10u %9u %7u %11lu %s\n", HOURLY.name, days, wakes, flashBytes / 1024.0, flash.bytesWritten / 1024.0,
+           flash.mounts, result.historyRecords[0], result.historyRecords[1], result.historyRecords[2], result.historyChunks, result.historyWakes, verdict);
+    munmap(shared, sizeof(SimSharedMemory));
+  }
+  return regressions;
+
+}
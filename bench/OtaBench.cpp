@@ -0,0 +1,101 @@
+/*
+  OtaBench.cpp - Firmware updates pulled by the station in upload mode over a weak Wi-Fi link
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+
+  NOTE: someone presses the button and tools/ota_server.py publishes the manifest of an image on cmnd/<id>/OTA.
+  The server sends 20KB/s, the compressed image is assumed 70% of the raw one. Every row reports the bytes the
+  station read from the server, the HTTP requests, the bytes written to the update partition and the time of
+  the last report on stat/<id>/OTA. The benchmark fails when the last report is not the expected one, when
+  a rejected update wrote the update partition, when a resumed transfer read a byte twice, or when the
+  restart would not boot the new image because the eboot command in RTC memory has been overwritten.
+*/
+
+#include <cstdio>
+#include <string>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <Arduino.h>
+#include "SimWorld.h"
+
+void setup();
+void loop();
+void buildDeviceId();
+extern char deviceId[];
+
+static const SimScenario BUTTON = {"button", 950, false, 15, 1, false, 10, 1, 2500, 400, 300, 150, 3610000, LINK_UP, 0, 0, 0, 0, REASON_EXT_SYS_RST};
+static const uint32_t RAW_IMAGE_BYTES = 430080;
+static const uint32_t GZIP_IMAGE_BYTES = RAW_IMAGE_BYTES * 7 / 10;
+static const SimOta OTA_RUNS[] = {
+  // name, board, imageBytes, gzip, badHash, bytesPerSecond, dropAt, expect
+  {"raw image", "solarstation_esp8266", RAW_IMAGE_BYTES, false, false, 20480, {0, 0}, "done"},
+  {"gzip image", "solarstation_esp8266", GZIP_IMAGE_BYTES, true, false, 20480, {0, 0}, "done"},
+  {"gzip two drops", "solarstation_esp8266", GZIP_IMAGE_BYTES, true, false, 20480, {100000, 250000}, "done"},
+  {"wrong board", "solarstation", GZIP_IMAGE_BYTES, true, false, 20480, {0, 0}, "board"},
+  {"too large", "solarstation_esp8266", RAW_IMAGE_BYTES * 3 / 2, false, false, 20480, {0, 0}, "size"},
+  {"bad hash", "solarstation_esp8266", GZIP_IMAGE_BYTES, true, true, 20480, {0, 0}, "verify"},
+};
+
+// button wake, the manifest is on the broker before the station connects
+static SimResult runUpdateWake(const SimOta& ota, SimSharedMemory* shared) {
+
+  SimWorld::setOta(ota);
+  pid_t pid = fork();
+  if (pid == 0) {
+    SimWorld::begin(BUTTON, REASON_EXT_SYS_RST, &shared->persistent, &shared->result);
+    buildDeviceId();
+    SimWorld::command((std::string("cmnd/") + deviceId + "/OTA").c_str(), SimWorld::otaManifest());
+    setup();
+    for (;;) {
+      loop();
+    }
+  }
+  waitpid(pid, nullptr, 0);
+  return shared->result;
+
+}
+
+// returns the number of updates that didn't end as expected
+int runOtaBench() {
+
+  int regressions = 0;
+  printf("\n%-16s %9s %11s %9s %8s %11s %10s %10s %8s %s\n", "ota", "image_kb", "fetched_kb", "requests", "resumes",
+         "written_kb", "report_ms", "restarted", "report", "result");
+  for (const SimOta& ota : OTA_RUNS) {
+    SimSharedMemory* shared = static_cast<SimSharedMemory*>(mmap(nullptr, sizeof(SimSharedMemory), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+    *shared = SimSharedMemory();
+    SimResult result = runUpdateWake(ota, shared);
+    bool done = strcmp(ota.expect, "done") == 0;
+    const char* verdict = "OK";
+    if (strcmp(result.otaReport, ota.expect) != 0 || result.otaRestarted != done) {
+      verdict = "UNEXPECTED";
+    } else if (done && result.otaFetchedBytes != ota.imageBytes) {
+      verdict = "REFETCHED";
+    } else if (!done && strcmp(ota.expect, "verify") != 0 && result.otaWrittenBytes > 0) {
+      verdict = "FLASH WRITTEN";
+    }
+    if (strcmp(verdict, "OK") != 0) {
+      regressions++;
+    }
+    printf("%-16s %9.1f %11.1f %9u %8u %11.1f %10lu %10s %8s %s\n", ota.name, ota.imageBytes / 1024.0, result.otaFetchedBytes / 1024.0,
+           result.otaRequests, result.otaResumes, result.otaWrittenBytes / 1024.0, result.otaReportMs, result.otaRestarted ? "yes" : "no",
+           result.otaReport, verdict);
+    munmap(shared, sizeof(SimSharedMemory));
+  }
+  return regressions;
+
+}
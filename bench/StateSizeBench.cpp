@@ -0,0 +1,102 @@
+/*
+  StateSizeBench.cpp - STATE messages with every ring of the RTC memory full
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+
+  A station comes back after a long outage: the battery history, the offline waterings, the energy totals and the
+  brown-out counter are all at their largest, the longest values they can take. The timer wakes that follow report
+  the largest STATE they sent, the packets PubSubClient dropped because they didn't fit MQTT_MAX_PACKET_SIZE and the
+  battery samples still waiting in RTC memory. The benchmark fails if a packet is dropped, if the STATE is not acked
+  or if the samples are not delivered by the last wake.
+*/
+
+#include <cstdio>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <Arduino.h>
+#include "RtcStore.h"
+#include "SimWorld.h"
+
+void setup();
+void loop();
+extern uint8_t handshakeWindow;
+SimResult runWakeCycle(const SimScenario& scenario, uint8_t window, uint32_t resetReason, SimSharedMemory* shared);
+
+static const SimScenario ROUTINE = {"full rings", 950, false, 15, 1, false, 10, 1, 2500, 400, 300, 150, 30000, LINK_UP, 0, 0, 0, 0, REASON_DEFAULT_RST};
+
+// timer wakes after the one that finds the rings full
+const int STATE_SIZE_WAKES = 3;
+
+// the rings are filled in RTC memory right before the firmware loads it
+static SimResult runFullRingsWake(SimSharedMemory* shared) {
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    SimWorld::begin(ROUTINE, REASON_DEEP_SLEEP_AWAKE, &shared->persistent, &shared->result);
+    rtcStore.load();
+    RtcData& data = rtcStore.data;
+    for (uint8_t i = 0; i < BATTERY_HISTORY_SIZE; i++) {
+      data.batteryHistory[i] = 4200 - i;
+    }
+    data.historyHead = 0;
+    data.historyCount = BATTERY_HISTORY_SIZE;
+    for (uint8_t i = 0; i < OFFLINE_WATERING_SIZE; i++) {
+      data.offline[i] = {4000000000U + i * 86400U, 65535, 4200};
+    }
+    data.offlineCount = OFFLINE_WATERING_SIZE;
+    data.energy = {4000000000UL, 4000000000UL, 4000000000UL, 4000000000UL, 4000000000UL, 4000000000UL, 4000000000UL, 4000000000UL};
+    data.brownOuts = 255;
+    data.batteryMilliohm = 1000;
+    rtcStore.save();
+    setup();
+    for (;;) {
+      loop();
+    }
+  }
+  waitpid(pid, nullptr, 0);
+  return shared->result;
+
+}
+
+// returns the number of wakes that lost a STATE
+int runStateSizeBench() {
+
+  int regressions = 0;
+  SimSharedMemory* shared = static_cast<SimSharedMemory*>(mmap(nullptr, sizeof(SimSharedMemory), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+  *shared = SimSharedMemory();
+  const RtcData* rtc = reinterpret_cast<const RtcData*>(shared->persistent.rtcMemory);
+  printf("\n%-12s %6s %11s %9s %12s %s\n", "state", "wake", "state_bytes", "oversize", "history_left", "result");
+  runWakeCycle(ROUTINE, handshakeWindow, REASON_DEFAULT_RST, shared);
+  for (int wake = 0; wake < STATE_SIZE_WAKES; wake++) {
+    SimResult result = wake == 0 ? runFullRingsWake(shared) : runWakeCycle(ROUTINE, handshakeWindow, REASON_DEEP_SLEEP_AWAKE, shared);
+    const char* verdict = "OK";
+    if (result.oversizePublishes > 0) {
+      verdict = "DROPPED";
+    } else if (!result.slept || result.backedOff) {
+      verdict = "NOT ACKED";
+    } else if (wake == STATE_SIZE_WAKES - 1 && rtc->historyCount > 0) {
+      verdict = "SAMPLES LEFT";
+    }
+    if (strcmp(verdict, "OK") != 0) {
+      regressions++;
+    }
+    printf("%-12s %6d %11zu %9u %12u %s\n", ROUTINE.name, wake + 1, result.stateBytes, result.oversizePublishes, rtc->historyCount, verdict);
+  }
+  munmap(shared, sizeof(SimSharedMemory));
+  return regressions;
+
+}
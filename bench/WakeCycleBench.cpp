@@ -0,0 +1,168 @@
+/*
+  WakeCycleBench.cpp - Host-native wake cycle benchmark for the Solar Station firmware
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+
+  Run it with: pio run -e native -t exec
+  Every scenario runs setup() and loop() in a forked process until ESP.deepSleep() is called,
+  the exit code is not zero if a scenario never sleeps or if it stays awake longer than its budget.
+*/
+
+#include <cstdio>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <Arduino.h>
+#include "SimWorld.h"
+#include "RtcStore.h"
+#include "BatterySampler.h"
+
+// firmware entry points and globals, SolarStation.cpp is linked as is
+void setup();
+void loop();
+extern int number_of_attemps;
+enum WakeState : uint8_t;
+extern WakeState wakeState;
+extern bool interactiveSession;
+extern uint8_t handshakeWindow;
+void runCallbackBench();
+int runFaultInjectionBench();
+int runFleetLoadBench();
+int runHistoryBench();
+int runOtaBench();
+int runStateSizeBench();
+
+static const SimScenario SCENARIOS[] = {
+  // name, batteryAdc, pumpActive, pumpSeconds, zones, uploadMode, sleepMinutes, batchWakes, wifiConnectMs, wifiFastConnectMs, mqttConnectMs, haLatencyMs, budgetMs, link,
+  // batteryAdcPerHour, sleepMinMinutes, sleepMaxMinutes, waterDeferHours, bootReason
+  {"pump active", 950, true, 15, 1, false, 10, 1, 2500, 400, 300, 150, 30000, LINK_UP, 0, 0, 0, 0, REASON_DEFAULT_RST},
+  {"pump inactive", 950, false, 15, 1, false, 10, 1, 2500, 400, 300, 150, 10000, LINK_UP, 0, 0, 0, 0, REASON_DEFAULT_RST},
+  {"batched telemetry", 950, false, 15, 1, false, 10, 6, 2500, 400, 300, 150, 10000, LINK_UP, 0, 0, 0, 0, REASON_DEFAULT_RST},
+  {"upload mode", 950, false, 15, 1, true, 10, 1, 2500, 400, 300, 150, 3610000, LINK_UP, 0, 0, 0, 0, REASON_DEFAULT_RST},
+  {"water pump cutoff", 800, true, 15, 1, false, 10, 1, 2500, 400, 300, 150, 10000, LINK_UP, 0, 0, 0, 0, REASON_DEFAULT_RST},
+  {"hard cutoff", 700, false, 15, 1, false, 10, 1, 2500, 400, 300, 150, 10000, LINK_UP, 0, 0, 0, 0, REASON_DEFAULT_RST},
+  {"broker down", 950, false, 15, 1, false, 10, 1, 2500, 400, 300, 150, 30000, LINK_BROKER_DOWN, 0, 0, 0, 0, REASON_DEFAULT_RST},
+  {"HA down", 950, false, 15, 1, false, 10, 1, 2500, 400, 300, 150, 30000, LINK_HA_DOWN, 0, 0, 0, 0, REASON_DEFAULT_RST},
+  {"three zones", 950, true, 15, 3, false, 10, 1, 2500, 400, 300, 150, 50000, LINK_UP, 0, 0, 0, 0, REASON_DEFAULT_RST},
+  {"broker drop", 950, true, 15, 1, false, 10, 1, 2500, 400, 300, 150, 30000, LINK_BROKER_DROP, 0, 0, 0, 0, REASON_DEFAULT_RST},
+  {"shady spot", 870, false, 15, 1, false, 10, 1, 2500, 400, 300, 150, 10000, LINK_UP, -8, 5, 60, 0, REASON_DEFAULT_RST},
+  {"sunny spot", 950, false, 15, 1, false, 10, 1, 2500, 400, 300, 150, 10000, LINK_UP, 8, 5, 60, 0, REASON_DEFAULT_RST},
+  {"deferred watering", 880, true, 15, 1, false, 10, 1, 2500, 400, 300, 150, 30000, LINK_UP, 0, 5, 60, 6, REASON_DEFAULT_RST},
+  {"shortened watering", 850, true, 300, 1, false, 10, 1, 2500, 400, 300, 150, 300000, LINK_UP, 0, 0, 0, 0, REASON_DEFAULT_RST},
+  {"button", 950, false, 15, 1, false, 10, 1, 2500, 400, 300, 150, 3610000, LINK_UP, 0, 0, 0, 0, REASON_EXT_SYS_RST},
+  {"button empty cell", 760, false, 15, 1, false, 10, 1, 2500, 400, 300, 150, 10000, LINK_UP, -600, 0, 0, 0, REASON_EXT_SYS_RST},
+};
+
+// routine timer wakes that follow the power on wake, results are averaged
+const int TIMER_WAKES = 6;
+
+static void snapshotFirmware(SimResult& result) {
+
+  result.numberOfAttemps = number_of_attemps;
+  result.chargeMicroAh = rtcStore.data.energy.wakeMicroAh;
+  result.wakeState = wakeState;
+  result.backedOff = rtcStore.data.connectionFailures > 0;
+  result.interactive = interactiveSession;
+  result.emptyCell = batterySampler.restingMv < Board::ESP_CUTOFF_MV;
+
+}
+
+SimResult runWakeCycle(const SimScenario& scenario, uint8_t window, uint32_t resetReason, SimSharedMemory* shared) {
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    SimWorld::onSleep = snapshotFirmware;
+    SimWorld::begin(scenario, resetReason, &shared->persistent, &shared->result);
+    handshakeWindow = window;
+    setup();
+    for (;;) {
+      loop();
+    }
+  }
+  waitpid(pid, nullptr, 0);
+  return shared->result;
+
+}
+
+int main() {
+
+  // every scenario runs with the strictly serial handshake first and then with the firmware default window
+  const uint8_t windows[] = {1, handshakeWindow};
+  int regressions = 0;
+  printf("%-20s %6s %6s %10s %10s %10s %9s %9s %11s %12s %9s %s\n", "scenario", "window", "wake", "awake_ms", "radio_ms", "publishes", "tx_bytes", "attempts", "pump_on_ms", "sleep_s", "wake_uah", "result");
+  for (const SimScenario& scenario : SCENARIOS) {
+    for (uint8_t window : windows) {
+      SimSharedMemory* shared = static_cast<SimSharedMemory*>(mmap(nullptr, sizeof(SimSharedMemory), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+      *shared = SimSharedMemory();
+      shared->persistent.haPumpActive = scenario.pumpActive;
+      // the button is pressed half way through the sleep that follows a power on, the reset reason is the one of a timer wake
+      if (scenario.bootReason == REASON_EXT_SYS_RST) {
+        SimResult powerOn = runWakeCycle(scenario, window, REASON_DEFAULT_RST, shared);
+        SimWorld::pressButton(shared->persistent, powerOn.sleepMicros / 2);
+      }
+      // power on wake first, then routine timer wakes that can use what the previous ones left in RTC memory
+      const uint32_t wakes[] = {scenario.bootReason, REASON_DEEP_SLEEP_AWAKE};
+      bool sleptForever = false;
+      for (uint32_t resetReason : wakes) {
+        if (sleptForever) {
+          break;
+        }
+        SimResult total = {};
+        int cycles = resetReason == REASON_DEEP_SLEEP_AWAKE ? TIMER_WAKES : 1;
+        const char* verdict = "OK";
+        for (int cycle = 0; cycle < cycles; cycle++) {
+          SimResult result = runWakeCycle(scenario, window, resetReason == REASON_EXT_SYS_RST ? static_cast<uint32_t>(REASON_DEEP_SLEEP_AWAKE) : resetReason, shared);
+          if (!result.slept) {
+            verdict = "NEVER SLEPT";
+          } else if (result.awakeMs > scenario.budgetMs) {
+            verdict = "OVER BUDGET";
+          } else if (resetReason == REASON_EXT_SYS_RST && result.interactive == result.emptyCell) {
+            verdict = result.emptyCell ? "EMPTY CELL SESSION" : "NO BUTTON";
+          }
+          total.awakeMs += result.awakeMs;
+          total.radioMs += result.radioMs;
+          total.publishCount += result.publishCount;
+          total.txBytes += result.txBytes;
+          total.numberOfAttemps += result.numberOfAttemps;
+          total.pumpOnMs += result.pumpOnMs;
+          total.sleepMicros = result.sleepMicros;
+          total.chargeMicroAh += result.chargeMicroAh;
+          // sleeping forever, the next wake can only be a reset
+          if (!result.slept || result.sleepMicros == 0) {
+            sleptForever = true;
+            cycles = cycle + 1;
+          }
+        }
+        if (strcmp(verdict, "OK") != 0) {
+          regressions++;
+        }
+        printf("%-20s %6u %6s %10lu %10lu %10.1f %9lu %9d %11lu %12llu %9lu %s\n", scenario.name, window, resetReason == REASON_DEEP_SLEEP_AWAKE ? "timer" : (resetReason == REASON_EXT_SYS_RST ? "button" : "boot"),
+               total.awakeMs / cycles, total.radioMs / cycles, static_cast<double>(total.publishCount) / cycles, total.txBytes / cycles, total.numberOfAttemps, total.pumpOnMs,
+               static_cast<unsigned long long>(total.sleepMicros / 1000000ULL), total.chargeMicroAh / cycles, verdict);
+      }
+      munmap(shared, sizeof(SimSharedMemory));
+    }
+  }
+  regressions += runFaultInjectionBench();
+  regressions += runFleetLoadBench();
+  regressions += runHistoryBench();
+  regressions += runOtaBench();
+  regressions += runStateSizeBench();
+  // last, it feeds callback() in this process and the firmware globals inherited by the forked wakes would be dirty
+  runCallbackBench();
+  return regressions == 0 ? 0 : 1;
+
+}
@@ -0,0 +1,150 @@
+/*
+  Arduino.h - Host-native stand-in for the Arduino core used by the native benchmark
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+
+  NOTE: only the surface used by SolarStation.cpp is emulated, time is simulated and advances
+  only through delay() and through the simulated Wi-Fi/MQTT/UART costs (see SimWorld.h).
+*/
+
+#ifndef _DPSOFTWARE_NATIVE_ARDUINO_H
+#define _DPSOFTWARE_NATIVE_ARDUINO_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <string>
+
+typedef uint8_t byte;
+
+#define HIGH 0x1
+#define LOW 0x0
+#define INPUT 0x00
+#define OUTPUT 0x01
+
+// The native build emulates the Lolin D1 Mini pinout
+#define D5 14
+#define D6 12
+#define D7 13
+#define A0 17
+#define LED_BUILTIN 2
+
+/****************** TIME AND GPIO ******************/
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t pin);
+
+/****************** TIMER1 ******************/
+// timer1 interrupts fire inside the simulated clock, at their exact deadline, whatever the sketch is doing
+#define IRAM_ATTR
+#define TIM_DIV1 0
+#define TIM_DIV16 1
+#define TIM_DIV256 3
+#define TIM_EDGE 0
+#define TIM_SINGLE 0
+#define TIM_LOOP 1
+typedef void (*timercallback)(void);
+void timer1_attachInterrupt(timercallback userFunc);
+void timer1_enable(uint8_t divider, uint8_t int_type, uint8_t reload);
+void timer1_disable();
+void timer1_write(uint32_t ticks);
+
+/****************** STRING ******************/
+class String : public std::string {
+public:
+  String() = default;
+  String(const char* str) : std::string(str == nullptr ? "" : str) {}
+  String(const std::string& str) : std::string(str) {}
+  String(char c) : std::string(1, c) {}
+  String(int value) : std::string(std::to_string(value)) {}
+  String(unsigned int value) : std::string(std::to_string(value)) {}
+  String(long value) : std::string(std::to_string(value)) {}
+  String(unsigned long value) : std::string(std::to_string(value)) {}
+  String(float value) : String(static_cast<double>(value)) {}
+  String(double value);
+  long toInt() const { return strtol(c_str(), nullptr, 10); }
+  float toFloat() const { return strtof(c_str(), nullptr); }
+  double toDouble() const { return strtod(c_str(), nullptr); }
+  bool equals(const String& other) const { return *this == other; }
+};
+
+/****************** SERIAL ******************/
+class Print {
+public:
+  virtual ~Print() = default;
+  virtual size_t write(const uint8_t* buffer, size_t size) = 0;
+};
+
+// Serial output is discarded, every byte is charged to the simulated clock as UART time
+class HardwareSerial : public Print {
+public:
+  void begin(unsigned long baud);
+  size_t write(const char* str, size_t len);
+  size_t write(const uint8_t* buffer, size_t size) override { return write(reinterpret_cast<const char*>(buffer), size); }
+  int availableForWrite();
+  size_t print(const char* str) { return write(str, strlen(str)); }
+  size_t print(const std::string& str) { return write(str.c_str(), str.length()); }
+  size_t print(char c) { return write(&c, 1); }
+  size_t print(int value) { return print(std::to_string(value)); }
+  size_t print(unsigned int value) { return print(std::to_string(value)); }
+  size_t print(long value) { return print(std::to_string(value)); }
+  size_t print(unsigned long value) { return print(std::to_string(value)); }
+  size_t print(double value) { return print(String(value)); }
+  template <typename T> size_t println(const T& value) { return print(value) + println(); }
+  size_t println() { return write("\r\n", 2); }
+  operator bool() const { return true; }
+};
+extern HardwareSerial Serial;
+
+/****************** ESP ******************/
+enum rst_reason {
+  REASON_DEFAULT_RST = 0,
+  REASON_WDT_RST = 1,
+  REASON_EXCEPTION_RST = 2,
+  REASON_SOFT_WDT_RST = 3,
+  REASON_SOFT_RESTART = 4,
+  REASON_DEEP_SLEEP_AWAKE = 5,
+  REASON_EXT_SYS_RST = 6
+};
+
+struct rst_info {
+  uint32_t reason;
+};
+
+class EspClass {
+public:
+  uint8_t getCpuFreqMHz();
+  void deepSleep(uint64_t time_us);
+  rst_info* getResetInfoPtr();
+  uint32_t getFreeHeap();
+  uint32_t getMaxFreeBlockSize();
+  uint32_t getFreeContStack();
+  uint32_t getFreeSketchSpace();
+  [[noreturn]] void restart();
+  bool rtcUserMemoryRead(uint32_t offset, uint32_t* data, size_t size);
+  bool rtcUserMemoryWrite(uint32_t offset, uint32_t* data, size_t size);
+};
+extern EspClass ESP;
+
+#endif
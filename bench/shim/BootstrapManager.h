@@ -0,0 +1,64 @@
+/*
+  BootstrapManager.h - Host-native stand-in for the Arduino Bootstrapper publish/subscribe surface
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+
+  NOTE: Wi-Fi and MQTT are never touched, publish() hands the message to the simulated
+  Home Assistant (see SimWorld.h) and bootstrapLoop() delivers its replies to the callback.
+*/
+
+#ifndef _DPSOFTWARE_NATIVE_BOOTSTRAP_MANAGER_H
+#define _DPSOFTWARE_NATIVE_BOOTSTRAP_MANAGER_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <ESP8266WiFi.h>
+#include "Helpers.h"
+
+// fixed header and remaining length of PubSubClient, a packet is built in a buffer of MQTT_MAX_PACKET_SIZE bytes
+#define MQTT_MAX_HEADER_SIZE 5
+
+// MQTT client of the library, publish() hands binary payloads to the simulated Home Assistant
+class PubSubClient : public Print {
+private:
+  std::string streamTopic;
+  std::string streamPayload;
+
+public:
+  bool publish(const char* topic, const uint8_t* payload, unsigned int length, bool retained);
+  bool beginPublish(const char* topic, unsigned int length, bool retained);
+  size_t write(const uint8_t* buffer, size_t size) override;
+  int endPublish();
+};
+extern PubSubClient mqttClient;
+
+class BootstrapManager {
+private:
+  JsonDocument jsonDoc;
+
+public:
+  void bootstrapSetup(void (*manageDisconnections)(), void (*manageHardwareButton)(), void (*callback)(char*, byte*, unsigned int));
+  void bootstrapLoop(void (*manageDisconnections)(), void (*manageQueueSubscription)(), void (*manageHardwareButton)());
+  void subscribe(const char* topic);
+  void subscribe(const char* topic, uint8_t qos);
+  void publish(const char* topic, const char* payload, bool retained);
+  void publish(const char* topic, JsonObject objectToSend, bool retained);
+  void sendState(const char* topic, JsonObject objectToSend, String version);
+  JsonObject getJsonObject();
+  JsonDocument parseQueueMsg(char* topic, byte* payload, unsigned int length);
+};
+
+#endif
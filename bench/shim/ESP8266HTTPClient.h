@@ -0,0 +1,50 @@
+/*
+  ESP8266HTTPClient.h - Host-native stand-in for the HTTP client of the ESP8266 core
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+
+  NOTE: every GET goes to the firmware server of SimWorld, whatever the host of the URL.
+  Only the calls used by the sketch: GET with an optional Range header and the response stream.
+*/
+
+#ifndef _DPSOFTWARE_NATIVE_ESP8266_HTTP_CLIENT_H
+#define _DPSOFTWARE_NATIVE_ESP8266_HTTP_CLIENT_H
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+
+enum t_http_codes {
+  HTTP_CODE_OK = 200,
+  HTTP_CODE_PARTIAL_CONTENT = 206
+};
+
+class HTTPClient {
+public:
+  bool begin(WiFiClient& client, const String& url);
+  void addHeader(const String& name, const String& value);
+  void setTimeout(uint16_t) {}
+  int GET();
+  int getSize() { return size; }
+  WiFiClient* getStreamPtr() { return client; }
+  bool connected();
+  void end();
+private:
+  WiFiClient* client = nullptr;
+  uint32_t rangeFrom = 0;
+  int size = -1;
+};
+
+#endif
@@ -0,0 +1,69 @@
+/*
+  ESP8266WiFi.h - Host-native stand-in for the ESP8266 Wi-Fi station API
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+*/
+
+#ifndef _DPSOFTWARE_NATIVE_ESP8266_WIFI_H
+#define _DPSOFTWARE_NATIVE_ESP8266_WIFI_H
+
+#include <Arduino.h>
+
+enum wl_status_t {
+  WL_IDLE_STATUS = 0,
+  WL_NO_SSID_AVAIL = 1,
+  WL_CONNECTED = 3,
+  WL_CONNECT_FAILED = 4,
+  WL_DISCONNECTED = 6
+};
+
+enum WiFiMode_t {
+  WIFI_OFF = 0,
+  WIFI_STA = 1
+};
+
+class IPAddress {
+public:
+  bool fromString(const char* address);
+  uint8_t octets[4] = {0, 0, 0, 0};
+};
+
+class WiFiClass {
+public:
+  void persistent(bool) {}
+  bool mode(WiFiMode_t mode);
+  bool config(IPAddress, IPAddress, IPAddress) { return true; }
+  wl_status_t begin(const char* ssid, const char* passphrase, int32_t channel = 0, const uint8_t* bssid = nullptr, bool connect = true);
+  bool disconnect(bool wifioff = false);
+  wl_status_t status();
+  uint8_t* BSSID();
+  int32_t channel();
+  uint8_t* macAddress(uint8_t* mac);
+  String macAddress();
+  int32_t RSSI() { return -60; }
+};
+extern WiFiClass WiFi;
+
+// TCP stream of the HTTP client, see ESP8266HTTPClient.h
+class WiFiClient {
+public:
+  int available();
+  int read(uint8_t* buffer, size_t size);
+  bool connected();
+  void stop();
+};
+
+#endif
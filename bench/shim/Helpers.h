@@ -0,0 +1,72 @@
+/*
+  Helpers.h - Host-native stand-in for the Arduino Bootstrapper helpers
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+*/
+
+#ifndef _DPSOFTWARE_NATIVE_HELPERS_H
+#define _DPSOFTWARE_NATIVE_HELPERS_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+// Arduino String <-> JSON conversion, the real core gets this for free from ArduinoJson
+namespace ArduinoJson {
+template <>
+struct Converter<String> {
+  static void toJson(const String& src, JsonVariant dst) {
+    dst.set(src.c_str());
+  }
+  static String fromJson(JsonVariantConst src) {
+    const char* str = src.as<const char*>();
+    return str == nullptr ? String("null") : String(str);
+  }
+  static bool checkJson(JsonVariantConst src) {
+    return src.is<const char*>();
+  }
+};
+}
+
+const String OFF_CMD = "OFF";
+const String ON_CMD = "ON";
+const String off_CMD = "off";
+const String on_CMD = "on";
+const String VALUE = "value";
+const int DELAY_10 = 10;
+const int DELAY_50 = 50;
+const int DELAY_100 = 100;
+const int DELAY_200 = 200;
+const int DELAY_500 = 500;
+const int DELAY_1000 = 1000;
+const int DELAY_1500 = 1500;
+const int DELAY_3000 = 3000;
+const int DELAY_5000 = 5000;
+
+extern String timedate;
+extern String deviceName;
+extern String microcontrollerIP;
+extern bool fastDisconnectionManagement;
+extern int wifiReconnectAttemp;
+extern int mqttReconnectAttemp;
+
+class Helpers {
+public:
+  String getValue(String string) { return string; }
+  String isOnOff(JsonDocument json) { return json[VALUE] == ON_CMD ? ON_CMD : OFF_CMD; }
+  char* string2char(const String& command) { return const_cast<char*>(command.c_str()); }
+};
+
+#endif
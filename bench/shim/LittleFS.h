@@ -0,0 +1,53 @@
+/*
+  LittleFS.h - Host-native stand-in for the LittleFS file system of the ESP8266 core
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+
+  NOTE: files live in the flash image of SimPersistentState, they survive deep sleep like on the station.
+  Only the calls used by the sketch: flat paths, modes "r", "w" and "a", one file size limit.
+*/
+
+#ifndef _DPSOFTWARE_NATIVE_LITTLEFS_H
+#define _DPSOFTWARE_NATIVE_LITTLEFS_H
+
+#include <Arduino.h>
+
+class File {
+public:
+  File(int slot = -1, bool writable = false) : slot(slot), writable(writable) {}
+  explicit operator bool() const { return slot >= 0; }
+  size_t write(const uint8_t* buffer, size_t size);
+  size_t read(uint8_t* buffer, size_t size);
+  bool seek(uint32_t position);
+  size_t size() const;
+  void close() { slot = -1; }
+private:
+  int slot;
+  bool writable;
+  uint32_t position = 0;
+};
+
+class LittleFSClass {
+public:
+  bool begin();
+  File open(const char* path, const char* mode);
+  bool exists(const char* path);
+  bool remove(const char* path);
+  bool rename(const char* from, const char* to);
+};
+extern LittleFSClass LittleFS;
+
+#endif
@@ -0,0 +1,644 @@
+/*
+  NativeCore.cpp - Host-native stand-in for the Arduino core and the Arduino Bootstrapper
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+*/
+
+#include <cstdio>
+#include <LittleFS.h>
+#include <ESP8266HTTPClient.h>
+#include <Updater.h>
+#include "BootstrapManager.h"
+#include "SimWorld.h"
+
+HardwareSerial Serial;
+EspClass ESP;
+WiFiClass WiFi;
+PubSubClient mqttClient;
+LittleFSClass LittleFS;
+UpdaterClass Update;
+
+String timedate = "OFF";
+String deviceName = WIFI_DEVICE_NAME;
+String microcontrollerIP = MICROCONTROLLER_IP;
+bool fastDisconnectionManagement = false;
+int wifiReconnectAttemp = 0;
+int mqttReconnectAttemp = 0;
+
+static unsigned long serialBaud = 115200;
+
+/********************************** ARDUINO CORE *****************************************/
+String::String(double value) {
+
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.2f", value);
+  assign(buf);
+
+}
+
+unsigned long millis() {
+
+  return static_cast<unsigned long>(SimWorld::now() / 1000);
+
+}
+
+unsigned long micros() {
+
+  return static_cast<unsigned long>(SimWorld::now());
+
+}
+
+void delay(unsigned long ms) {
+
+  SimWorld::advance(static_cast<uint64_t>(ms) * 1000);
+
+}
+
+void yield() {
+}
+
+void pinMode(uint8_t, uint8_t) {
+}
+
+void digitalWrite(uint8_t pin, uint8_t val) {
+
+  SimWorld::writePin(pin, val);
+
+}
+
+int digitalRead(uint8_t) {
+
+  return HIGH;
+
+}
+
+int analogRead(uint8_t) {
+
+  return SimWorld::readAdc();
+
+}
+
+static timercallback timer1Callback = nullptr;
+static uint8_t timer1Divider = TIM_DIV1;
+
+void timer1_attachInterrupt(timercallback userFunc) {
+
+  timer1Callback = userFunc;
+
+}
+
+void timer1_enable(uint8_t divider, uint8_t, uint8_t) {
+
+  timer1Divider = divider;
+
+}
+
+void timer1_disable() {
+
+  SimWorld::cancelTimer();
+
+}
+
+// 80MHz timer clock divided by 1, 16 or 256
+void timer1_write(uint32_t ticks) {
+
+  uint64_t divider = timer1Divider == TIM_DIV256 ? 256 : (timer1Divider == TIM_DIV16 ? 16 : 1);
+  SimWorld::startTimer(ticks * divider / 80, timer1Callback);
+
+}
+
+void HardwareSerial::begin(unsigned long baud) {
+
+  serialBaud = baud;
+
+}
+
+size_t HardwareSerial::write(const char*, size_t len) {
+
+  SimWorld::chargeUart(len, serialBaud);
+  return len;
+
+}
+
+int HardwareSerial::availableForWrite() {
+
+  return SimWorld::uartRoom(serialBaud);
+
+}
+
+uint8_t EspClass::getCpuFreqMHz() {
+
+  return 80;
+
+}
+
+void EspClass::deepSleep(uint64_t time_us) {
+
+  SimWorld::sleep(time_us);
+
+}
+
+// heap and stack of the host have nothing in common with the ones of the ESP8266, typical values after the Wi-Fi stack is up
+uint32_t EspClass::getFreeHeap() {
+
+  return 41000;
+
+}
+
+uint32_t EspClass::getMaxFreeBlockSize() {
+
+  return 38000;
+
+}
+
+uint32_t EspClass::getFreeContStack() {
+
+  return 1800;
+
+}
+
+// D1 Mini with a 2MB file system, the 1MB sketch area minus a 420KB sketch
+uint32_t EspClass::getFreeSketchSpace() {
+
+  return 589824;
+
+}
+
+void EspClass::restart() {
+
+  SimWorld::restart();
+
+}
+
+rst_info* EspClass::getResetInfoPtr() {
+
+  static rst_info info;
+  info.reason = SimWorld::resetReason();
+  return &info;
+
+}
+
+bool EspClass::rtcUserMemoryRead(uint32_t offset, uint32_t* data, size_t size) {
+
+  if (offset * 4 + size > sizeof(SimPersistentState::rtcMemory)) {
+    return false;
+  }
+  memcpy(data, SimWorld::persistent().rtcMemory + offset, size);
+  return true;
+
+}
+
+bool EspClass::rtcUserMemoryWrite(uint32_t offset, uint32_t* data, size_t size) {
+
+  if (offset * 4 + size > sizeof(SimPersistentState::rtcMemory)) {
+    return false;
+  }
+  memcpy(SimWorld::persistent().rtcMemory + offset, data, size);
+  return true;
+
+}
+
+/********************************** LITTLEFS *****************************************/
+static SimFlashFile* flashFile(int slot) {
+
+  return &SimWorld::persistent().flash.files[slot];
+
+}
+
+static int flashSlot(const char* path) {
+
+  for (int slot = 0; slot < SIM_FLASH_FILES; slot++) {
+    if (strcmp(flashFile(slot)->path, path) == 0) {
+      return slot;
+    }
+  }
+  return -1;
+
+}
+
+// an empty flash image is a formatted partition
+bool LittleFSClass::begin() {
+
+  SimWorld::persistent().flash.mounts++;
+  return true;
+
+}
+
+File LittleFSClass::open(const char* path, const char* mode) {
+
+  int slot = flashSlot(path);
+  if (mode[0] == 'r') {
+    return File(slot, false);
+  }
+  if (slot < 0) {
+    slot = flashSlot("");
+    if (slot < 0) {
+      return File();
+    }
+    snprintf(flashFile(slot)->path, sizeof(SimFlashFile::path), "%s", path);
+    flashFile(slot)->size = 0;
+  }
+  if (mode[0] == 'w') {
+    flashFile(slot)->size = 0;
+  }
+  File file(slot, true);
+  file.seek(flashFile(slot)->size);
+  return file;
+
+}
+
+bool LittleFSClass::exists(const char* path) {
+
+  return flashSlot(path) >= 0;
+
+}
+
+bool LittleFSClass::remove(const char* path) {
+
+  int slot = flashSlot(path);
+  if (slot < 0) {
+    return false;
+  }
+  flashFile(slot)->path[0] = '\0';
+  return true;
+
+}
+
+bool LittleFSClass::rename(const char* from, const char* to) {
+
+  int slot = flashSlot(from);
+  if (slot < 0) {
+    return false;
+  }
+  remove(to);
+  snprintf(flashFile(slot)->path, sizeof(SimFlashFile::path), "%s", to);
+  return true;
+
+}
+
+// writes go to the end of the file, a full file takes what fits
+size_t File::write(const uint8_t* buffer, size_t size) {
+
+  if (slot < 0 || !writable) {
+    return 0;
+  }
+  SimFlashFile* file = flashFile(slot);
+  position = file->size;
+  if (size > SIM_FLASH_FILE_SIZE - position) {
+    size = SIM_FLASH_FILE_SIZE - position;
+  }
+  memcpy(file->data + position, buffer, size);
+  position += size;
+  file->size = position;
+  SimWorld::persistent().flash.bytesWritten += size;
+  return size;
+
+}
+
+size_t File::read(uint8_t* buffer, size_t size) {
+
+  if (slot < 0) {
+    return 0;
+  }
+  SimFlashFile* file = flashFile(slot);
+  if (size > file->size - position) {
+    size = file->size - position;
+  }
+  memcpy(buffer, file->data + position, size);
+  position += size;
+  return size;
+
+}
+
+bool File::seek(uint32_t to) {
+
+  if (slot < 0 || to > flashFile(slot)->size) {
+    return false;
+  }
+  position = to;
+  return true;
+
+}
+
+size_t File::size() const {
+
+  return slot < 0 ? 0 : flashFile(slot)->size;
+
+}
+
+/********************************** HTTP CLIENT *****************************************/
+bool HTTPClient::begin(WiFiClient& stream, const String&) {
+
+  client = &stream;
+  rangeFrom = 0;
+  size = -1;
+  return true;
+
+}
+
+// "bytes=<from>-", the only range the sketch asks for
+void HTTPClient::addHeader(const String& name, const String& value) {
+
+  unsigned long from;
+  if (name == "Range" && sscanf(value.c_str(), "bytes=%lu-", &from) == 1) {
+    rangeFrom = from;
+  }
+
+}
+
+int HTTPClient::GET() {
+
+  return SimWorld::httpGet(rangeFrom, size);
+
+}
+
+bool HTTPClient::connected() {
+
+  return SimWorld::httpConnected();
+
+}
+
+void HTTPClient::end() {
+
+  SimWorld::httpClose();
+
+}
+
+int WiFiClient::available() {
+
+  return SimWorld::httpAvailable();
+
+}
+
+int WiFiClient::read(uint8_t* buffer, size_t size) {
+
+  return SimWorld::httpRead(buffer, size);
+
+}
+
+bool WiFiClient::connected() {
+
+  return SimWorld::httpConnected();
+
+}
+
+void WiFiClient::stop() {
+
+  SimWorld::httpClose();
+
+}
+
+/********************************** UPDATER *****************************************/
+const uint32_t FLASH_SECTOR_SIZE = 4096;
+const uint64_t FLASH_SECTOR_MICROS = 25000; // erase and write of one sector, the CPU waits for it
+
+bool UpdaterClass::begin(size_t imageSize) {
+
+  if (imageSize > ESP.getFreeSketchSpace()) {
+    return false;
+  }
+  size = imageSize;
+  written = 0;
+  SimWorld::digestBegin(digest);
+  expectedMd5.clear();
+  return true;
+
+}
+
+bool UpdaterClass::setMD5(const char* expected) {
+
+  expectedMd5 = expected;
+  return true;
+
+}
+
+size_t UpdaterClass::write(uint8_t* data, size_t len) {
+
+  if (len > size - written) {
+    return 0;
+  }
+  if ((written + len) / FLASH_SECTOR_SIZE != written / FLASH_SECTOR_SIZE) {
+    SimWorld::advance(FLASH_SECTOR_MICROS);
+  }
+  SimWorld::digestAdd(digest, data, len);
+  written += len;
+  SimWorld::otaWritten(len);
+  return len;
+
+}
+
+// like the core, an incomplete image or a hash that doesn't match is discarded
+bool UpdaterClass::end(bool evenIfRemaining) {
+
+  bool complete = written == size || evenIfRemaining;
+  bool verified = complete && (expectedMd5.empty() || SimWorld::digestHex(digest) == expectedMd5);
+  if (verified) {
+    SimWorld::ebootCommand();
+  }
+  size = 0;
+  written = 0;
+  return verified;
+
+}
+
+/********************************** WIFI *****************************************/
+bool IPAddress::fromString(const char* address) {
+
+  unsigned int a, b, c, d;
+  if (sscanf(address, "%u.%u.%u.%u", &a, &b, &c, &d) != 4 || a > 255 || b > 255 || c > 255 || d > 255) {
+    return false;
+  }
+  octets[0] = a;
+  octets[1] = b;
+  octets[2] = c;
+  octets[3] = d;
+  return true;
+
+}
+
+bool WiFiClass::mode(WiFiMode_t mode) {
+
+  if (mode == WIFI_OFF) {
+    SimWorld::radioOff();
+  }
+  return true;
+
+}
+
+wl_status_t WiFiClass::begin(const char*, const char*, int32_t channel, const uint8_t* bssid, bool) {
+
+  SimWorld::beginWifi(channel, bssid);
+  return status();
+
+}
+
+bool WiFiClass::disconnect(bool) {
+
+  SimWorld::disconnectWifi();
+  return true;
+
+}
+
+wl_status_t WiFiClass::status() {
+
+  return SimWorld::wifiConnected() ? WL_CONNECTED : WL_DISCONNECTED;
+
+}
+
+uint8_t* WiFiClass::BSSID() {
+
+  static uint8_t bssid[6];
+  memcpy(bssid, SimWorld::wifiBssid(), sizeof(bssid));
+  return bssid;
+
+}
+
+int32_t WiFiClass::channel() {
+
+  return SimWorld::wifiChannel();
+
+}
+
+uint8_t* WiFiClass::macAddress(uint8_t* mac) {
+
+  SimWorld::macAddress(mac);
+  return mac;
+
+}
+
+String WiFiClass::macAddress() {
+
+  uint8_t mac[6];
+  char buf[18];
+  macAddress(mac);
+  snprintf(buf, sizeof(buf), "%02X:%02X:%02X:%02X:%02X:%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+  return buf;
+
+}
+
+/********************************** MQTT CLIENT *****************************************/
+bool PubSubClient::publish(const char* topic, const uint8_t* payload, unsigned int length, bool) {
+
+  return SimWorld::publish(topic, std::string(reinterpret_cast<const char*>(payload), length));
+
+}
+
+bool PubSubClient::beginPublish(const char* topic, unsigned int, bool) {
+
+  streamTopic = topic;
+  streamPayload.clear();
+  return true;
+
+}
+
+size_t PubSubClient::write(const uint8_t* buffer, size_t size) {
+
+  streamPayload.append(reinterpret_cast<const char*>(buffer), size);
+  return size;
+
+}
+
+// the payload is streamed to the socket, it is not limited by the buffer
+int PubSubClient::endPublish() {
+
+  SimWorld::publish(streamTopic.c_str(), streamPayload, true);
+  return 1;
+
+}
+
+/********************************** BOOTSTRAP MANAGER *****************************************/
+static void (*queueCallback)(char*, byte*, unsigned int) = nullptr;
+
+void BootstrapManager::bootstrapSetup(void (*)(), void (*)(), void (*callback)(char*, byte*, unsigned int)) {
+
+  queueCallback = callback;
+  SimWorld::connectWifi();
+
+}
+
+// like the library, reconnection blocks the loop and calls manageDisconnections() at every failed attempt
+void BootstrapManager::bootstrapLoop(void (*manageDisconnections)(), void (*manageQueueSubscription)(), void (*)()) {
+
+  while (!SimWorld::mqttConnected()) {
+    if (SimWorld::connectMqtt()) {
+      mqttReconnectAttemp = 0;
+      manageQueueSubscription();
+    } else {
+      mqttReconnectAttemp++;
+      manageDisconnections();
+      delay(DELAY_500);
+    }
+  }
+  SimWorld::deliver(queueCallback);
+
+}
+
+void BootstrapManager::subscribe(const char* topic) {
+
+  SimWorld::subscribe(topic);
+
+}
+
+void BootstrapManager::subscribe(const char* topic, uint8_t) {
+
+  SimWorld::subscribe(topic);
+
+}
+
+void BootstrapManager::publish(const char* topic, const char* payload, bool) {
+
+  SimWorld::publish(topic, payload);
+
+}
+
+void BootstrapManager::publish(const char* topic, JsonObject objectToSend, bool) {
+
+  std::string payload;
+  serializeJson(objectToSend, payload);
+  SimWorld::publish(topic, payload);
+
+}
+
+void BootstrapManager::sendState(const char* topic, JsonObject objectToSend, String version) {
+
+  objectToSend["Whoami"] = deviceName;
+  objectToSend["IP"] = microcontrollerIP;
+  objectToSend["MAC"] = WiFi.macAddress();
+  objectToSend["ver"] = version;
+  objectToSend["time"] = timedate;
+  objectToSend["wifi"] = 80; // quality of WiFi.RSSI()
+  publish(topic, objectToSend, false);
+
+}
+
+JsonObject BootstrapManager::getJsonObject() {
+
+  jsonDoc.clear();
+  return jsonDoc.to<JsonObject>();
+
+}
+
+JsonDocument BootstrapManager::parseQueueMsg(char*, byte* payload, unsigned int length) {
+
+  JsonDocument json;
+  DeserializationError error = deserializeJson(json, reinterpret_cast<const char*>(payload), length);
+  if (error) {
+    json.clear();
+    json[VALUE] = std::string(reinterpret_cast<const char*>(payload), length);
+  }
+  return json;
+
+}
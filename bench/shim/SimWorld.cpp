@@ -0,0 +1,847 @@
+/*
+  SimWorld.cpp - Simulated clock, battery, broker and Home Assistant for the native benchmark
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+*/
+
+#include <algorithm>
+#include <ctime>
+#include <set>
+#include <vector>
+#include <unistd.h>
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <BootstrapManager.h>
+#include "SimWorld.h"
+
+namespace SimWorld {
+
+void (*onSleep)(SimResult& result) = nullptr;
+
+struct PendingMessage {
+  uint64_t due;
+  std::string topic;
+  std::string payload;
+};
+
+static SimScenario current;
+static uint32_t reset = 0;
+static SimPersistentState* state = nullptr;
+static SimResult* result = nullptr;
+static uint64_t clockMicros = 0;
+static std::set<std::string> subscriptions;
+static std::vector<PendingMessage> pending;
+static bool mqttSession = false;
+// the access point of the simulated garden, association completes at wifiAssociatedAt
+static const uint8_t AP_BSSID[6] = {0x24, 0xA4, 0x3C, 0x11, 0x22, 0x33};
+static const int32_t AP_CHANNEL = 6;
+static uint64_t wifiAssociatedAt = UINT64_MAX;
+static uint64_t radioOnAt = UINT64_MAX;
+static uint64_t radioOnMicros = 0; // closed radio on intervals
+// one pump or valve per zone of the native zone table
+static const uint8_t PUMP_PINS[] = {D5, D6, D7};
+const uint8_t PUMP_COUNT = sizeof(PUMP_PINS);
+static uint64_t pumpOnSince[PUMP_COUNT];
+static bool pumpOn[PUMP_COUNT];
+static uint64_t pumpOnMicros = 0;
+static uint64_t uartIdleAt = 0;
+static uint64_t timerAt = 0;
+static void (*timerIsr)() = nullptr;
+// LINK_BROKER_DROP, the broker goes away when the pump starts and refuses connections until brokerBackAt
+const uint64_t BROKER_DROP_MICROS = 20ULL * 1000000ULL;
+static uint64_t brokerBackAt = 0;
+// ADC noise, a spike every few samples and the battery sag while the pump draws current
+const int ADC_NOISE = 6;
+const int ADC_SPIKE = 60;
+const int ADC_PUMP_SAG = 25;
+static uint32_t adcSeed = 1;
+// link faults, the random sequence is seeded by the wall clock, every run of the same scenario is the same
+static SimFaults faults = {"none", 0, 0, 0, 0};
+// newest record of the history received so far
+static uint32_t historyLastTime = 0;
+const uint64_t REORDER_MICROS = 500ULL * 1000ULL;
+static uint32_t faultSeed = 1;
+// fleet of stations on the same broker and HA, this process runs one of them
+static SimOta ota = {};
+static bool otaDropped[2];
+static bool httpOpen = false;
+static uint32_t httpFrom = 0; // first byte of the response
+static uint32_t httpPosition = 0; // next byte the station reads
+static uint64_t httpStartMicros = 0;
+const uint64_t HTTP_CONNECT_MICROS = 300ULL * 1000ULL; // TCP handshake, request and response headers
+const char* const OTA_SERVER_URL = "http://192.168.1.3:8266/firmware.bin";
+
+static uint16_t station = 0;
+static SimFleet* fleet = nullptr;
+static std::vector<const SimFleetMessage*> foreign; // messages HA published for the other stations, by delivery time
+
+void begin(const SimScenario& scenario, uint32_t resetReason, SimPersistentState* persistent, SimResult* out) {
+
+  current = scenario;
+  reset = resetReason;
+  state = persistent;
+  result = out;
+  *result = SimResult();
+  clockMicros = 0;
+  subscriptions.clear();
+  pending.clear();
+  mqttSession = false;
+  wifiAssociatedAt = UINT64_MAX;
+  radioOnAt = UINT64_MAX;
+  radioOnMicros = 0;
+  memset(pumpOn, 0, sizeof(pumpOn));
+  pumpOnMicros = 0;
+  uartIdleAt = 0;
+  timerIsr = nullptr;
+  brokerBackAt = 0;
+  adcSeed = 1;
+  faultSeed = static_cast<uint32_t>(state->wallMicros / 1000) | 1;
+  foreign.clear();
+  historyLastTime = 0;
+  httpOpen = false;
+  if (fleet != nullptr) {
+    for (int i = 0; i < fleet->logCount; i++) {
+      if (fleet->log[i].station != station && fleet->log[i].wallMicros > state->wallMicros) {
+        foreign.push_back(&fleet->log[i]);
+      }
+    }
+    std::sort(foreign.begin(), foreign.end(), [](const SimFleetMessage* a, const SimFleetMessage* b) {
+      return a->wallMicros < b->wallMicros;
+    });
+  }
+
+}
+
+void setStation(uint16_t index, SimFleet* shared) {
+
+  station = index;
+  fleet = shared;
+
+}
+
+// Espressif OUI, the last three bytes are the station
+void macAddress(uint8_t* mac) {
+
+  const uint8_t address[6] = {0x5C, 0xCF, 0x7F, 0xA0, static_cast<uint8_t>(station >> 8), static_cast<uint8_t>(station)};
+  memcpy(mac, address, sizeof(address));
+
+}
+
+void setFaults(const SimFaults& injected) {
+
+  faults = injected;
+
+}
+
+static uint32_t faultRandom() {
+
+  faultSeed = faultSeed * 1103515245 + 12345;
+  return faultSeed >> 16;
+
+}
+
+// the random sequence is not touched by a fault that is off, a perfect link behaves exactly like before
+static bool faultHits(int percent) {
+
+  return percent > 0 && static_cast<int>(faultRandom() % 100) < percent;
+
+}
+
+static uint64_t faultJitter() {
+
+  return faults.jitterMs > 0 ? (faultRandom() % (faults.jitterMs + 1)) * 1000 : 0;
+
+}
+
+// the TTP223 pulls the reset pin micros into the last deep sleep, the ESP8266 reports it like the timer
+void pressButton(SimPersistentState& persistent, uint64_t micros) {
+
+  if (persistent.sleepMicros == 0) {
+    persistent.wallMicros += micros;
+  } else if (micros < persistent.sleepMicros) {
+    persistent.wallMicros -= persistent.sleepMicros - micros;
+  }
+  persistent.sleepMicros = micros;
+
+}
+
+const SimScenario& scenario() {
+
+  return current;
+
+}
+
+uint32_t resetReason() {
+
+  return reset;
+
+}
+
+SimPersistentState& persistent() {
+
+  return *state;
+
+}
+
+uint64_t now() {
+
+  return clockMicros;
+
+}
+
+[[noreturn]] static void finish(bool timedOut, uint64_t sleepMicros) {
+
+  for (uint8_t pin : PUMP_PINS) {
+    writePin(pin, LOW);
+  }
+  result->slept = !timedOut;
+  result->timedOut = timedOut;
+  result->awakeMs = clockMicros / 1000;
+  result->radioMs = (radioOnMicros + (radioOnAt == UINT64_MAX ? 0 : clockMicros - radioOnAt)) / 1000;
+  result->pumpOnMs = pumpOnMicros / 1000;
+  result->sleepMicros = sleepMicros;
+  state->wallMicros += clockMicros + sleepMicros;
+  state->sleepMicros = sleepMicros;
+  if (onSleep != nullptr) {
+    onSleep(*result);
+  }
+  _exit(0);
+
+}
+
+void advance(uint64_t micros) {
+
+  uint64_t target = clockMicros + micros;
+  // a timer interrupt preempts whatever the sketch is doing at its deadline, the ISR can arm the timer again
+  while (timerIsr != nullptr && timerAt <= target) {
+    clockMicros = timerAt;
+    void (*isr)() = timerIsr;
+    timerIsr = nullptr;
+    isr();
+  }
+  clockMicros = target;
+  if (clockMicros > MAX_SIMULATED_MICROS) {
+    finish(true, 0);
+  }
+
+}
+
+// full scan and association done by bootstrapSetup(), nothing to do if the station is already associated
+void connectWifi() {
+
+  if (!wifiConnected()) {
+    if (radioOnAt == UINT64_MAX) {
+      radioOnAt = clockMicros;
+    }
+    advance(current.wifiConnectMs * 1000);
+    wifiAssociatedAt = clockMicros;
+  }
+
+}
+
+// association without scan, it never completes if the AP is not on that BSSID and channel
+void beginWifi(int32_t channel, const uint8_t* bssid) {
+
+  if (radioOnAt == UINT64_MAX) {
+    radioOnAt = clockMicros;
+  }
+  if (bssid != nullptr && channel == AP_CHANNEL && memcmp(bssid, AP_BSSID, sizeof(AP_BSSID)) == 0) {
+    wifiAssociatedAt = clockMicros + current.wifiFastConnectMs * 1000;
+  } else if (bssid == nullptr) {
+    wifiAssociatedAt = clockMicros + current.wifiConnectMs * 1000;
+  }
+
+}
+
+void disconnectWifi() {
+
+  wifiAssociatedAt = UINT64_MAX;
+
+}
+
+// WIFI_OFF, the broker session is lost with the association
+void radioOff() {
+
+  if (radioOnAt != UINT64_MAX) {
+    radioOnMicros += clockMicros - radioOnAt;
+    radioOnAt = UINT64_MAX;
+  }
+  wifiAssociatedAt = UINT64_MAX;
+  mqttSession = false;
+
+}
+
+bool wifiConnected() {
+
+  return clockMicros >= wifiAssociatedAt;
+
+}
+
+const uint8_t* wifiBssid() {
+
+  return AP_BSSID;
+
+}
+
+int32_t wifiChannel() {
+
+  return AP_CHANNEL;
+
+}
+
+static bool linkDown(SimLink link) {
+
+  return current.link == link && reset == REASON_DEEP_SLEEP_AWAKE;
+
+}
+
+// one connection attempt, it always fails when the broker is down
+bool connectMqtt() {
+
+  advance(current.mqttConnectMs * 1000);
+  if (linkDown(LINK_BROKER_DOWN) || clockMicros < brokerBackAt) {
+    return false;
+  }
+  mqttSession = true;
+  return true;
+
+}
+
+bool mqttConnected() {
+
+  return mqttSession;
+
+}
+
+void subscribe(const char* topic) {
+
+  subscriptions.insert(topic);
+
+}
+
+/********************************** HOME ASSISTANT REPLICA *****************************************/
+// sensor.activate_water_pump_active, daily watering time
+static const char* HA_WATER_TIME = "21:35";
+void setOta(const SimOta& served) {
+
+  ota = served;
+  memset(otaDropped, 0, sizeof(otaDropped));
+
+}
+
+// magic of a gzip or of an ESP image in the first bytes, noise after them
+static uint8_t otaImageByte(uint32_t offset) {
+
+  static const uint8_t GZIP_HEADER[] = {0x1F, 0x8B, 0x08, 0x00};
+  static const uint8_t IMAGE_HEADER[] = {0xE9, 0x04, 0x02, 0x20};
+  if (offset < sizeof(IMAGE_HEADER)) {
+    return ota.gzip ? GZIP_HEADER[offset] : IMAGE_HEADER[offset];
+  }
+  uint32_t noise = offset * 2654435761u;
+  return static_cast<uint8_t>((noise >> 24) ^ (noise >> 11));
+
+}
+
+// cmnd/<id>/OTA payload of tools/ota_server.py for the image on the server
+std::string otaManifest() {
+
+  uint64_t digest[2];
+  digestBegin(digest);
+  for (uint32_t offset = 0; offset < ota.imageBytes; offset++) {
+    uint8_t byte = otaImageByte(offset) ^ (ota.badHash && offset == ota.imageBytes / 2 ? 1 : 0);
+    digestAdd(digest, &byte, 1);
+  }
+  char manifest[256];
+  snprintf(manifest, sizeof(manifest), "{\"url\":\"%s%s\",\"size\":%u,\"md5\":\"%s\",\"board\":\"%s\"}", OTA_SERVER_URL,
+           ota.gzip ? ".gz" : "", static_cast<unsigned int>(ota.imageBytes), digestHex(digest).c_str(), ota.board);
+  return manifest;
+
+}
+
+// two FNV-1a 64 with different offset bases, 32 hex digits like an MD5
+void digestBegin(uint64_t digest[2]) {
+
+  digest[0] = 14695981039346656037ULL;
+  digest[1] = 14695981039346656037ULL ^ 0x5A5A5A5A5A5A5A5AULL;
+
+}
+
+void digestAdd(uint64_t digest[2], const uint8_t* data, size_t size) {
+
+  for (size_t i = 0; i < size; i++) {
+    digest[0] = (digest[0] ^ data[i]) * 1099511628211ULL;
+    digest[1] = (digest[1] ^ data[i]) * 1099511628211ULL;
+  }
+
+}
+
+std::string digestHex(const uint64_t digest[2]) {
+
+  char hex[33];
+  snprintf(hex, sizeof(hex), "%016llx%016llx", static_cast<unsigned long long>(digest[0]), static_cast<unsigned long long>(digest[1]));
+  return hex;
+
+}
+
+// the response starts after the handshake, from the requested byte, a Range request gets 206
+int httpGet(uint32_t from, int& length) {
+
+  advance(HTTP_CONNECT_MICROS);
+  if (ota.imageBytes == 0 || !wifiConnected()) {
+    return -1;
+  }
+  result->otaRequests++;
+  if (from >= ota.imageBytes) {
+    return 416;
+  }
+  httpOpen = true;
+  httpFrom = from;
+  httpPosition = from;
+  httpStartMicros = clockMicros;
+  length = static_cast<int>(ota.imageBytes - from);
+  return from > 0 ? 206 : 200;
+
+}
+
+// end of the bytes this connection delivers, the next drop point or the end of the image
+static uint32_t httpEnd() {
+
+  uint32_t end = ota.imageBytes;
+  for (int i = 0; i < 2; i++) {
+    if (!otaDropped[i] && ota.dropAt[i] > httpFrom && ota.dropAt[i] < end) {
+      end = ota.dropAt[i];
+    }
+  }
+  return end;
+
+}
+
+int httpAvailable() {
+
+  if (!httpOpen) {
+    return 0;
+  }
+  uint64_t arrived = httpFrom + (clockMicros - httpStartMicros) * ota.bytesPerSecond / 1000000;
+  uint32_t end = httpEnd();
+  return static_cast<int>((arrived < end ? arrived : end) - httpPosition);
+
+}
+
+int httpRead(uint8_t* buffer, size_t size) {
+
+  int available = httpAvailable();
+  int count = static_cast<int>(size) < available ? static_cast<int>(size) : available;
+  for (int i = 0; i < count; i++) {
+    buffer[i] = otaImageByte(httpPosition + i);
+  }
+  httpPosition += count;
+  result->otaFetchedBytes += count;
+  // the link drops right after the last byte before the drop point
+  uint32_t end = httpEnd();
+  if (httpPosition == end && end < ota.imageBytes) {
+    for (int i = 0; i < 2; i++) {
+      otaDropped[i] = otaDropped[i] || ota.dropAt[i] == end;
+    }
+    httpOpen = false;
+  }
+  return count;
+
+}
+
+bool httpConnected() {
+
+  return httpOpen;
+
+}
+
+void httpClose() {
+
+  httpOpen = false;
+
+}
+
+void otaWritten(size_t bytes) {
+
+  result->otaWrittenBytes += bytes;
+
+}
+
+// HA local time, the first wake happens at 2026-10-17 21:30:00
+static std::string haTime() {
+
+  struct tm start = {};
+  start.tm_year = 2026 - 1900;
+  start.tm_mon = 9;
+  start.tm_mday = 17;
+  start.tm_hour = 21;
+  start.tm_min = 30;
+  time_t now = timegm(&start) + static_cast<time_t>((state->wallMicros + clockMicros) / 1000000);
+  char buf[32];
+  strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", gmtime(&now));
+  return buf;
+
+}
+
+// HA to station, through the faulty link
+static void haPublish(const std::string& topic, const std::string& payload) {
+
+  if (faultHits(faults.lossPercent)) {
+    return;
+  }
+  uint64_t due = clockMicros + current.haLatencyMs * 1000 + faultJitter();
+  if (fleet != nullptr) {
+    // the automation runs in the first slot HA is not running the automation of another station
+    uint64_t slotMicros = fleet->automationMs * 1000ULL;
+    uint64_t slot = (state->wallMicros + clockMicros + slotMicros - 1) / slotMicros;
+    while (slot < FLEET_HA_SLOTS && fleet->haBusy[slot]) {
+      slot++;
+    }
+    if (slot < FLEET_HA_SLOTS) {
+      fleet->haBusy[slot] = true;
+      due += (slot + 1) * slotMicros - (state->wallMicros + clockMicros);
+    }
+  }
+  if (faultHits(faults.reorderPercent)) {
+    due += REORDER_MICROS;
+  }
+  pending.push_back({due, topic, payload});
+  if (faultHits(faults.duplicatePercent)) {
+    pending.push_back({due + faultJitter(), topic, payload});
+  }
+  if (fleet != nullptr && fleet->logCount < FLEET_LOG_SIZE) {
+    SimFleetMessage& logged = fleet->log[fleet->logCount++];
+    logged.wallMicros = state->wallMicros + due;
+    logged.station = station;
+    snprintf(logged.topic, sizeof(logged.topic), "%s", topic.c_str());
+    snprintf(logged.payload, sizeof(logged.payload), "%s", payload.c_str());
+  }
+
+}
+
+// ACK payload echoes the sequence number of the acknowledged message like the HA package does
+static std::string haAck(const char* name, const std::string& payload) {
+
+  long seq = 0;
+  size_t pos = payload.find("\"seq\":");
+  if (pos != std::string::npos) {
+    seq = strtol(payload.c_str() + pos + 6, nullptr, 10);
+  }
+  return std::string("{\"value\":\"") + name + "\",\"seq\":" + std::to_string(seq) + "}";
+
+}
+
+// sensor.solarstation_config_tag
+static std::string haConfigTag() {
+
+  std::string tag = current.uploadMode ? "on|" : "off|";
+  tag += state->haPumpActive ? "on|" : "off|";
+  tag += std::to_string(current.pumpSeconds) + "|" + std::to_string(current.sleepMinutes) + "|" + std::to_string(current.batchWakes) + "|" + HA_WATER_TIME + "|0|";
+  return tag + std::to_string(current.sleepMinMinutes) + "|" + std::to_string(current.sleepMaxMinutes) + "|" + std::to_string(current.waterDeferHours) + "|" + std::to_string(current.zones);
+
+}
+
+static void haSendConfig(const std::string& id) {
+
+  std::string config = "{\"time\":\"" + haTime() + "\",\"upload_mode\":\"";
+  config += current.uploadMode ? "on" : "off";
+  config += "\",\"esp_sleep_time_minutes\":\"" + std::to_string(current.sleepMinutes);
+  config += "\",\"pump_active\":\"";
+  config += state->haPumpActive ? "on" : "off";
+  config += "\",\"pump_seconds\":\"" + std::to_string(current.pumpSeconds);
+  config += "\",\"pump_ml\":\"0"; // waterpump_dose_ml, the benchmark doses by time
+  config += "\",\"batch_wakes\":\"" + std::to_string(current.batchWakes);
+  config += "\",\"water_time\":\"" + std::string(HA_WATER_TIME);
+  config += "\",\"sleep_min_minutes\":\"" + std::to_string(current.sleepMinMinutes);
+  config += "\",\"sleep_max_minutes\":\"" + std::to_string(current.sleepMaxMinutes);
+  config += "\",\"water_defer_hours\":\"" + std::to_string(current.waterDeferHours);
+  config += "\",\"config_tag\":\"" + haConfigTag() + "\",\"zones\":[";
+  for (int zone = 0; zone < current.zones; zone++) {
+    config += std::string(zone > 0 ? "," : "") + "{\"seconds\":\"" + std::to_string(current.pumpSeconds) + "\",\"ml\":\"0\"}";
+  }
+  config += "]}";
+  haPublish("stat/" + id + "/CONFIG", config);
+
+}
+
+static void haReceive(const std::string& t, const std::string& payload);
+
+// a message published by a script or by the developer tools of HA, not by the automations
+void command(const char* topic, const std::string& payload) {
+
+  haPublish(topic, payload);
+
+}
+
+bool publish(const char* topic, const std::string& payload, bool streamed) {
+
+  // QoS 0 PUBLISH: fixed header, remaining length, topic length, topic and payload
+  size_t remaining = 2 + strlen(topic) + payload.length();
+  if (!streamed && MQTT_MAX_HEADER_SIZE + remaining > MQTT_MAX_PACKET_SIZE) {
+    result->oversizePublishes++;
+    return false;
+  }
+  result->publishCount++;
+  result->txBytes += 1 + (remaining < 128 ? 1 : 2) + remaining;
+  if (strstr(topic, "/STATE") != nullptr && payload.length() > result->stateBytes) {
+    result->stateBytes = payload.length();
+  }
+  if (linkDown(LINK_HA_DOWN) || !mqttSession || faultHits(faults.lossPercent)) {
+    return true;
+  }
+  haReceive(topic, payload);
+  if (faultHits(faults.duplicatePercent)) {
+    haReceive(topic, payload);
+  }
+  return true;
+
+}
+
+// station to HA, the automations of the HA package, they answer on the topics of the station that triggered them
+static void haReceive(const std::string& t, const std::string& payload) {
+
+  // tools/telemetry_bridge.py, MessagePack telemetry comes back as JSON on the topic without "/mp"
+  const std::string msgpackSuffix = "/mp";
+  if (t.length() > msgpackSuffix.length() && t.compare(t.length() - msgpackSuffix.length(), msgpackSuffix.length(), msgpackSuffix) == 0) {
+    JsonDocument doc;
+    if (deserializeMsgPack(doc, payload.data(), payload.length())) {
+      return;
+    }
+    std::string json;
+    serializeJson(doc, json);
+    haReceive(t.substr(0, t.length() - msgpackSuffix.length()), json);
+    return;
+  }
+  size_t idStart = t.find('/') + 1;
+  size_t idEnd = t.find('/', idStart);
+  if (idStart == 0 || idEnd == std::string::npos) {
+    return;
+  }
+  std::string id = t.substr(idStart, idEnd - idStart);
+  std::string topic = t.substr(0, idStart) + "+" + t.substr(idEnd);
+  std::string ackTopic = "stat/" + id + "/ACK";
+  if (topic == "stat/+/POWER") {
+    bool on = payload.find("\"state\":\"ON\"") != std::string::npos;
+    // config is pushed only when the station does not have the current one
+    bool configChanged = payload.find("\"config_tag\":\"" + haConfigTag() + "\"") == std::string::npos;
+    if (configChanged) {
+      haSendConfig(id);
+    }
+    std::string ack = haAck(on ? "sendOnState" : "sendOffState", payload);
+    if (on) {
+      ack.pop_back();
+      ack += std::string(",\"config_changed\":") + (configChanged ? "true" : "false") + ",\"time\":\"" + haTime() + "\"}";
+    }
+    haPublish(ackTopic, ack);
+  } else if (topic == "stat/+/PUMP_POWER") {
+    haPublish(ackTopic, payload == "ON" ? "sendWaterPumpPowerStateOn" : "sendWaterPumpPowerStateOff");
+  } else if (topic == "tele/+/STATE") {
+    haPublish(ackTopic, haAck("sendSensorState", payload));
+  } else if (topic == "stat/+/HISTORY") {
+    // the backfill script, records are [time, battery, battery_min, battery_max, pump_seconds, wakes, failed_wakes]
+    JsonDocument doc;
+    if (deserializeJson(doc, payload)) {
+      return;
+    }
+    static const char* const resolutions[] = {"wake", "hour", "day"};
+    int resolution = std::find_if(resolutions, resolutions + 3, [&doc](const char* res) { return doc["res"] == res; }) - resolutions;
+    result->historyChunks++;
+    result->historyLast = doc["last"] | false;
+    for (JsonVariant record : doc["records"].as<JsonArray>()) {
+      uint32_t time = record[0] | 0U;
+      if (time <= historyLastTime) {
+        result->historyDisorder++;
+      }
+      historyLastTime = time;
+      result->historyWakes += record[5] | 0U;
+      if (resolution < 3) {
+        result->historyRecords[resolution]++;
+      }
+    }
+  } else if (topic == "stat/+/OTA") {
+    // progress printed by tools/ota_server.py
+    JsonDocument doc;
+    if (deserializeJson(doc, payload)) {
+      return;
+    }
+    const char* error = doc["error"] | "";
+    snprintf(result->otaReport, sizeof(result->otaReport), "%s", error[0] != '\0' ? error : (doc["state"] | ""));
+    result->otaResumes = doc["resumes"] | 0U;
+    result->otaReportMs = clockMicros / 1000;
+  } else if (topic == "stat/+/PUMP_ACTIVE") {
+    state->haPumpActive = payload == "ON";
+    haSendConfig(id);
+    if (!state->haPumpActive) {
+      haPublish(ackTopic, "sendWaterPumpActiveStateOff");
+    }
+  }
+
+}
+
+static void deliverTo(void (*callback)(char*, uint8_t*, unsigned int), const std::string& topic, const std::string& payload) {
+
+  std::vector<char> topicBuffer(topic.begin(), topic.end());
+  topicBuffer.push_back('\0');
+  std::vector<uint8_t> payloadBuffer(payload.begin(), payload.end());
+  payloadBuffer.push_back('\0');
+  callback(topicBuffer.data(), payloadBuffer.data(), payload.length());
+
+}
+
+void deliver(void (*callback)(char*, uint8_t*, unsigned int)) {
+
+  std::stable_sort(pending.begin(), pending.end(), [](const PendingMessage& a, const PendingMessage& b) {
+    return a.due < b.due;
+  });
+  while (!pending.empty() && pending.front().due <= clockMicros) {
+    PendingMessage msg = pending.front();
+    pending.erase(pending.begin());
+    if (subscriptions.count(msg.topic) > 0) {
+      deliverTo(callback, msg.topic, msg.payload);
+    }
+  }
+  // the broker sends the messages for the other stations too, if this one subscribed to their topics
+  while (!foreign.empty() && foreign.front()->wallMicros <= state->wallMicros + clockMicros) {
+    const SimFleetMessage* msg = foreign.front();
+    foreign.erase(foreign.begin());
+    if (mqttSession && subscriptions.count(msg->topic) > 0) {
+      result->crossTalk++;
+      deliverTo(callback, msg->topic, msg->payload);
+    }
+  }
+
+}
+
+/********************************** HARDWARE *****************************************/
+int readAdc() {
+
+  adcSeed = adcSeed * 1103515245 + 12345;
+  uint32_t random = adcSeed >> 16;
+  int drift = static_cast<int>(current.batteryAdcPerHour * static_cast<int64_t>(state->wallMicros + clockMicros) / 3600000000LL);
+  int value = current.batteryAdc + drift + static_cast<int>(random % (2 * ADC_NOISE + 1)) - ADC_NOISE;
+  if (random % 8 == 0) {
+    value += (random & 0x100) ? ADC_SPIKE : -ADC_SPIKE;
+  }
+  if (std::find(pumpOn, pumpOn + PUMP_COUNT, true) != pumpOn + PUMP_COUNT) {
+    value -= ADC_PUMP_SAG;
+  }
+  advance(100); // one conversion
+  return value;
+
+}
+
+void startTimer(uint64_t micros, void (*isr)()) {
+
+  timerAt = clockMicros + micros;
+  timerIsr = isr;
+
+}
+
+void cancelTimer() {
+
+  timerIsr = nullptr;
+
+}
+
+void writePin(uint8_t pin, uint8_t val) {
+
+  const uint8_t* pump = std::find(PUMP_PINS, PUMP_PINS + PUMP_COUNT, pin);
+  if (pump == PUMP_PINS + PUMP_COUNT) {
+    return;
+  }
+  uint8_t i = pump - PUMP_PINS;
+  if (val == HIGH && !pumpOn[i]) {
+    pumpOn[i] = true;
+    pumpOnSince[i] = clockMicros;
+    if (current.link == LINK_BROKER_DROP && brokerBackAt == 0) {
+      mqttSession = false;
+      brokerBackAt = clockMicros + BROKER_DROP_MICROS;
+    }
+  } else if (val == LOW && pumpOn[i]) {
+    pumpOn[i] = false;
+    pumpOnMicros += clockMicros - pumpOnSince[i];
+  }
+
+}
+
+// Hardware UART FIFO is 128 bytes, once it is full Serial.print() blocks until there is room
+static const uint64_t UART_FIFO_BYTES = 128;
+
+void chargeUart(size_t bytes, unsigned long baud) {
+
+  const uint64_t fifoBytes = UART_FIFO_BYTES;
+  const uint64_t byteMicros = 10ULL * 1000000ULL / baud;
+  uint64_t start = std::max(uartIdleAt, clockMicros);
+  uartIdleAt = start + bytes * byteMicros;
+  uint64_t fifoDrainedAt = clockMicros + fifoBytes * byteMicros;
+  if (uartIdleAt > fifoDrainedAt) {
+    advance(uartIdleAt - fifoDrainedAt);
+  }
+
+}
+
+// free bytes in the UART FIFO, what Serial.availableForWrite() returns
+int uartRoom(unsigned long baud) {
+
+  const uint64_t byteMicros = 10ULL * 1000000ULL / baud;
+  uint64_t queued = uartIdleAt > clockMicros ? (uartIdleAt - clockMicros + byteMicros - 1) / byteMicros : 0;
+  return queued >= UART_FIFO_BYTES ? 0 : static_cast<int>(UART_FIFO_BYTES - queued);
+
+}
+
+[[noreturn]] void sleep(uint64_t micros) {
+
+  finish(false, micros);
+
+}
+
+// the eboot command is 32 words at the start of the RTC user memory: magic, action, arguments and a checksum.
+// The checksum is a stand-in for the CRC32 of eboot.
+const uint32_t EBOOT_MAGIC = 0xEB001000;
+const uint32_t EBOOT_ACTION_COPY_RAW = 0x00000002;
+const size_t EBOOT_COMMAND_WORDS = 32;
+
+static uint32_t ebootChecksum(const uint32_t* command) {
+
+  uint32_t sum = 0;
+  for (size_t i = 0; i < EBOOT_COMMAND_WORDS - 1; i++) {
+    sum = (sum ^ command[i]) * 16777619UL;
+  }
+  return sum;
+
+}
+
+// Update.end() of the ESP8266 core asks eboot to copy the new image on the next boot
+void ebootCommand() {
+
+  uint32_t* command = state->rtcMemory;
+  memset(command, 0, EBOOT_COMMAND_WORDS * sizeof(uint32_t));
+  command[0] = EBOOT_MAGIC;
+  command[1] = EBOOT_ACTION_COPY_RAW;
+  command[EBOOT_COMMAND_WORDS - 1] = ebootChecksum(command);
+
+}
+
+// ESP.restart() after an update, the wake ends without a deep sleep.
+// The new firmware runs only if nothing has overwritten the eboot command since Update.end()
+[[noreturn]] void restart() {
+
+  const uint32_t* command = state->rtcMemory;
+  result->otaRestarted = command[0] == EBOOT_MAGIC && command[EBOOT_COMMAND_WORDS - 1] == ebootChecksum(command);
+  finish(false, 0);
+
+}
+
+}
@@ -0,0 +1,214 @@
+/*
+  SimWorld.h - Simulated clock, battery, broker and Home Assistant for the native benchmark
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+
+  NOTE: one wake cycle runs in one forked process, deep sleep ends the process exactly like
+  it resets the RAM on the microcontroller. The Home Assistant replica answers the firmware
+  with the same automations found in home_assistant_solarstation_package.yaml.
+*/
+
+#ifndef _DPSOFTWARE_SIM_WORLD_H
+#define _DPSOFTWARE_SIM_WORLD_H
+
+#include <cstdint>
+#include <string>
+
+// Link failures start from the first timer wake, the power on wake finds HA up and running
+enum SimLink {
+  LINK_UP,
+  LINK_BROKER_DOWN, // MQTT connection refused
+  LINK_HA_DOWN, // broker up, HA never answers
+  LINK_BROKER_DROP // the broker goes away for 20 seconds when the pump starts, power on wake included
+};
+
+struct SimScenario {
+  const char* name;
+  int batteryAdc; // raw analogRead() value of the battery divider at rest
+  bool pumpActive; // water_pump_active switch in Home Assistant
+  int pumpSeconds; // waterpump_activation_seconds in Home Assistant
+  int zones; // zones configured in Home Assistant, every one of them for pumpSeconds
+  bool uploadMode; // upload_mode switch in Home Assistant
+  int sleepMinutes; // esp_sleep_time_minutes in Home Assistant
+  int batchWakes; // solarstation_batch_wakes in Home Assistant
+  unsigned long wifiConnectMs; // full Wi-Fi scan and association
+  unsigned long wifiFastConnectMs; // association with known BSSID and channel, no scan
+  unsigned long mqttConnectMs; // MQTT connect and subscriptions
+  unsigned long haLatencyMs; // broker + automation round trip for every answer
+  unsigned long budgetMs; // awake time above this value is reported as a regression
+  SimLink link;
+  int batteryAdcPerHour; // battery drift, negative in a shady spot
+  int sleepMinMinutes; // adaptive sleep bounds in Home Assistant, 0 = not sent
+  int sleepMaxMinutes;
+  int waterDeferHours; // waterpump_defer_hours in Home Assistant, 0 = not sent
+  uint32_t bootReason; // reset reason of the first wake, REASON_EXT_SYS_RST is the TTP223 button pressed during deep sleep
+};
+
+// LittleFS partition, a fixed number of files of a fixed maximum size, a free slot has an empty path
+const int SIM_FLASH_FILES = 8;
+const size_t SIM_FLASH_FILE_SIZE = 16384;
+struct SimFlashFile {
+  char path[32];
+  uint32_t size;
+  uint8_t data[SIM_FLASH_FILE_SIZE];
+};
+struct SimFlash {
+  SimFlashFile files[SIM_FLASH_FILES];
+  uint32_t mounts;
+  uint32_t bytesWritten;
+};
+
+// State that survives deep sleep: RTC memory and flash on the station side and the entities on the Home Assistant side
+struct SimPersistentState {
+  uint32_t rtcMemory[128];
+  SimFlash flash;
+  bool haPumpActive;
+  uint64_t wallMicros; // time elapsed since the first wake, deep sleeps included
+  uint64_t sleepMicros; // last deep sleep, 0 is forever
+};
+
+// Faults injected by the broker stand-in, 0 everywhere is a perfect link. Loss and duplication hit the messages
+// in both directions, reordering and jitter hit the messages sent by HA, the round trip is delayed the same way.
+struct SimFaults {
+  const char* name;
+  int lossPercent; // the message never arrives
+  int duplicatePercent; // the message arrives twice
+  int reorderPercent; // the message is held back 500ms, the following ones overtake it
+  unsigned long jitterMs; // random extra latency, from 0 to jitterMs, on top of the HA latency
+};
+
+// One broker and one HA serve every station of a fleet. HA runs one automation at a time, a station waits for the runs
+// triggered by the others. Every message HA publishes is logged, a station receives the ones on the topics it subscribed
+// to, whichever station they were meant for. Times are on the wall clock of the fleet, every station starts at 0.
+const int FLEET_HA_SLOTS = 360000; // one hour of 10ms runs
+const int FLEET_LOG_SIZE = 8192;
+struct SimFleetMessage {
+  uint64_t wallMicros; // delivery time
+  uint16_t station;
+  char topic[64];
+  char payload[768];
+};
+struct SimFleet {
+  unsigned long automationMs; // one automation run, HA time is sliced in runs of this length
+  bool haBusy[FLEET_HA_SLOTS];
+  int logCount;
+  SimFleetMessage log[FLEET_LOG_SIZE];
+};
+
+// Firmware server of tools/ota_server.py behind a weak Wi-Fi link: a fixed throughput and connections that drop once
+// at the given offsets of the image. The image is generated from its size, its hash is SimWorld::digestHex().
+struct SimOta {
+  const char* name;
+  const char* board; // board in the manifest
+  uint32_t imageBytes;
+  bool gzip; // compressed with gzip -9, the image starts with the gzip magic
+  bool badHash; // the manifest carries the hash of another build
+  uint32_t bytesPerSecond;
+  uint32_t dropAt[2]; // image offsets where the connection drops, 0 = none
+  const char* expect; // last state reported on stat/<id>/OTA, "done" or the error
+};
+
+struct SimResult {
+  bool slept;
+  bool timedOut;
+  unsigned long awakeMs;
+  unsigned long radioMs; // from the first Wi-Fi association attempt to deep sleep
+  unsigned int publishCount;
+  unsigned long txBytes; // MQTT PUBLISH packets sent by the station, header and topic included
+  unsigned int oversizePublishes; // packets larger than MQTT_MAX_PACKET_SIZE, PubSubClient drops them without sending
+  size_t stateBytes; // largest STATE payload sent
+  int numberOfAttemps;
+  unsigned long pumpOnMs;
+  uint64_t sleepMicros;
+  unsigned long chargeMicroAh; // charge of the wake estimated by the firmware energy accountant
+  uint8_t wakeState; // state of the wake cycle state machine when the station went to sleep
+  bool backedOff; // the wake ran out of connection budget
+  bool interactive; // the wake has been recognized as a press of the button
+  bool emptyCell; // resting battery below the ESP cutoff, a press of the button must not open a session
+  unsigned int crossTalk; // messages received on this station topics that HA published for another station
+  unsigned int historyChunks; // stat/<id>/HISTORY messages received by HA
+  unsigned int historyRecords[3]; // records received by resolution: wake, hour, day
+  unsigned long historyWakes; // wakes behind the records received
+  unsigned int historyDisorder; // records not newer than the one received before them
+  bool historyLast; // the chunk flagged as the last one has been received
+  unsigned int otaRequests; // HTTP GETs served by the firmware server
+  unsigned long otaFetchedBytes; // image bytes read by the station
+  unsigned long otaWrittenBytes; // image bytes written to the update partition
+  bool otaRestarted; // the station restarted on the new firmware, eboot found its copy command in RTC memory
+  char otaReport[12]; // last state or error reported on stat/<id>/OTA
+  unsigned int otaResumes; // resumes in the last report
+  unsigned long otaReportMs; // time of the last report since boot
+};
+
+// shared with the forked wake cycles, persistent state survives from one wake to the next one
+struct SimSharedMemory {
+  SimPersistentState persistent;
+  SimResult result;
+};
+
+namespace SimWorld {
+  // safety net for scenarios that never reach deep sleep, upload mode needs more than one hour
+  const uint64_t MAX_SIMULATED_MICROS = 2ULL * 3600ULL * 1000000ULL;
+
+  // called right before the wake cycle ends, used to snapshot firmware globals into the result
+  extern void (*onSleep)(SimResult& result);
+
+  void begin(const SimScenario& scenario, uint32_t resetReason, SimPersistentState* persistent, SimResult* result);
+  void setFaults(const SimFaults& faults);
+  void setStation(uint16_t station, SimFleet* fleet); // fleet is nullptr for a station alone
+  void setOta(const SimOta& ota);
+  void pressButton(SimPersistentState& persistent, uint64_t micros);
+  std::string otaManifest();
+  void macAddress(uint8_t* mac);
+  const SimScenario& scenario();
+  uint32_t resetReason();
+  SimPersistentState& persistent();
+  uint64_t now();
+  void advance(uint64_t micros);
+  void connectWifi();
+  void beginWifi(int32_t channel, const uint8_t* bssid);
+  void disconnectWifi();
+  void radioOff();
+  bool wifiConnected();
+  const uint8_t* wifiBssid();
+  int32_t wifiChannel();
+  bool connectMqtt();
+  bool mqttConnected();
+  void subscribe(const char* topic);
+  void command(const char* topic, const std::string& payload);
+  bool publish(const char* topic, const std::string& payload, bool streamed = false);
+  void deliver(void (*callback)(char*, uint8_t*, unsigned int));
+  void startTimer(uint64_t micros, void (*isr)());
+  void cancelTimer();
+  void writePin(uint8_t pin, uint8_t val);
+  int readAdc();
+  void chargeUart(size_t bytes, unsigned long baud);
+  int uartRoom(unsigned long baud);
+  int httpGet(uint32_t from, int& length);
+  int httpAvailable();
+  int httpRead(uint8_t* buffer, size_t size);
+  bool httpConnected();
+  void httpClose();
+  void otaWritten(size_t bytes);
+  void digestBegin(uint64_t digest[2]);
+  void digestAdd(uint64_t digest[2], const uint8_t* data, size_t size);
+  std::string digestHex(const uint64_t digest[2]);
+  void ebootCommand();
+  [[noreturn]] void restart();
+  [[noreturn]] void sleep(uint64_t micros);
+}
+
+#endif
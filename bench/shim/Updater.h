@@ -0,0 +1,42 @@
+/*
+  Updater.h - Host-native stand-in for the Update class of the ESP8266 core
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+
+  NOTE: nothing is flashed, the bytes written are counted and hashed. The hash is a stand-in of MD5
+  computed by SimWorld::digest(), the manifests of the benchmark carry the same one.
+*/
+
+#ifndef _DPSOFTWARE_NATIVE_UPDATER_H
+#define _DPSOFTWARE_NATIVE_UPDATER_H
+
+#include <Arduino.h>
+
+class UpdaterClass {
+public:
+  bool begin(size_t size);
+  bool setMD5(const char* expected);
+  size_t write(uint8_t* data, size_t len);
+  bool end(bool evenIfRemaining = false);
+private:
+  size_t size = 0;
+  size_t written = 0;
+  uint64_t digest[2] = {};
+  std::string expectedMd5;
+};
+extern UpdaterClass Update;
+
+#endif
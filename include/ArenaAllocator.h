@@ -0,0 +1,68 @@
+/*
+  ArenaAllocator.h - Fixed size ArduinoJson allocator for incoming MQTT messages
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+
+  NOTE: memory comes from a static buffer and it is never returned to the heap, reset() frees everything
+  at once before parsing the next message, this way parsing a message does not fragment the heap.
+*/
+
+#ifndef _DPSOFTWARE_ARENA_ALLOCATOR_H
+#define _DPSOFTWARE_ARENA_ALLOCATOR_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#ifndef JSON_ARENA_SIZE
+#define JSON_ARENA_SIZE 2560
+#endif
+
+// ArduinoJson 7 on a 32 bit board: the first value allocates a whole pool of 128 slots of 8 bytes, every string is
+// a node with an 8 bytes header and its terminator, the node of the string being parsed starts at 31 chars
+const size_t JSON_POOL_SLOTS = 128;
+const size_t JSON_SLOT_BYTES = 8;
+const size_t JSON_STRING_NODE_BYTES = 8 + 1;
+const size_t JSON_STRING_BUILDER_CHARS = 31;
+
+// worst case arena bytes to parse a message, every block pays its size header and the 8 bytes alignment
+constexpr size_t jsonArenaBytes(size_t slots, size_t strings, size_t chars) {
+
+  return (slots + JSON_POOL_SLOTS - 1) / JSON_POOL_SLOTS * (sizeof(size_t) + JSON_POOL_SLOTS * JSON_SLOT_BYTES)
+      + strings * (sizeof(size_t) + JSON_STRING_NODE_BYTES + 7) + chars
+      + sizeof(size_t) + JSON_STRING_NODE_BYTES + JSON_STRING_BUILDER_CHARS + 7;
+
+}
+
+class ArenaAllocator : public ArduinoJson::Allocator {
+
+  public:
+    void* allocate(size_t size) override;
+    void deallocate(void* ptr) override;
+    void* reallocate(void* ptr, size_t newSize) override;
+    void reset();
+
+  private:
+    // every block is preceded by its size, reallocate() needs it to copy the block
+    struct Header {
+      size_t size;
+    };
+    alignas(8) uint8_t buffer[JSON_ARENA_SIZE];
+    size_t used = 0;
+    uint8_t* last = nullptr; // most recent block, it can grow and shrink in place
+
+};
+
+#endif
@@ -0,0 +1,51 @@
+/*
+  BatterySampler.h - Oversampled and calibrated battery voltage
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+
+  NOTE: every reading is a burst of samples, the lowest and the highest quarter are discarded and
+  the rest is averaged. The resting value is sampled once per wake before the radio is powered up,
+  the under-load value is sampled while the water pump is running.
+*/
+
+#ifndef _DPSOFTWARE_BATTERY_SAMPLER_H
+#define _DPSOFTWARE_BATTERY_SAMPLER_H
+
+#include <Arduino.h>
+#include "BoardTraits.h"
+
+const uint8_t BATTERY_RESTING_SAMPLES = 16;
+const uint8_t BATTERY_LOAD_SAMPLES = 4;
+
+class BatterySampler {
+
+  public:
+    int restingMv = 0; // battery voltage with the radio and the pump off, sampled once per wake
+    int loadMv = 0; // lowest battery voltage seen while the water pump is running, 0 if never sampled
+    void begin(uint8_t pin);
+    int sampleResting();
+    int sampleLoad();
+
+  private:
+    uint8_t pin;
+    int sampleMv(uint8_t samples);
+    int readMv();
+
+};
+
+extern BatterySampler batterySampler;
+
+#endif
@@ -0,0 +1,385 @@
+/*
+  BoardTraits.h - Compile time description of the supported boards
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+
+  NOTE: every supported board is a traits struct with its pins, battery divider, ADC and thresholds in millivolts,
+  plus the few calls that differ from board to board. The build env selects one of them as Board and the sketch
+  only uses Board, adding a board (an ESP32-C3 for example) means adding its struct and its line in the selection.
+*/
+
+#ifndef _DPSOFTWARE_BOARD_TRAITS_H
+#define _DPSOFTWARE_BOARD_TRAITS_H
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#if defined(ESP8266)
+#include <ESP8266WiFi.h>
+#else
+#include <esp_attr.h>
+#include <esp_sleep.h>
+#include <esp_system.h>
+#include <esp_pm.h>
+#endif
+
+// Trim of the divider ratio in ‰ to absorb the resistor tolerances,
+// measure the battery with a multimeter and set it to multimeter / reported * 1000
+#ifndef BATTERY_CALIBRATION_PERMILLE
+#define BATTERY_CALIBRATION_PERMILLE 1000
+#endif
+
+// Battery voltage divider, top resistor between the battery and the ADC pin, bottom resistor between the ADC pin and GND
+struct BatteryDivider {
+  uint32_t topOhm;
+  uint32_t bottomOhm;
+
+  constexpr uint32_t batteryMv(uint32_t pinMv) const {
+    return (uint64_t) pinMv * (topOhm + bottomOhm) * BATTERY_CALIBRATION_PERMILLE / ((uint64_t) bottomOhm * 1000);
+  }
+
+  constexpr uint32_t pinMv(uint32_t batteryMv) const {
+    return (uint64_t) batteryMv * bottomOhm * 1000 / ((uint64_t) (topOhm + bottomOhm) * BATTERY_CALIBRATION_PERMILLE);
+  }
+};
+
+// Why the chip is running, setup() takes a different path for every cause
+enum ResetCause : uint8_t {
+  RESET_POWER_ON, // fresh power on, the RTC memory is lost
+  RESET_TIMER, // deep sleep timer
+  RESET_BUTTON, // TTP223 on the reset pin
+  RESET_BROWNOUT, // supply dropped below the brown-out threshold
+  RESET_CRASH, // watchdog, exception or software restart
+  RESET_CAUSE_COUNT
+};
+
+#if defined(ESP8266)
+// Lolin D1 Mini, ESP8266EX running at 80MHz
+struct Esp8266Board {
+  static constexpr const char* FIRMWARE_TARGET = "solarstation_esp8266"; // PlatformIO environment, checked against the OTA manifest
+  static constexpr uint8_t LED_PIN = LED_BUILTIN; // Pin used for turning off the integrated LED
+  static constexpr uint8_t BATTERY_PIN = A0;
+  static constexpr uint8_t ZONE_PINS[] = {D5, D6, D7}; // the first one is the water pump
+  static constexpr BatteryDivider DIVIDER = {22000 + 4700, 100000};
+  static constexpr uint32_t ADC_FULL_SCALE_MV = 3268; // A0 of the D1 Mini, 1V ADC behind the on board 220kΩ/100kΩ divider
+  static constexpr uint32_t ADC_MAX = 1024;
+  static constexpr uint16_t WATER_PUMP_CUTOFF_MV = 3300;
+  static constexpr uint16_t ESP_CUTOFF_MV = 3000;
+  // estimated battery current of the whole board, see EnergyAccountant.h
+  static constexpr uint16_t AWAKE_MA = 20;
+  static constexpr uint16_t WIFI_MA = 80;
+  static constexpr uint16_t MQTT_MA = 75;
+  static constexpr uint16_t ACK_WAIT_MA = 70;
+  static constexpr uint16_t SLEEP_UA = 100; // step up modules and LDO included
+  static constexpr unsigned long IDLE_POLL_MS = 10; // loop() polls MQTT at this rate while nothing happens
+  // Update.end() leaves the eboot copy command in the first 128 bytes of the RTC user memory, RtcData must not overwrite it
+  static constexpr bool OTA_KEEPS_RTC = false;
+  static inline volatile bool eventPending = false;
+
+  static void beginSerial() {
+
+    Serial.begin(SERIAL_RATE);
+
+  }
+
+  // the CPU already runs at 80MHz, there is no light sleep while the station is connected
+  static void beginPowerSave() {
+  }
+
+  // idle until the next poll, an event raised since the last wait skips it
+  static void waitForEvent(unsigned long millis) {
+
+    if (!eventPending) {
+      delay(millis);
+    }
+    eventPending = false;
+
+  }
+
+  // MQTT message or pump event, safe to call from an interrupt
+  static void IRAM_ATTR notifyEvent() {
+
+    eventPending = true;
+
+  }
+
+  static void beginLed() {
+
+    pinMode(LED_PIN, OUTPUT);
+    ledOff();
+
+  }
+
+  static void ledOff() {
+
+    digitalWrite(LED_PIN, HIGH);
+
+  }
+
+  static void beginBatteryPin(uint8_t) {
+  }
+
+  static uint32_t readPinMv(uint8_t pin) {
+
+    return (uint32_t) analogRead(pin) * ADC_FULL_SCALE_MV / ADC_MAX;
+
+  }
+
+  static uint32_t freeHeap() {
+
+    return ESP.getFreeHeap();
+
+  }
+
+  static uint32_t largestFreeBlock() {
+
+    return ESP.getMaxFreeBlockSize();
+
+  }
+
+  // the core paints the loop stack at boot, the bytes still painted have never been used
+  static uint32_t stackFree() {
+
+    return ESP.getFreeContStack();
+
+  }
+
+  // there is no brown-out reset on the ESP8266, a chip that browns out restarts like on a fresh power on.
+  // The deep sleep timer resets the chip through the reset pin, a press of the button during deep sleep
+  // is reported as a timer wake too, the sketch tells them apart with the sleep it armed, see isEarlyWake().
+  static ResetCause resetCause() {
+
+    switch (ESP.getResetInfoPtr()->reason) {
+      case REASON_DEFAULT_RST: return RESET_POWER_ON;
+      case REASON_DEEP_SLEEP_AWAKE: return RESET_TIMER;
+      case REASON_EXT_SYS_RST: return RESET_BUTTON;
+      default: return RESET_CRASH;
+    }
+
+  }
+
+  // LittleFS formats the partition when the mount fails, a new board has a blank one
+  static bool mountFlash() {
+
+    return LittleFS.begin();
+
+  }
+
+  // first bytes of an OTA image, eboot inflates the images compressed with gzip -9 on the next boot
+  static bool otaImageValid(const uint8_t* header) {
+
+    return header[0] == 0xE9 || (header[0] == 0x1F && header[1] == 0x8B);
+
+  }
+
+  // the radio is on at boot, wakes that don't use it turn it off
+  static void radioOff() {
+
+    WiFi.mode(WIFI_OFF);
+
+  }
+
+  // 0 means sleep forever or until the capacitive button is pressed
+  static void deepSleep(uint64_t micros) {
+
+    ESP.deepSleep(micros);
+
+  }
+};
+#else
+// Calls shared by the ESP32 family, the ADC reading is calibrated with the eFuse values
+struct Esp32Family {
+  // Wi-Fi modem sleep delivers the packets at every DTIM beacon (~100ms), polling MQTT faster only wakes up the CPU for nothing
+  static constexpr unsigned long IDLE_POLL_MS = 50;
+  static constexpr int CPU_MAX_MHZ = 80; // lowest clock that keeps Wi-Fi running
+  static constexpr int CPU_MIN_MHZ = 40; // crystal clock, used while every task is blocked
+  static inline TaskHandle_t controllerTask = nullptr;
+  static constexpr uint32_t POWERED_MARKER = 0x534F4C50; // "SOLP"
+  static constexpr bool OTA_KEEPS_RTC = true; // the new image is selected in the otadata partition, RTC memory is free
+
+  static void beginSerial() {
+
+    Serial.begin(SERIAL_RATE);
+
+  }
+
+  // loop() is the controller task, it blocks on a notification between events. While it is blocked the power
+  // manager lowers the clock and, with tickless idle, drops into automatic light sleep, timers and Wi-Fi wake it up.
+  static void beginPowerSave() {
+
+    controllerTask = xTaskGetCurrentTaskHandle();
+#if CONFIG_PM_ENABLE
+    esp_pm_config_t pm = {};
+    pm.max_freq_mhz = CPU_MAX_MHZ;
+    pm.min_freq_mhz = CPU_MIN_MHZ;
+    pm.light_sleep_enable = true;
+    if (esp_pm_configure(&pm) == ESP_OK) {
+      return;
+    }
+#endif
+    // core built without power management, at least don't run at 240MHz
+    setCpuFrequencyMhz(CPU_MAX_MHZ);
+
+  }
+
+  // block the controller task until an event is notified or the poll interval expires
+  static void waitForEvent(unsigned long millis) {
+
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(millis));
+
+  }
+
+  // MQTT message or pump event, called by the controller task itself or by the esp_timer task
+  static void notifyEvent() {
+
+    if (controllerTask != nullptr) {
+      xTaskNotifyGive(controllerTask);
+    }
+
+  }
+
+  static void beginLed() {
+
+    ledOff();
+
+  }
+
+  static void ledOff() {
+
+    rgbLedWrite(LED_BUILTIN, 0, 0, 0);
+
+  }
+
+  static void beginBatteryPin(uint8_t pin) {
+
+    pinMode(pin, INPUT); // it is necessary to declare the input pin
+    analogSetPinAttenuation(pin, ADC_11db); // up to 3.1V on the ADC pin
+
+  }
+
+  static uint32_t readPinMv(uint8_t pin) {
+
+    return analogReadMilliVolts(pin);
+
+  }
+
+  static uint32_t freeHeap() {
+
+    return ESP.getFreeHeap();
+
+  }
+
+  static uint32_t largestFreeBlock() {
+
+    return ESP.getMaxAllocHeap();
+
+  }
+
+  // high-water mark of the loop task, in bytes on the ESP-IDF FreeRTOS
+  static uint32_t stackFree() {
+
+    return uxTaskGetStackHighWaterMark(nullptr);
+
+  }
+
+  // the EN pin resets the chip like a power on, RTC memory that is not initialized at boot and still holds
+  // the marker of the previous boot tells that the power never went away
+  static ResetCause resetCause() {
+
+    static RTC_NOINIT_ATTR uint32_t poweredMarker;
+    bool powered = poweredMarker == POWERED_MARKER;
+    poweredMarker = POWERED_MARKER;
+    if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER) {
+      return RESET_TIMER;
+    }
+    switch (esp_reset_reason()) {
+      case ESP_RST_POWERON: return powered ? RESET_BUTTON : RESET_POWER_ON;
+      case ESP_RST_EXT: return RESET_BUTTON;
+      case ESP_RST_BROWNOUT: return RESET_BROWNOUT;
+      default: return RESET_CRASH;
+    }
+
+  }
+
+  // the "spiffs" partition of the partition table, formatted when the mount fails
+  static bool mountFlash() {
+
+    return LittleFS.begin(true);
+
+  }
+
+  // esp_image_header_t, the chip ID keeps the image of another ESP32 out, the bootloader can't inflate compressed images
+  static bool otaImageValid(const uint8_t* header) {
+
+    return header[0] == 0xE9 && (header[12] | header[13] << 8) == CONFIG_IDF_FIRMWARE_CHIP_ID;
+
+  }
+
+  // the radio stays off until bootstrapSetup() turns it on
+  static void radioOff() {
+  }
+
+  // 0 means sleep forever or until the capacitive button is pressed
+  static void deepSleep(uint64_t micros) {
+
+    if (micros == 0) {
+      esp_deep_sleep_start();
+    }
+    ESP.deepSleep(micros);
+
+  }
+};
+
+// Lolin S3 Mini
+struct Esp32S3Board : Esp32Family {
+  static constexpr const char* FIRMWARE_TARGET = "solarstation"; // PlatformIO environment, checked against the OTA manifest
+  static constexpr uint8_t BATTERY_PIN = 2;
+  static constexpr uint8_t ZONE_PINS[] = {12, 13, 14}; // the first one is the water pump
+  static constexpr BatteryDivider DIVIDER = {22000 + 10000 + 4700, 100000};
+  static constexpr uint32_t ADC_FULL_SCALE_MV = 3100; // 11dB attenuation
+  static constexpr uint16_t WATER_PUMP_CUTOFF_MV = 3700;
+  static constexpr uint16_t ESP_CUTOFF_MV = 3000; // same cell as the ESP8266 board
+  // estimated battery current of the whole board, see EnergyAccountant.h
+  static constexpr uint16_t AWAKE_MA = 25; // 80MHz
+  static constexpr uint16_t WIFI_MA = 110;
+  static constexpr uint16_t MQTT_MA = 100;
+  static constexpr uint16_t ACK_WAIT_MA = 35; // automatic light sleep between DTIM beacons
+  static constexpr uint16_t SLEEP_UA = 60; // step up modules and LDO included
+
+  // USB CDC serial, don't block when no host is listening
+  static void beginSerial() {
+
+    Serial.setTxTimeoutMs(0);
+    Serial.begin(SERIAL_RATE);
+
+  }
+};
+#endif
+
+#if defined(ESP8266)
+using Board = Esp8266Board;
+#elif CONFIG_IDF_TARGET_ESP32S3
+using Board = Esp32S3Board;
+#else
+#error "Unsupported board, add its traits to BoardTraits.h"
+#endif
+
+// a cutoff outside of the ADC range would never trigger
+static_assert(Board::DIVIDER.pinMv(Board::WATER_PUMP_CUTOFF_MV) < Board::ADC_FULL_SCALE_MV, "water pump cutoff is out of the ADC range");
+static_assert(Board::ESP_CUTOFF_MV < Board::WATER_PUMP_CUTOFF_MV, "ESP cutoff must be lower than the water pump cutoff");
+// cutoffs are cell voltages, a lithium cell is never used below 2.5V, a lower value is an ADC reading
+static_assert(Board::ESP_CUTOFF_MV >= 2500, "ESP cutoff is not a cell voltage in millivolts");
+
+#endif
@@ -0,0 +1,79 @@
+/*
+  EnergyAccountant.h - Charge used by every wake, estimated from the time spent in every phase
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+
+  NOTE: there is no current sensor on the station, the charge is estimated by timing every phase of the wake
+  (Wi-Fi association, MQTT connection, waiting for HA, pump on) and multiplying it by the board current
+  of that phase. Measure the currents with a USB meter once and override them with the build flags below.
+*/
+
+#ifndef _DPSOFTWARE_ENERGY_ACCOUNTANT_H
+#define _DPSOFTWARE_ENERGY_ACCOUNTANT_H
+
+#include <Arduino.h>
+#include "BoardTraits.h"
+#include "RtcStore.h"
+
+// Battery current in every phase, defaults are the estimates of the board in BoardTraits.h
+#ifndef ENERGY_AWAKE_MA
+#define ENERGY_AWAKE_MA Board::AWAKE_MA // CPU on, radio off
+#endif
+#ifndef ENERGY_WIFI_MA
+#define ENERGY_WIFI_MA Board::WIFI_MA
+#endif
+#ifndef ENERGY_MQTT_MA
+#define ENERGY_MQTT_MA Board::MQTT_MA
+#endif
+#ifndef ENERGY_ACK_WAIT_MA
+#define ENERGY_ACK_WAIT_MA Board::ACK_WAIT_MA
+#endif
+#ifndef ENERGY_SLEEP_UA
+#define ENERGY_SLEEP_UA Board::SLEEP_UA
+#endif
+// Battery current drawn for every mA used by a pump or a valve, 8.66V / 3.7V / 90% MT3608 efficiency
+#ifndef PUMP_STEP_UP_PERMILLE
+#define PUMP_STEP_UP_PERMILLE 2600
+#endif
+
+// Radio phases of a wake, the pump is accounted on its own since it runs together with them
+enum EnergyPhase : uint8_t {
+  ENERGY_AWAKE, // radio off, sampling the battery, sample only wakes, offline watering
+  ENERGY_WIFI, // association, reconnections included
+  ENERGY_MQTT, // broker connection, reconnections included
+  ENERGY_ACK_WAIT, // connected, waiting for the config and the ACKs of HA
+  ENERGY_PHASES
+};
+
+class EnergyAccountant {
+
+  public:
+    void enter(EnergyPhase phase);
+    void addPump(unsigned long millis, uint16_t supplyMa);
+    void close(EnergyStats& stats, uint64_t sleepMicros);
+
+  private:
+    EnergyPhase phase = ENERGY_AWAKE; // the board boots with the radio off, millis() starts from 0
+    unsigned long phaseStartMillis = 0;
+    unsigned long phaseMillis[ENERGY_PHASES] = {};
+    unsigned long pumpMillis = 0;
+    uint64_t pumpMaMillis = 0;
+
+};
+
+extern EnergyAccountant energyAccountant;
+
+#endif
@@ -0,0 +1,74 @@
+/*
+  HealthProfiler.h - Loop latency histogram, heap and stack watermarks
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+
+  NOTE: always on and cheap, two micros() reads per loop and per send, the free heap is read once per loop
+  to keep its minimum. The largest free block and the stack high-water mark are read only when the section
+  is added to a STATE message, once per wake and every HEALTH_REPORT_SECONDS in upload mode.
+  Everything is counted from the boot of this wake, an upload mode session is one long wake.
+*/
+
+#ifndef _DPSOFTWARE_HEALTH_PROFILER_H
+#define _DPSOFTWARE_HEALTH_PROFILER_H
+
+#include <Arduino.h>
+#include "BoardTraits.h"
+
+// The health section is added to the STATE messages sent at least this many seconds apart
+#ifndef HEALTH_REPORT_SECONDS
+#define HEALTH_REPORT_SECONDS 60
+#endif
+
+// loop() iterations shorter than 1, 5, 10, 50, 100, 500, 1000 milliseconds, the last bucket counts the longer ones
+const uint8_t LOOP_HISTOGRAM_SIZE = 8;
+const uint16_t LOOP_HISTOGRAM_BOUNDS_MS[LOOP_HISTOGRAM_SIZE - 1] = {1, 5, 10, 50, 100, 500, 1000};
+
+class HealthProfiler {
+
+  public:
+    uint32_t loopHistogram[LOOP_HISTOGRAM_SIZE] = {};
+    // times are kept in us and turned into ms only when reported, sub-millisecond sends still add up
+    uint32_t loopMaxMicros = 0;
+    uint32_t bootstrapMaxMicros = 0; // bootstrapLoop(), MQTT poll and reconnections
+    uint32_t sendCount = 0; // messages built and published
+    uint64_t sendTotalMicros = 0;
+    uint32_t sendMaxMicros = 0;
+    uint32_t freeHeap = 0;
+    uint32_t minFreeHeap = UINT32_MAX;
+    uint32_t largestFreeBlock = 0;
+    uint32_t stackFree = 0; // bytes of stack never used by the loop task
+    void addLoop(unsigned long micros);
+    void addBootstrap(unsigned long micros);
+    void addSend(unsigned long micros);
+    uint32_t loopMaxMs() const;
+    uint32_t bootstrapMaxMs() const;
+    uint32_t sendAvgMs() const;
+    uint32_t sendMaxMs() const;
+    void sampleHeap();
+    void sampleWatermarks();
+    bool reportDue();
+    void postpone();
+
+  private:
+    unsigned long lastReportMillis = 0;
+    bool reported = false;
+
+};
+
+extern HealthProfiler healthProfiler;
+
+#endif
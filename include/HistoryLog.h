@@ -0,0 +1,86 @@
+/*
+  HistoryLog.h - Wake history on LittleFS, downsampled from wakes to hours to days
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+
+  NOTE: every tier is two append-only files, the current one and the old one. When the current file is full the old
+  one is merged into the next tier (wakes into hours, hours into days) and deleted, the current one takes its place.
+  Records are never rewritten, LittleFS spreads the writes over the whole partition, the flash used never goes over
+  2 * (HISTORY_WAKE_RECORDS + HISTORY_HOUR_RECORDS + HISTORY_DAY_RECORDS) records, the oldest days are dropped.
+  A range query is read one chunk at a time from the files, oldest first, it never loads the log in RAM.
+*/
+
+#ifndef _DPSOFTWARE_HISTORY_LOG_H
+#define _DPSOFTWARE_HISTORY_LOG_H
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include "BoardTraits.h"
+#include "RtcStore.h"
+
+// records per file, 16 bytes each. With the default sleep of 10 minutes the wakes cover 3.5 to 7 days,
+// the hours 30 to 60 days and the days one to two years, 51KB of flash.
+#ifndef HISTORY_WAKE_RECORDS
+#define HISTORY_WAKE_RECORDS 512
+#endif
+#ifndef HISTORY_HOUR_RECORDS
+#define HISTORY_HOUR_RECORDS 720
+#endif
+#ifndef HISTORY_DAY_RECORDS
+#define HISTORY_DAY_RECORDS 366
+#endif
+// records in one MQTT message of a range query
+const uint8_t HISTORY_CHUNK_RECORDS = 16;
+
+enum HistoryTier : uint8_t {
+  TIER_WAKE,
+  TIER_HOUR,
+  TIER_DAY,
+  TIER_COUNT
+};
+const char* const HISTORY_TIER_NAMES[TIER_COUNT] = {"wake", "hour", "day"};
+const uint16_t HISTORY_TIER_RECORDS[TIER_COUNT] = {HISTORY_WAKE_RECORDS, HISTORY_HOUR_RECORDS, HISTORY_DAY_RECORDS};
+const uint32_t HISTORY_TIER_SECONDS[TIER_COUNT] = {0, 3600, 86400}; // length of one record, 0 is one wake
+
+class HistoryLog {
+
+  public:
+    bool begin();
+    void append(const HistoryRecord* records, uint8_t count);
+    void startQuery(uint32_t from, uint32_t to);
+    bool querying();
+    uint8_t nextChunk(HistoryRecord* chunk, HistoryTier &tier);
+
+  private:
+    bool mounted = false;
+    bool queryActive = false;
+    uint32_t queryFrom = 0;
+    uint32_t queryTo = 0;
+    uint8_t queryFile = 0; // files are read from the old day file to the current wake file
+    uint32_t queryOffset = 0;
+    void append(HistoryTier tier, const HistoryRecord &record);
+    void rotate(HistoryTier tier);
+    uint32_t lastTime(HistoryTier tier);
+    static bool lastRecord(File &file, HistoryRecord &record);
+    static void merge(HistoryRecord &bucket, const HistoryRecord &record);
+    static File openForRead(HistoryTier tier, bool old);
+    static const char* path(HistoryTier tier, bool old);
+
+};
+
+extern HistoryLog historyLog;
+
+#endif
@@ -0,0 +1,87 @@
+/*
+  LogBuffer.h - Compile-time log levels and an in-RAM log ring buffer
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+
+  NOTE: the LOG_* macros of the levels above LOG_LEVEL expand to nothing, their arguments are not even evaluated.
+  Enabled lines are written to a ring buffer in RAM, loop() moves them to the UART only when its FIFO has room,
+  sending a message never waits for the serial port. The newest LOG_BUFFER_SIZE bytes are kept until deep sleep,
+  cmnd/<id>/LOG publishes them on stat/<id>/LOG while the station is in upload mode.
+*/
+
+#ifndef _DPSOFTWARE_LOG_BUFFER_H
+#define _DPSOFTWARE_LOG_BUFFER_H
+
+#include <Arduino.h>
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+// Messages sent and received are logged at LOG_LEVEL_DEBUG, override it with a build flag
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+// Fits in one MQTT message together with the topic, MQTT_MAX_PACKET_SIZE is 1024
+#ifndef LOG_BUFFER_SIZE
+#define LOG_BUFFER_SIZE 768
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) logBuffer.log('E', __VA_ARGS__)
+#else
+#define LOG_ERROR(...) do {} while (0)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...) logBuffer.log('W', __VA_ARGS__)
+#else
+#define LOG_WARN(...) do {} while (0)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) logBuffer.log('I', __VA_ARGS__)
+#else
+#define LOG_INFO(...) do {} while (0)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) logBuffer.log('D', __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do {} while (0)
+#endif
+
+const uint8_t LOG_LINE_SIZE = 96;
+
+class LogBuffer {
+
+  public:
+    void log(char level, const char* format, ...) __attribute__((format(printf, 3, 4)));
+    size_t drain(Print& out, size_t room);
+    size_t length();
+    void printTo(Print& out);
+
+  private:
+    char data[LOG_BUFFER_SIZE];
+    uint32_t written = 0; // bytes ever written, the ring keeps the last LOG_BUFFER_SIZE of them
+    uint32_t drained = 0; // bytes ever sent to the UART
+    void write(uint32_t from, size_t count, Print& out);
+
+};
+
+extern LogBuffer logBuffer;
+
+#endif
@@ -0,0 +1,108 @@
+/*
+  OtaUpdater.h - Firmware update pulled over HTTP in upload mode, resumed after a dropped connection in the same wake
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+
+  NOTE: cmnd/<id>/OTA carries the manifest written by tools/ota_server.py: url, size, md5 and board.
+  The manifest and the first bytes of the image are checked before the update partition is touched,
+  the board must be the PlatformIO environment of this firmware, the image must fit the free sketch
+  space and start like an image of this chip. The MD5 can only be checked by Update.end() once the
+  whole image has been written: a bad image is not booted, but the update partition has been written.
+  A dropped connection is resumed with an HTTP Range request from the last byte written. The offset
+  and the partially written image live in RAM, a reset or a deep sleep starts the download over.
+*/
+
+#ifndef _DPSOFTWARE_OTA_UPDATER_H
+#define _DPSOFTWARE_OTA_UPDATER_H
+
+#include <Arduino.h>
+#include "BoardTraits.h"
+#if defined(ESP8266)
+#include <ESP8266HTTPClient.h>
+#include <Updater.h>
+#else
+#include <HTTPClient.h>
+#include <Update.h>
+#endif
+
+const uint8_t OTA_URL_SIZE = 128;
+const uint8_t OTA_MD5_SIZE = 33; // hex digest and terminator
+const uint8_t OTA_HEADER_SIZE = 16; // ESP image header, chip ID included
+const size_t OTA_BUFFER_SIZE = 1024;
+const size_t OTA_LOOP_BYTES = 4096; // written per loop(), MQTT keeps being polled between two of them
+const unsigned long OTA_STALL_MS = 5000; // a connection that doesn't deliver a byte for this long is dropped and resumed
+const unsigned long OTA_RETRY_MS = 2000;
+const uint8_t OTA_MAX_ATTEMPTS = 5; // connections in a row that don't move the transfer forward
+const uint8_t OTA_PROGRESS_STEP = 10; // % between two progress reports
+
+enum OtaState : uint8_t {
+  OTA_IDLE,
+  OTA_CONNECT, // waiting for the next connection, from the start or from the last byte written
+  OTA_DOWNLOAD,
+  OTA_DONE, // whole image written and its MD5 checked, the station restarts once the report is out
+  OTA_ERROR,
+  OTA_STATE_COUNT
+};
+const char* const OTA_STATE_NAMES[OTA_STATE_COUNT] = {"idle", "connect", "download", "done", "error"};
+
+enum OtaError : uint8_t {
+  OTA_OK,
+  OTA_ERR_MANIFEST, // url or md5 missing or too long
+  OTA_ERR_BOARD, // image built for another PlatformIO environment
+  OTA_ERR_SIZE, // larger than the free sketch space, or not the size the server sends
+  OTA_ERR_IMAGE, // first bytes are not an image of this chip
+  OTA_ERR_HTTP, // server unreachable or without Range support
+  OTA_ERR_WRITE, // flash write failed
+  OTA_ERR_VERIFY, // MD5 of the image written doesn't match the manifest
+  OTA_ERROR_COUNT
+};
+const char* const OTA_ERROR_NAMES[OTA_ERROR_COUNT] = {"", "manifest", "board", "size", "image", "http", "write", "verify"};
+
+class OtaUpdater {
+
+  public:
+    OtaState state = OTA_IDLE;
+    OtaError error = OTA_OK;
+    uint32_t size = 0;
+    uint32_t offset = 0; // bytes written to the update partition
+    uint8_t resumes = 0; // connections resumed from the middle of the image
+    bool start(const char* url, uint32_t size, const char* md5, const char* board);
+    bool active();
+    void loop();
+    uint8_t percent();
+    bool reportDue();
+
+  private:
+    char url[OTA_URL_SIZE];
+    char md5[OTA_MD5_SIZE];
+    uint8_t buffer[OTA_BUFFER_SIZE];
+    WiFiClient client;
+    HTTPClient http;
+    bool updateStarted = false;
+    uint8_t attempts = 0;
+    unsigned long nextAttemptMillis = 0;
+    unsigned long lastByteMillis = 0;
+    OtaState reportedState = OTA_IDLE;
+    uint8_t reportedPercent = 0;
+    void connect();
+    void download();
+    bool fail(OtaError reason);
+
+};
+
+extern OtaUpdater otaUpdater;
+
+#endif
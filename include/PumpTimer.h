@@ -0,0 +1,84 @@
+/*
+  PumpTimer.h - Water pump run time driven by a hardware timer
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+
+  NOTE: pumps and valves are switched on and off by the timer interrupt (timer1 on the ESP8266, esp_timer on the ESP32),
+  not by loop(), run times and the gaps between zones don't depend on Wi-Fi, MQTT or any other blocking call in the sketch.
+  A single hardware timer serves every channel, it is always armed for the next on or off event.
+*/
+
+#ifndef _DPSOFTWARE_PUMP_TIMER_H
+#define _DPSOFTWARE_PUMP_TIMER_H
+
+#include <Arduino.h>
+#include "BoardTraits.h"
+#if !defined(ESP8266)
+#include <esp_timer.h>
+#endif
+
+// Flow rate of the pump, measure it by filling a jug for one minute, override it with a build flag
+#ifndef PUMP_FLOW_ML_PER_MINUTE
+#define PUMP_FLOW_ML_PER_MINUTE 1200 // 3.5/9V water pump at 8.66V, 1m of 8mm hose
+#endif
+
+const uint8_t PUMP_TIMER_CHANNELS = 4;
+// the timer counts in micros(), that wraps after ~71 minutes, a plan never runs longer
+const unsigned long PUMP_TIMER_MAX_MILLIS = 0xFFFFFFFFUL / 1000 - 1000;
+#if defined(ESP8266)
+// timer1 runs at 80MHz / 256 = 3.2µs per tick, its counter is 23 bits wide (~26s), longer waits are chained
+const uint32_t PUMP_TIMER_MAX_TICKS = 0x7FFFFF;
+#endif
+
+// One pump or valve run, times are relative to the start of the watering, a run of 0 milliseconds is skipped
+struct PumpRun {
+  uint8_t pin;
+  unsigned long startMillis;
+  unsigned long durationMillis;
+};
+
+class PumpTimer {
+
+  public:
+    void begin();
+    void start(uint8_t pin, unsigned long millis);
+    void start(const PumpRun* plan, uint8_t count);
+    void stop();
+    bool running();
+    unsigned long onMillis();
+    unsigned long onMillis(uint8_t channel);
+    static unsigned long doseMillis(uint16_t ml, uint16_t flowMlPerMinute = PUMP_FLOW_ML_PER_MINUTE);
+
+  private:
+    enum RunState : uint8_t { RUN_PENDING, RUN_ON, RUN_DONE };
+    static void IRAM_ATTR onTimer();
+    void IRAM_ATTR dispatch();
+    PumpRun runs[PUMP_TIMER_CHANNELS];
+    uint8_t count = 0;
+    unsigned long startAtMicros = 0;
+    volatile bool active = false;
+    volatile RunState state[PUMP_TIMER_CHANNELS];
+    volatile unsigned long onAtMicros[PUMP_TIMER_CHANNELS];
+    volatile unsigned long offAtMicros[PUMP_TIMER_CHANNELS];
+#if !defined(ESP8266)
+    esp_timer_handle_t timer = nullptr;
+#endif
+
+};
+
+extern PumpTimer pumpTimer;
+
+#endif
@@ -0,0 +1,143 @@
+/*
+  RtcStore.h - State that survives deep sleep
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+
+  NOTE: RTC memory survives deep sleep but it is lost on power loss, data is protected by a checksum
+  and it is reinitialized when the checksum does not match. ESP8266 has 512 bytes of user RTC memory.
+*/
+
+#ifndef _DPSOFTWARE_RTC_STORE_H
+#define _DPSOFTWARE_RTC_STORE_H
+
+#include <Arduino.h>
+
+const uint32_t RTC_MAGIC = 0x534F4C45; // "SOLE", change it when RtcData layout changes
+const size_t RTC_USER_MEMORY_SIZE = 512;
+const uint8_t BATTERY_HISTORY_SIZE = 48;
+const uint8_t OFFLINE_WATERING_SIZE = 4;
+const uint16_t NO_WATERING_SCHEDULE = 0xFFFF;
+const uint8_t MAX_WATER_ZONES = 4;
+const uint8_t BATTERY_TREND_SIZE = 8;
+const uint8_t HISTORY_PENDING_SIZE = 4;
+
+// Watering of one zone, the ml dose wins over the seconds when it is not 0
+struct ZoneConfig {
+  uint16_t seconds;
+  uint16_t ml;
+};
+
+// Config received via MQTT, cached to skip the config round trip on routine wakes
+struct MQTTConfig {
+  bool uploadMode;
+  bool pumpActive;
+  ZoneConfig zones[MAX_WATER_ZONES];
+  float espSleepTimeMinutes;
+  uint8_t batchWakes; // telemetry is sent once every batchWakes wakes, the other ones only sample the battery
+  uint8_t sleepMinMinutes; // bounds of the adaptive sleep, 0 means esp_sleep_time_minutes (old HA package)
+  uint8_t sleepMaxMinutes;
+  uint8_t waterDeferHours; // a watering can wait for a better battery up to this many hours, 0 never waits
+  uint16_t waterMinute; // minute of the day of the daily watering scheduled in HA, NO_WATERING_SCHEDULE if unknown
+  char time[32];
+  char tag[48]; // config_tag computed by Home Assistant, it changes when any of the fields above changes
+};
+
+// Watering done while HA was unreachable, it is reported to HA when the link comes back
+struct OfflineWatering {
+  uint32_t time; // local time, seconds since 1970-01-01
+  uint16_t pumpSeconds;
+  uint16_t batteryMv;
+};
+
+// Resting battery voltage of one wake, the trend of the last samples drives the adaptive sleep
+struct BatteryTrendSample {
+  uint16_t mv;
+  uint16_t minutes; // time elapsed since the previous sample
+};
+
+// Charge used by the station, see EnergyAccountant.h. Totals start from the last power loss.
+struct EnergyStats {
+  uint32_t awakeMs; // last complete wake, from boot to deep sleep
+  uint32_t wifiMs;
+  uint32_t mqttMs;
+  uint32_t ackWaitMs;
+  uint32_t pumpMs;
+  uint32_t wakeMicroAh; // charge used by the last complete wake, pump included
+  uint32_t awakeMicroAh; // total of the wakes
+  uint32_t sleepMicroAh; // total of the deep sleeps
+};
+
+// Outcome of one wake, or of every wake of one hour or one day once downsampled, see HistoryLog.h
+struct HistoryRecord {
+  uint32_t time; // local time of the first wake, seconds since 1970-01-01
+  uint16_t batteryMv; // mean resting voltage
+  uint16_t batteryMinMv; // under load when the pump ran
+  uint16_t batteryMaxMv;
+  uint16_t pumpSeconds;
+  uint16_t wakes;
+  uint16_t failedWakes; // wakes that didn't reach HA, brown-outs included
+};
+
+struct RtcData {
+  uint32_t magic;
+  uint32_t crc;
+  uint32_t wakeCount;
+  bool configValid;
+  MQTTConfig config;
+  bool wifiValid;
+  uint8_t wifiChannel;
+  uint8_t wifiBssid[6]; // access point of the last successful association, used to skip the scan on the next wake
+  uint8_t wakesSinceFlush; // sample only wakes since the last time the battery history has been sent
+  uint8_t historyHead; // next slot to write in the battery history
+  uint8_t historyCount;
+  uint16_t lastBatteryMv; // resting battery voltage of the previous wake
+  uint16_t batteryHistory[BATTERY_HISTORY_SIZE]; // ring buffer, when full the oldest sample is overwritten
+  bool clockValid;
+  uint8_t offlineCount;
+  uint8_t connectionFailures; // consecutive wakes that could not reach HA, the sleep doubles at every one of them
+  bool buttonOnlySleep; // the last wake slept forever, the wake that follows it is the button
+  uint32_t clockAtBoot; // local time of the last reset, derived from the time sent by HA and advanced by every sleep
+  uint32_t sleepSeconds; // deep sleep armed by the last wake, 0 means forever and only the button can end it
+  uint32_t lastWateringDay; // days since 1970-01-01 of the last watering, online or offline
+  OfflineWatering offline[OFFLINE_WATERING_SIZE];
+  EnergyStats energy;
+  BatteryTrendSample trend[BATTERY_TREND_SIZE]; // oldest first, timer wakes only, a reset starts a new trend
+  uint8_t trendCount;
+  uint16_t trendSleepMinutes; // length of the current deep sleep, the next wake stores it with its sample
+  uint32_t deferredSince; // local time of the first watering request postponed by the battery, 0 if none
+  uint8_t brownOuts; // wakes that went back to sleep without the radio since the last STATE delivered to HA
+  uint8_t pendingRecordCount;
+  uint16_t batteryMilliohm; // internal resistance learned from the pump runs, 0 until the first one, see SocEstimator.h
+  HistoryRecord pendingRecords[HISTORY_PENDING_SIZE]; // wakes not written to the history log yet, oldest first
+};
+static_assert(sizeof(RtcData) <= RTC_USER_MEMORY_SIZE, "RtcData does not fit the RTC user memory");
+static_assert(sizeof(RtcData) % 4 == 0, "RTC user memory is accessed in 4 bytes blocks");
+
+class RtcStore {
+
+  public:
+    RtcData data;
+    bool load();
+    void save();
+
+  private:
+    uint32_t checksum();
+
+};
+
+extern RtcStore rtcStore;
+
+#endif
@@ -0,0 +1,61 @@
+/*
+  SocEstimator.h - State of charge of the battery and charge left for the watering
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+
+  NOTE: the resting voltage is turned into a state of charge with the open circuit voltage curve of
+  an 18650 NMC cell, the internal resistance is learned from the sag measured while the pump runs.
+  A watering is shortened when it would bring the resting voltage below the water pump cutoff, or
+  the voltage under load below the ESP cutoff, before its end.
+*/
+
+#ifndef _DPSOFTWARE_SOC_ESTIMATOR_H
+#define _DPSOFTWARE_SOC_ESTIMATOR_H
+
+#include <Arduino.h>
+#include "BoardTraits.h"
+
+// Capacity of the cell, Sony VTC6 or any other 3000mAh 18650
+#ifndef BATTERY_CAPACITY_MAH
+#define BATTERY_CAPACITY_MAH 3000
+#endif
+// Cell, protection circuit, holder and wires, used until the first pump run measures the real one
+#ifndef BATTERY_DEFAULT_MILLIOHM
+#define BATTERY_DEFAULT_MILLIOHM 150
+#endif
+
+// a watering shortened below this length is skipped, the pipes would barely fill
+const unsigned long SOC_MIN_WATERING_MILLIS = 5000;
+
+// Resting voltage of the cell at one point of the discharge curve
+struct OcvPoint {
+  uint16_t mv;
+  uint16_t permille; // state of charge
+};
+
+class SocEstimator {
+
+  public:
+    uint16_t permille(int restingMv);
+    uint16_t milliohm(uint16_t learnedMilliohm);
+    void learn(uint16_t& learnedMilliohm, int restingMv, int loadMv, uint32_t loadMa);
+    uint64_t availableMaMillis(int restingMv, uint32_t loadMa, uint16_t learnedMilliohm);
+
+};
+
+extern SocEstimator socEstimator;
+
+#endif
@@ -34,61 +34,173 @@
 */
 
 #include "Version.h"
+#include "BoardTraits.h"
 #include "BootstrapManager.h"
+#include "RtcStore.h"
+#include "BatterySampler.h"
+#include "PumpTimer.h"
+#include "EnergyAccountant.h"
+#include "ArenaAllocator.h"
+#include "LogBuffer.h"
+#include "HealthProfiler.h"
+#include "HistoryLog.h"
+#include "SocEstimator.h"
+#include "OtaUpdater.h"
 
 /****************** BOOTSTRAP MANAGER ******************/
 BootstrapManager bootstrapManager;
 Helpers helper;
 
 /**************************** PIN DEFINITIONS **************************************************/
-#if defined(ESP8266)
-#define OLED_RESET LED_BUILTIN // Pin used for turning off the integrated LED
-#define ANALOG_IN_PIN A0
-#define WATER_PUMP_PIN D5
-#endif
-#if CONFIG_IDF_TARGET_ESP32S3
-#define OLED_RESET 47 // Pin used for turning off the integrated LED
-#define ANALOG_IN_PIN 2
-#define WATER_PUMP_PIN 12
-#endif
+// pins, divider and thresholds of the board come from BoardTraits.h
+constexpr uint8_t ANALOG_IN_PIN = Board::BATTERY_PIN;
+constexpr uint8_t WATER_PUMP_PIN = Board::ZONE_PINS[0];
 
 // NOTE: TP223 capacitive touch button is not registered because I don't manage it from sketch, it is only used to reset the microcontroller (or to wake it up from the deep sleep)
-#if CONFIG_IDF_TARGET_ESP32S3
-#define WATER_PUMP_CUTOFF 3700 // 3.7V
-#define ESP_CUTOFF 2300 // 2.3V
+// Battery thresholds in millivolts
+constexpr int WATER_PUMP_CUTOFF = Board::WATER_PUMP_CUTOFF_MV;
+constexpr int ESP_CUTOFF = Board::ESP_CUTOFF_MV;
+
+/****************** WATERING ZONES ******************/
+// One entry per pump or valve. Zones water in table order within the same wake, a zone starts together with
+// the previous ones while the step up module can power all of them, otherwise it waits until enough of them are done.
+struct WaterZone {
+  const char* name;
+  uint8_t pin;
+  uint16_t seconds; // used when HA doesn't send the zones config (old HA package)
+  uint16_t minBatteryMv; // the zone is skipped when the resting battery voltage is lower
+  uint16_t currentMa;
+  uint16_t flowMlPerMinute; // converts the ml dose into run time
+};
+// zones wired on this board, the first WATER_ZONES entries of the table are used
+#ifndef WATER_ZONES
+#define WATER_ZONES 1
 #endif
-#if defined(ESP8266)
-#define WATER_PUMP_CUTOFF 816 // 3.3V
-#define ESP_CUTOFF 740 // 3.0V
+// current the pump supply can deliver, MT3608 step up at 8.66V
+#ifndef PUMP_SUPPLY_MA
+#define PUMP_SUPPLY_MA 400
 #endif
+constexpr WaterZone ZONE_TABLE[] = {
+  {"zone1", Board::ZONE_PINS[0], 15, WATER_PUMP_CUTOFF, 330, PUMP_FLOW_ML_PER_MINUTE},
+  {"zone2", Board::ZONE_PINS[1], 10, WATER_PUMP_CUTOFF, 60, 120}, // drip line solenoid valve
+  {"zone3", Board::ZONE_PINS[2], 10, WATER_PUMP_CUTOFF + 200, 330, PUMP_FLOW_ML_PER_MINUTE},
+};
+constexpr uint8_t ZONE_COUNT = WATER_ZONES;
+static_assert(ZONE_COUNT >= 1 && ZONE_COUNT <= sizeof(ZONE_TABLE) / sizeof(ZONE_TABLE[0]), "WATER_ZONES exceeds the zone table");
+static_assert(ZONE_COUNT <= MAX_WATER_ZONES && ZONE_COUNT <= PUMP_TIMER_CHANNELS, "too many zones for the RTC config or the pump timer");
+PumpRun wateringPlan[ZONE_COUNT]; // one run per zone, in table order, skipped zones have no run time
+uint32_t wateringPeakMa = 0; // battery current when the most zones of the plan run together, radio included
+uint8_t wateringPercent = 100; // share of the watering the battery can deliver, every run is shortened by the same ratio
 
 /************* MQTT TOPICS **************************/
+// Every topic carries the ID of the station in place of "+", one broker and one HA can serve a fleet of stations.
+// The ID is DEVICE_ID when it is defined, the lowercase WIFI_DEVICE_NAME followed by the end of the MAC address otherwise.
 // subscribe
-const char* SOLAR_STATION_UPLOADMODE_TOPIC = "cmnd/upload_mode/SLEEP";
-const char* SOLAR_STATION_WATERPUMP_ACTIVE_TOPIC = "cmnd/water_pump/ACTIVE";
-const char* SOLAR_STATION_MQTT_CONFIG = "stat/solarstation/CONFIG";
+constexpr char SOLAR_STATION_UPLOADMODE_TOPIC[] = "cmnd/+/UPLOAD_MODE";
+constexpr char SOLAR_STATION_WATERPUMP_ACTIVE_TOPIC[] = "cmnd/+/PUMP_ACTIVE";
+constexpr char SOLAR_STATION_MQTT_CONFIG[] = "stat/+/CONFIG";
+constexpr char SOLAR_STATION_MQTT_ACK[] = "stat/+/ACK";
+constexpr char SOLAR_STATION_LOG_TOPIC[] = "cmnd/+/LOG";
+constexpr char SOLAR_STATION_HISTORY_TOPIC[] = "cmnd/+/HISTORY";
+constexpr char SOLAR_STATION_OTA_TOPIC[] = "cmnd/+/OTA";
 // publish
-const char* SOLAR_STATION_STATE_TOPIC = "tele/solarstation/STATE";
-const char* SOLAR_STATION_WATERPUMP_ACTIVE_STAT_TOPIC = "stat/water_pump/ACTIVE";
-const char* SOLAR_STATION_WATERPUMP_POWER_TOPIC = "stat/water_pump/POWER";
-const char* SOLAR_STATION_POWER_TOPIC = "stat/solarstation/POWER";
-const char* SOLAR_STATION_MQTT_ACK = "stat/solarstation/ACK";
+constexpr char SOLAR_STATION_STATE_TOPIC[] = "tele/+/STATE";
+constexpr char SOLAR_STATION_WATERPUMP_ACTIVE_STAT_TOPIC[] = "stat/+/PUMP_ACTIVE";
+constexpr char SOLAR_STATION_WATERPUMP_POWER_TOPIC[] = "stat/+/PUMP_POWER";
+constexpr char SOLAR_STATION_POWER_TOPIC[] = "stat/+/POWER";
+constexpr char SOLAR_STATION_LOG_STAT_TOPIC[] = "stat/+/LOG";
+constexpr char SOLAR_STATION_HISTORY_STAT_TOPIC[] = "stat/+/HISTORY";
+constexpr char SOLAR_STATION_OTA_STAT_TOPIC[] = "stat/+/OTA";
+const uint8_t DEVICE_ID_SIZE = 33;
+char deviceId[DEVICE_ID_SIZE];
+char topicBuffer[64]; // topic of this station, filled by stationTopic()
+#ifdef TELEMETRY_MSGPACK
+// STATE and POWER go out as MessagePack on their topic followed by "/mp", tools/telemetry_bridge.py republishes them
+// as JSON on the topic without "/mp". Commands, CONFIG and ACK are small and they stay JSON.
+constexpr char TELEMETRY_MSGPACK_SUFFIX[] = "/mp";
+uint8_t telemetryBuffer[MQTT_MAX_PACKET_SIZE];
+#endif
+
+// FNV-1a hash used as ID of topics and ACK names, IDs of the known strings are computed at compile time
+constexpr uint32_t mqttId(const char* str, uint32_t hash = 2166136261UL) {
+  return *str == 0 ? hash : mqttId(str + 1, (hash ^ static_cast<uint8_t>(*str)) * 16777619UL);
+}
+
+/****************** MQTT HANDSHAKE ******************/
+// Messages that need an ACK from Home Assistant, ACK payload contains the message name and the sequence number of the message
+enum HandshakeMsg : uint8_t {
+  MSG_ON_STATE,
+  MSG_SENSOR_STATE,
+  MSG_PUMP_POWER_ON,
+  MSG_PUMP_POWER_OFF,
+  MSG_PUMP_ACTIVE_OFF,
+  MSG_OFF_STATE,
+  MSG_COUNT
+};
+constexpr const char* HANDSHAKE_ACK_NAMES[MSG_COUNT] = {
+  "sendOnState",
+  "sendSensorState",
+  "sendWaterPumpPowerStateOn",
+  "sendWaterPumpPowerStateOff",
+  "sendWaterPumpActiveStateOff",
+  "sendOffState"
+};
+constexpr uint32_t HANDSHAKE_ACK_IDS[MSG_COUNT] = {
+  mqttId(HANDSHAKE_ACK_NAMES[MSG_ON_STATE]),
+  mqttId(HANDSHAKE_ACK_NAMES[MSG_SENSOR_STATE]),
+  mqttId(HANDSHAKE_ACK_NAMES[MSG_PUMP_POWER_ON]),
+  mqttId(HANDSHAKE_ACK_NAMES[MSG_PUMP_POWER_OFF]),
+  mqttId(HANDSHAKE_ACK_NAMES[MSG_PUMP_ACTIVE_OFF]),
+  mqttId(HANDSHAKE_ACK_NAMES[MSG_OFF_STATE])
+};
+// Max number of messages in flight waiting for an ACK, 1 means strictly serial handshake (one message per round trip)
+#ifndef HANDSHAKE_WINDOW
+#define HANDSHAKE_WINDOW MSG_COUNT
+#endif
+struct HandshakeSlot {
+  bool queued;
+  bool sent;
+  bool acked;
+  uint16_t seq;
+  unsigned long sentMillis;
+};
+
+/****************** WAKE CYCLE STATE MACHINE ******************/
+// Every wake goes through these states, dwell time of each state is published in the OFF state message
+enum WakeState : uint8_t {
+  WAKE_BOOT, // setup(), Wi-Fi and MQTT connection
+  WAKE_CONFIG, // ON state sent, waiting for the MQTT config or for the ACK that confirms the cached one
+  WAKE_UPLOAD, // upload mode, stay awake for OTA
+  WAKE_REPORT, // pump not active, queue sensor state and pump off state
+  WAKE_PUMP_START, // pump active, waiting for the ACK of the pump on state
+  WAKE_PUMP_RUN, // pump on, sensor state every second
+  WAKE_SLEEP, // OFF state sent, waiting for every ACK before deep sleep
+  WAKE_STATE_COUNT
+};
+struct WakeStateDef {
+  const char* name; // key of the timing breakdown
+  WakeState (*run)(); // called once per loop, returns the next state
+  unsigned int retryMillis; // retransmission interval of the messages waiting for an ACK in this state
+};
+WakeState wakeState = WAKE_BOOT;
+unsigned long wakeStateEnteredMillis = 0;
+unsigned long wakeStateDwellMillis[WAKE_STATE_COUNT]; // time spent in every state, a state can be entered more than once
+uint8_t wakeStateVisits[WAKE_STATE_COUNT] = {1}; // boot state is entered on reset
+
+/****************** INCOMING MQTT MESSAGES ******************/
+// incoming messages are parsed in place in a static arena, no heap allocation per message
+ArenaAllocator jsonArena;
+JsonDocument mqttJson(&jsonArena);
+char plainPayload[32]; // payloads that are not JSON (ON/OFF, ACK names sent by old HA packages)
 
 /****************** GLOBAL VARS ******************/
-// MQTT publish retry until ack received
+// MQTT publish retry until ack received, number_of_attemps counts retransmissions only
 int number_of_attemps = 0;
-bool onStateAckReceived = false;
-unsigned long onStateNowMillis = 0; 
-bool offStateAckReceived = false;
-unsigned long offStateNowMillis = 0; 
-bool waterPumpPowerStateOnAckReceived = false;
-unsigned long waterPumpPowerStateOnNowMillis = 0;
-bool waterPumpPowerStateOffAckReceived = false;
-unsigned long waterPumpPowerStateOffNowMillis = 0;
-bool sensorStateAckReceived = false;
-unsigned long sensorStateNowMillis = 0;
-bool waterPumpActiveStateOffAckReceived = false;
-unsigned long waterPumpActiveStateOffNowMillis = 0;
+HandshakeSlot handshake[MSG_COUNT];
+HandshakeMsg handshakeOrder[MSG_COUNT]; // messages are sent in the order they are queued
+uint8_t handshakeQueued = 0;
+uint8_t handshakeWindow = HANDSHAKE_WINDOW;
+uint16_t handshakeSeq = 0;
 
 int blinked = 10;
 float temperature = 0;
@@ -99,23 +211,105 @@ bool uploadMode = false; // if true, microcontroller does nothing but expose its
 bool waterPumpActive = false; // value received via MQTT config, if true, turn on the pump
 bool waterPumpPower = false; // value send via MQTT message to the broker, if true, the pump if turned on
 bool dataMQTTReceived = false;  // don't do anything until MQTT server sent its configuration
-int waterPumpSecondsOn = 10000; // default 10 seconds, it changes after config received via MQTT message 
+MQTTConfig mqttConfig = {}; // config in use, received via MQTT or cached in RTC memory
+bool configFromCache = false; // config in use comes from RTC memory and it has not been confirmed by HA yet
+bool configConfirmed = false; // HA sent a config or confirmed the cached one, the pump can start and the ESP can sleep
+int waterPumpSecondsOn = 10000; // whole watering of this wake, every zone included, it changes after config received via MQTT message 
 double espSleepTime = 600e6; // 15e6 = 15 seconds, 600e6 1 hour
-int sensorValue = 0;  // analogRead to measure battery level via a voltage divider
 
 bool hardCutOff = false;
 bool waterPumpCutOff = true;
 bool espCutOff = false;
 int batteryLevelOnboot = -1;
+uint8_t stateHistorySent = BATTERY_HISTORY_SIZE; // fewest battery samples carried by a STATE of this wake, its ACK drops as many
 
-const int FORCE_DEEP_SLEEP_TIME = 3600000; // force deepSleep after 1 hour
+const int FORCE_DEEP_SLEEP_TIME = 3600000; // force deepSleep after 1 hour in upload mode
+// the station goes to sleep after FORCE_DEEP_SLEEP_TIME whatever the pump is doing, a watering is planned within it
+const unsigned long WATERING_MAX_MILLIS = FORCE_DEEP_SLEEP_TIME;
+static_assert(WATERING_MAX_MILLIS <= PUMP_TIMER_MAX_MILLIS, "a watering can't be longer than the pump timer can count");
+
+/****************** BOOT PATH ******************/
+// Path taken by setup() for the reset cause and the battery of this wake, both are reported in the STATE message
+enum BootPath : uint8_t {
+  BOOT_FULL, // power on or crash, Wi-Fi scan and config from HA
+  BOOT_TELEMETRY, // timer wake, cached access point and cached config
+  BOOT_SAMPLE, // timer wake that only stores the battery sample, the radio stays off
+  BOOT_INTERACTIVE, // button, upload mode until HA turns it off or for FORCE_DEEP_SLEEP_TIME
+  BOOT_BROWNOUT // brown-out or power on with the battery below ESP_CUTOFF, back to sleep with the radio off
+};
+const char* const RESET_CAUSE_NAMES[RESET_CAUSE_COUNT] = {"power_on", "timer", "button", "brownout", "crash"};
+const char* const BOOT_PATH_NAMES[] = {"full", "telemetry", "sample", "interactive", "brownout"};
+// The radio would pull the cell down again, the next wake waits for the sun to charge it a little
+#ifndef BROWNOUT_SLEEP_MINUTES
+#define BROWNOUT_SLEEP_MINUTES 60
+#endif
+ResetCause resetCause = RESET_POWER_ON;
+BootPath bootPath = BOOT_FULL;
+bool interactiveSession = false; // button wake, upload mode stays on whatever the config says until HA turns it off
+const uint32_t EARLY_WAKE_MIN_SECONDS = 60; // a timer wake this much earlier than the sleep it armed is the button, plus 1/8 of the sleep
+
+/****************** FAST WIFI CONNECT ******************/
+// Max time to wait for the association with the cached BSSID/channel before falling back to the full scan
+#ifndef FAST_WIFI_CONNECT_TIMEOUT
+#define FAST_WIFI_CONNECT_TIMEOUT 3000
+#endif
+unsigned long wifiAssociationMillis = 0; // time spent to associate with the access point, published in the STATE message
+bool wifiFastConnect = false; // true if the association used the cached BSSID/channel
+
+/****************** CONNECTION BUDGET ******************/
+// Max time a wake can spend on Wi-Fi, MQTT and the handshake with HA, the watering is not counted.
+// When it runs out the station waters on its own schedule and sleeps with an exponential back-off.
+#ifndef CONNECTION_BUDGET
+#define CONNECTION_BUDGET 10000
+#endif
+// every wake that runs out of budget doubles the sleep time up to this value
+#ifndef BACKOFF_MAX_MINUTES
+#define BACKOFF_MAX_MINUTES 120
+#endif
+const uint8_t BACKOFF_MAX_SHIFT = 8;
+// A fleet powered on together (a breaker, a panel shared by many stations) would reach HA in the same second.
+// A full boot waits from 0 to this many ms, taken from the station ID, before it starts Wi-Fi. It's not part of the budget.
+#ifndef BOOT_JITTER_MS
+#define BOOT_JITTER_MS 5000
+#endif
+unsigned long bootJitterMillis = 0;
+unsigned long wateringMillis = 0; // watering time of this wake, added to the connection budget
+
+/****************** OFFLINE WATERING ******************/
+const uint32_t SECONDS_PER_DAY = 86400;
+
+/****************** ADAPTIVE SLEEP ******************/
+// The sleep moves between the bounds sent by HA following the battery trend: short while the battery is full or charging,
+// long while it drains towards the water pump cutoff, in between when it is steady and there is nothing new to report.
+// The trend is the slope of the resting voltage of the last BATTERY_TREND_SIZE timer wakes.
+const uint8_t TREND_MIN_SAMPLES = 3;
+const uint16_t TREND_MIN_MINUTES = 30; // shorter windows are mostly ADC noise
+const int TREND_CHARGING_MV_PER_HOUR = 15;
+const int TREND_STEADY_MV_PER_HOUR = 5;
+#ifndef BATTERY_FULL_MV
+#define BATTERY_FULL_MV 4100
+#endif
+// the sleep starts to stretch this many mV above the water pump cutoff, or when the cutoff is less than TREND_HORIZON_HOURS away
+#ifndef SLEEP_ADAPT_MARGIN_MV
+#define SLEEP_ADAPT_MARGIN_MV 300
+#endif
+const uint8_t TREND_HORIZON_HOURS = 12;
+int batteryTrendMvPerHour = 0; // slope of the battery trend, valid when batteryTrendValid
+bool batteryTrendValid = false;
+bool wateringDeferred = false; // HA asked to water but the battery can wait for the sun
+
+/****************** HISTORY LOG ******************/
+// Every wake with a valid clock leaves one record, RTC memory keeps HISTORY_PENDING_SIZE of them and the flash is
+// written once every HISTORY_PENDING_SIZE wakes. cmnd/<id>/HISTORY asks for a time range in upload mode.
+HistoryRecord historyChunk[HISTORY_CHUNK_RECORDS];
+uint16_t historyChunkSeq = 0;
 
 // variable used for faster delay instead of arduino delay(), this custom delay prevent a lot of problem and memory leak
 const int TENSECONDSPERIOD = 10000;
 unsigned long timeNowStatus = 0;
-unsigned long nowMillisWaterPumpStatus = 0; // used to turn off the pump after seconds
 unsigned long nowMillisSendStatus = 0; // used to send status every second when the pump is on or when in upload mode
 unsigned long nowMillisForceDeepSleepStatus = 0; // used to force deep sleep after 15 minutes
+unsigned long nowMillisBatteryLoad = 0; // used to sample the battery under load every second while the pump is on
 
 /********************************** FUNCTION DECLARATION (NEEDED BY PLATFORMIO WHILE COMPILING CPP FILES) *****************************************/
 // Bootstrap functions
@@ -124,22 +318,90 @@ void manageDisconnections();
 void manageQueueSubscription();
 void manageHardwareButton();
 // Project specific functions
-bool processMQTTConfig(JsonDocument json);
-bool processUploadModeJson(JsonDocument json);
-bool processAckTopic(JsonDocument json);
+void buildDeviceId();
+unsigned long bootJitter();
+const char* stationTopic(const char* topic);
+uint32_t topicId(const char* topic);
+void publishTelemetry(const char* topic, JsonObject root);
+bool processMQTTConfig(JsonVariantConst json);
+void applyMQTTConfig();
+bool isTimerWake();
+bool isEarlyWake(uint32_t haSeconds);
+void buttonWake();
+bool isBrownOut();
+void brownOutWake();
+bool fastWifiConnect();
+bool isSampleOnlyWake();
+void sampleOnlyWake();
+void pushBatteryHistory(uint16_t mv);
+void clearBatteryHistory(uint8_t count);
+size_t stateBudget(const char* topic);
+void cacheWifiAccessPoint();
+bool processUploadMode(const char* value);
+bool processAckTopic(uint32_t ackId, JsonVariantConst json);
+void queueMessage(HandshakeMsg msg);
+void resetHandshake();
+bool isAcked(HandshakeMsg msg);
+bool isHandshakeComplete();
+void flushHandshake();
+void sendHandshakeMessage(HandshakeMsg msg);
 void sendWaterPumpActiveStateOff();
+void sendLog();
+void recordHistory();
+void flushHistory();
+void processHistoryRequest(JsonVariantConst json);
+void sendHistoryChunk();
+void processOtaRequest(JsonVariantConst json);
+void sendOtaProgress();
 void sendWaterPumpPowerStateOff();
 void sendWaterPumpPowerStateOn();
 void readSensorData();
-void sendOnState();
-void sendOffState();
-void sendOnOffState(String cmd, unsigned long stateMillis);
+void sendOnOffState(String cmd, uint16_t seq);
 void espDeepSleep(bool sendState, bool hardCutOff);
 void espDeepSleep(bool hardCutOff);
-void sendSensorState();
-void sendSensorStateNotTimed();
+void accountEnergy(uint64_t sleepMicros);
+void sendSensorStateNotTimed(uint16_t seq = 0);
 void turnOffWaterPumpAfterSeconds();
 void sendSensorStateAfterSeconds(int delay);
-int readAnalogBatteryLevel();
 void forceDeepSleep();
 void turnOffBuiltInLed();
+void enterWakeState(WakeState next);
+unsigned long wakeStateDwell(WakeState state);
+void requestConfig();
+bool parseHaTime(const char* haTime, uint32_t &seconds);
+void syncClock(const char* haTime);
+uint32_t localTime();
+void advanceClock(uint64_t sleepMicros);
+bool isWateringDue();
+bool wateredOfflineToday();
+void recordWatering(bool offline, unsigned long pumpMillis);
+void offlineWake();
+void pushBatteryTrend(bool continues);
+bool batteryTrend(int &mvPerHour);
+float adaptSleepMinutes(float minutes);
+bool deferWatering();
+unsigned long zoneMillis(uint8_t zone);
+bool supplyAllows(uint8_t zone, unsigned long start, unsigned long duration);
+unsigned long planWatering();
+unsigned long fitWatering(unsigned long wateringEnd);
+uint32_t zoneBatteryMa(uint8_t zone);
+bool hasWatering(const MQTTConfig &config);
+unsigned long awakeBudget();
+void backOff();
+WakeState wakeBoot();
+WakeState wakeConfig();
+WakeState wakeUpload();
+WakeState wakeReport();
+WakeState wakePumpStart();
+WakeState wakePumpRun();
+WakeState wakeSleep();
+
+const WakeStateDef WAKE_STATES[WAKE_STATE_COUNT] = {
+  {"boot", wakeBoot, DELAY_1000},
+  {"config", wakeConfig, DELAY_1000},
+  {"upload", wakeUpload, DELAY_1000},
+  {"report", wakeReport, DELAY_1000},
+  {"pump_start", wakePumpStart, DELAY_1000},
+  {"pump_run", wakePumpRun, 2 * DELAY_1000}, // pump is running, ACKs of the messages sent meanwhile are not urgent
+  {"sleep", wakeSleep, DELAY_1000}
+};
@@ -0,0 +1,84 @@
+/*
+  ArenaAllocator.cpp - Fixed size ArduinoJson allocator for incoming MQTT messages
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+*/
+
+#include "ArenaAllocator.h"
+
+static size_t alignedSize(size_t size) {
+
+  return (size + 7) & ~static_cast<size_t>(7);
+
+}
+
+void* ArenaAllocator::allocate(size_t size) {
+
+  size_t blockSize = sizeof(Header) + alignedSize(size);
+  if (used + blockSize > sizeof(buffer)) {
+    return nullptr; // ArduinoJson reports NoMemory
+  }
+  Header* header = reinterpret_cast<Header*>(buffer + used);
+  header->size = size;
+  last = buffer + used;
+  used += blockSize;
+  return header + 1;
+
+}
+
+// only the most recent block gives its memory back, the others are freed by reset()
+void ArenaAllocator::deallocate(void* ptr) {
+
+  if (ptr != nullptr && static_cast<uint8_t*>(ptr) == last + sizeof(Header)) {
+    used = last - buffer;
+    last = nullptr;
+  }
+
+}
+
+void* ArenaAllocator::reallocate(void* ptr, size_t newSize) {
+
+  if (ptr == nullptr) {
+    return allocate(newSize);
+  }
+  Header* header = static_cast<Header*>(ptr) - 1;
+  if (reinterpret_cast<uint8_t*>(header) == last) {
+    size_t start = last - buffer;
+    if (start + sizeof(Header) + alignedSize(newSize) > sizeof(buffer)) {
+      return nullptr;
+    }
+    header->size = newSize;
+    used = start + sizeof(Header) + alignedSize(newSize);
+    return ptr;
+  }
+  // ArduinoJson shrinks the pool once the message is parsed, an older block shrinks where it is
+  if (newSize <= header->size) {
+    return ptr;
+  }
+  void* block = allocate(newSize);
+  if (block != nullptr) {
+    memcpy(block, ptr, header->size < newSize ? header->size : newSize);
+  }
+  return block;
+
+}
+
+void ArenaAllocator::reset() {
+
+  used = 0;
+  last = nullptr;
+
+}
@@ -0,0 +1,81 @@
+/*
+  BatterySampler.cpp - Oversampled and calibrated battery voltage
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+*/
+
+#include "BatterySampler.h"
+
+BatterySampler batterySampler;
+
+void BatterySampler::begin(uint8_t analogPin) {
+
+  pin = analogPin;
+  Board::beginBatteryPin(pin);
+
+}
+
+// battery voltage at rest, call it before the radio and the pump are turned on
+int BatterySampler::sampleResting() {
+
+  restingMv = sampleMv(BATTERY_RESTING_SAMPLES);
+  return restingMv;
+
+}
+
+// battery voltage under load, call it while the pump is running, the lowest value wins
+int BatterySampler::sampleLoad() {
+
+  int mv = sampleMv(BATTERY_LOAD_SAMPLES);
+  if (loadMv == 0 || mv < loadMv) {
+    loadMv = mv;
+  }
+  return mv;
+
+}
+
+// trimmed mean of a burst of samples, spikes on both sides are discarded
+int BatterySampler::sampleMv(uint8_t samples) {
+
+  int values[BATTERY_RESTING_SAMPLES];
+  if (samples > BATTERY_RESTING_SAMPLES) {
+    samples = BATTERY_RESTING_SAMPLES;
+  }
+  for (uint8_t i = 0; i < samples; i++) {
+    int value = readMv();
+    // insertion sort, the array is tiny
+    uint8_t j = i;
+    while (j > 0 && values[j - 1] > value) {
+      values[j] = values[j - 1];
+      j--;
+    }
+    values[j] = value;
+  }
+  uint8_t trim = samples / 4;
+  long sum = 0;
+  for (uint8_t i = trim; i < samples - trim; i++) {
+    sum += values[i];
+  }
+  return sum / (samples - 2 * trim);
+
+}
+
+// millivolts on the ADC pin scaled up by the divider, see BoardTraits.h for the calibration
+int BatterySampler::readMv() {
+
+  return Board::DIVIDER.batteryMv(Board::readPinMv(pin));
+
+}
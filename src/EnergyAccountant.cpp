@@ -0,0 +1,62 @@
+/*
+  EnergyAccountant.cpp - Charge used by every wake, estimated from the time spent in every phase
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+*/
+
+#include "EnergyAccountant.h"
+
+EnergyAccountant energyAccountant;
+
+const uint16_t PHASE_MA[ENERGY_PHASES] = {ENERGY_AWAKE_MA, ENERGY_WIFI_MA, ENERGY_MQTT_MA, ENERGY_ACK_WAIT_MA};
+
+// close the current phase and start a new one, entering the current phase again only closes it
+void EnergyAccountant::enter(EnergyPhase next) {
+
+  unsigned long now = millis();
+  phaseMillis[phase] += now - phaseStartMillis;
+  phaseStartMillis = now;
+  phase = next;
+
+}
+
+// run time of one pump or valve, supplyMa is the current it draws from the step up module
+void EnergyAccountant::addPump(unsigned long millis, uint16_t supplyMa) {
+
+  pumpMillis += millis;
+  pumpMaMillis += (uint64_t) millis * supplyMa * PUMP_STEP_UP_PERMILLE / 1000;
+
+}
+
+// charge of this wake and of the deep sleep that follows it, call it right before the deep sleep
+void EnergyAccountant::close(EnergyStats& stats, uint64_t sleepMicros) {
+
+  enter(phase);
+  uint64_t maMillis = pumpMaMillis;
+  for (uint8_t i = 0; i < ENERGY_PHASES; i++) {
+    maMillis += (uint64_t) phaseMillis[i] * PHASE_MA[i];
+  }
+  stats.awakeMs = millis();
+  stats.wifiMs = phaseMillis[ENERGY_WIFI];
+  stats.mqttMs = phaseMillis[ENERGY_MQTT];
+  stats.ackWaitMs = phaseMillis[ENERGY_ACK_WAIT];
+  stats.pumpMs = pumpMillis;
+  stats.wakeMicroAh = maMillis / 3600;
+  stats.awakeMicroAh += stats.wakeMicroAh;
+  // µA * µs to µAh rounded to the nearest, a sleep without timer (0) is not accounted
+  stats.sleepMicroAh += (sleepMicros * ENERGY_SLEEP_UA + 1800000000ULL) / 3600000000ULL;
+
+}
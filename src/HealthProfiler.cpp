@@ -0,0 +1,124 @@
+/*
+  HealthProfiler.cpp - Loop latency histogram, heap and stack watermarks
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+*/
+
+#include "HealthProfiler.h"
+
+HealthProfiler healthProfiler;
+
+// nearest ms of a time in us
+static uint32_t toMs(uint64_t micros) {
+
+  return (micros + 500) / 1000;
+
+}
+
+// busy part of one loop() iteration, the idle wait for the next poll is not counted
+void HealthProfiler::addLoop(unsigned long micros) {
+
+  uint32_t ms = micros / 1000;
+  uint8_t bucket = 0;
+  while (bucket < LOOP_HISTOGRAM_SIZE - 1 && ms >= LOOP_HISTOGRAM_BOUNDS_MS[bucket]) {
+    bucket++;
+  }
+  loopHistogram[bucket]++;
+  if (micros > loopMaxMicros) {
+    loopMaxMicros = micros;
+  }
+
+}
+
+void HealthProfiler::addBootstrap(unsigned long micros) {
+
+  if (micros > bootstrapMaxMicros) {
+    bootstrapMaxMicros = micros;
+  }
+
+}
+
+void HealthProfiler::addSend(unsigned long micros) {
+
+  sendCount++;
+  sendTotalMicros += micros;
+  if (micros > sendMaxMicros) {
+    sendMaxMicros = micros;
+  }
+
+}
+
+uint32_t HealthProfiler::loopMaxMs() const {
+
+  return toMs(loopMaxMicros);
+
+}
+
+uint32_t HealthProfiler::bootstrapMaxMs() const {
+
+  return toMs(bootstrapMaxMicros);
+
+}
+
+uint32_t HealthProfiler::sendAvgMs() const {
+
+  return sendCount > 0 ? toMs(sendTotalMicros / sendCount) : 0;
+
+}
+
+uint32_t HealthProfiler::sendMaxMs() const {
+
+  return toMs(sendMaxMicros);
+
+}
+
+// free heap now and its lowest value, cheap enough for every loop
+void HealthProfiler::sampleHeap() {
+
+  freeHeap = Board::freeHeap();
+  if (freeHeap < minFreeHeap) {
+    minFreeHeap = freeHeap;
+  }
+
+}
+
+// the largest free block walks the heap and the stack watermark scans the stack, read them only when they are sent
+void HealthProfiler::sampleWatermarks() {
+
+  sampleHeap();
+  largestFreeBlock = Board::largestFreeBlock();
+  stackFree = Board::stackFree();
+
+}
+
+// first STATE of the wake and then one every HEALTH_REPORT_SECONDS
+bool HealthProfiler::reportDue() {
+
+  if (reported && millis() - lastReportMillis < HEALTH_REPORT_SECONDS * 1000UL) {
+    return false;
+  }
+  reported = true;
+  lastReportMillis = millis();
+  return true;
+
+}
+
+// the report didn't fit the message, the next one carries it
+void HealthProfiler::postpone() {
+
+  reported = false;
+
+}
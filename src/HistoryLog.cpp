@@ -0,0 +1,206 @@
+/*
+  HistoryLog.cpp - Wake history on LittleFS, downsampled from wakes to hours to days
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+*/
+
+#include "HistoryLog.h"
+
+HistoryLog historyLog;
+
+// current and old file of every tier
+const char* const HISTORY_PATHS[TIER_COUNT][2] = {
+  {"/history_wake_cur.bin", "/history_wake_old.bin"},
+  {"/history_hour_cur.bin", "/history_hour_old.bin"},
+  {"/history_day_cur.bin", "/history_day_old.bin"}
+};
+const uint8_t HISTORY_FILES = 2 * TIER_COUNT;
+
+// the partition is formatted the first time, mounted once per wake
+bool HistoryLog::begin() {
+
+  if (!mounted) {
+    mounted = Board::mountFlash();
+  }
+  return mounted;
+
+}
+
+void HistoryLog::append(const HistoryRecord* records, uint8_t count) {
+
+  for (uint8_t i = 0; i < count; i++) {
+    append(TIER_WAKE, records[i]);
+  }
+
+}
+
+void HistoryLog::append(HistoryTier tier, const HistoryRecord &record) {
+
+  File file = LittleFS.open(path(tier, false), "a");
+  if (file && file.size() >= HISTORY_TIER_RECORDS[tier] * sizeof(HistoryRecord)) {
+    file.close();
+    rotate(tier);
+    file = LittleFS.open(path(tier, false), "a");
+  }
+  if (file) {
+    file.write(reinterpret_cast<const uint8_t*>(&record), sizeof(record));
+    file.close();
+  }
+
+}
+
+// The old file is merged into the next tier and deleted, the current one becomes the old one. A power loss before
+// the delete merges the same file again on the next rotation, buckets already in the next tier are skipped.
+void HistoryLog::rotate(HistoryTier tier) {
+
+  if (tier + 1 < TIER_COUNT) {
+    HistoryTier next = static_cast<HistoryTier>(tier + 1);
+    uint32_t nextLast = lastTime(next);
+    File old = openForRead(tier, true);
+    HistoryRecord bucket = {};
+    HistoryRecord record;
+    while (old && old.read(reinterpret_cast<uint8_t*>(&record), sizeof(record)) == sizeof(record)) {
+      if (bucket.wakes > 0 && record.time / HISTORY_TIER_SECONDS[next] == bucket.time / HISTORY_TIER_SECONDS[next]) {
+        merge(bucket, record);
+        continue;
+      }
+      if (bucket.wakes > 0 && bucket.time > nextLast) {
+        append(next, bucket);
+      }
+      bucket = record;
+    }
+    if (bucket.wakes > 0 && bucket.time > nextLast) {
+      append(next, bucket);
+    }
+    if (old) {
+      old.close();
+    }
+  }
+  LittleFS.remove(path(tier, true));
+  LittleFS.rename(path(tier, false), path(tier, true));
+
+}
+
+// time of the newest record of a tier, 0 if the tier is empty
+uint32_t HistoryLog::lastTime(HistoryTier tier) {
+
+  HistoryRecord record;
+  for (bool old : {false, true}) {
+    File file = openForRead(tier, old);
+    bool found = file && lastRecord(file, record);
+    if (file) {
+      file.close();
+    }
+    if (found) {
+      return record.time;
+    }
+  }
+  return 0;
+
+}
+
+// newest record of one file, LittleFS commits a write when the file is closed, records are always whole
+bool HistoryLog::lastRecord(File &file, HistoryRecord &record) {
+
+  size_t records = file.size() / sizeof(record);
+  return records > 0 && file.seek((records - 1) * sizeof(record))
+    && file.read(reinterpret_cast<uint8_t*>(&record), sizeof(record)) == sizeof(record);
+
+}
+
+// the bucket keeps the time of its first record, the mean is weighted by the wakes behind every record
+void HistoryLog::merge(HistoryRecord &bucket, const HistoryRecord &record) {
+
+  uint32_t wakes = bucket.wakes + record.wakes;
+  uint32_t pumpSeconds = bucket.pumpSeconds + record.pumpSeconds;
+  uint32_t failedWakes = bucket.failedWakes + record.failedWakes;
+  bucket.batteryMv = (static_cast<uint32_t>(bucket.batteryMv) * bucket.wakes + static_cast<uint32_t>(record.batteryMv) * record.wakes) / wakes;
+  if (record.batteryMinMv < bucket.batteryMinMv) {
+    bucket.batteryMinMv = record.batteryMinMv;
+  }
+  if (record.batteryMaxMv > bucket.batteryMaxMv) {
+    bucket.batteryMaxMv = record.batteryMaxMv;
+  }
+  bucket.pumpSeconds = pumpSeconds < UINT16_MAX ? pumpSeconds : UINT16_MAX;
+  bucket.wakes = wakes < UINT16_MAX ? wakes : UINT16_MAX;
+  bucket.failedWakes = failedWakes < UINT16_MAX ? failedWakes : UINT16_MAX;
+
+}
+
+// the ESP32 core logs an error for every missing file opened for reading
+File HistoryLog::openForRead(HistoryTier tier, bool old) {
+
+  return LittleFS.exists(path(tier, old)) ? LittleFS.open(path(tier, old), "r") : File();
+
+}
+
+const char* HistoryLog::path(HistoryTier tier, bool old) {
+
+  return HISTORY_PATHS[tier][old ? 1 : 0];
+
+}
+
+/********************************** RANGE QUERY *****************************************/
+// local times, seconds since 1970-01-01, both included
+void HistoryLog::startQuery(uint32_t from, uint32_t to) {
+
+  queryFrom = from;
+  queryTo = to;
+  queryFile = 0;
+  queryOffset = 0;
+  queryActive = true;
+
+}
+
+bool HistoryLog::querying() {
+
+  return queryActive;
+
+}
+
+// Records of the range, oldest first, a chunk never mixes two tiers. It returns 0 records when the range has no more
+// records, querying() is false once the last file has been read.
+uint8_t HistoryLog::nextChunk(HistoryRecord* chunk, HistoryTier &tier) {
+
+  uint8_t count = 0;
+  tier = TIER_WAKE;
+  while (queryActive && count == 0) {
+    tier = static_cast<HistoryTier>(TIER_COUNT - 1 - queryFile / 2);
+    File file = openForRead(tier, queryFile % 2 == 0);
+    HistoryRecord record;
+    // a file that ends before the range starts is not read
+    bool skip = file && queryOffset == 0 && lastRecord(file, record) && record.time < queryFrom;
+    if (file && !skip && file.seek(queryOffset)) {
+      while (count < HISTORY_CHUNK_RECORDS && file.read(reinterpret_cast<uint8_t*>(&record), sizeof(record)) == sizeof(record)) {
+        queryOffset += sizeof(record);
+        if (record.time >= queryFrom && record.time <= queryTo) {
+          chunk[count++] = record;
+        }
+      }
+      if (count == HISTORY_CHUNK_RECORDS) {
+        file.close();
+        return count;
+      }
+    }
+    if (file) {
+      file.close();
+    }
+    queryOffset = 0;
+    queryActive = ++queryFile < HISTORY_FILES;
+  }
+  return count;
+
+}
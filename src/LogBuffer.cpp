@@ -0,0 +1,86 @@
+/*
+  LogBuffer.cpp - Compile-time log levels and an in-RAM log ring buffer
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+*/
+
+#include <stdarg.h>
+#include "LogBuffer.h"
+
+LogBuffer logBuffer;
+
+// one line, milliseconds since boot and level first: "1532 W HA unreachable"
+void LogBuffer::log(char level, const char* format, ...) {
+
+  char line[LOG_LINE_SIZE];
+  int prefix = snprintf(line, sizeof(line), "%lu %c ", millis(), level);
+  va_list args;
+  va_start(args, format);
+  vsnprintf(line + prefix, sizeof(line) - prefix - 1, format, args);
+  va_end(args);
+  size_t count = strlen(line);
+  line[count++] = '\n';
+  for (size_t i = 0; i < count; i++) {
+    data[(written + i) % LOG_BUFFER_SIZE] = line[i];
+  }
+  written += count;
+
+}
+
+// sends at most room bytes to the UART, call it with Serial.availableForWrite() and it never blocks.
+// Lines overwritten before they were sent are lost, the UART resumes from the oldest line still in the ring.
+size_t LogBuffer::drain(Print& out, size_t room) {
+
+  if (written - drained > LOG_BUFFER_SIZE) {
+    drained = written - LOG_BUFFER_SIZE;
+  }
+  size_t count = written - drained;
+  if (count > room) {
+    count = room;
+  }
+  write(drained, count, out);
+  drained += count;
+  return count;
+
+}
+
+// bytes kept in the ring
+size_t LogBuffer::length() {
+
+  return written < LOG_BUFFER_SIZE ? written : LOG_BUFFER_SIZE;
+
+}
+
+// every byte kept in the ring, oldest first, the UART position doesn't change
+void LogBuffer::printTo(Print& out) {
+
+  write(written - length(), length(), out);
+
+}
+
+// the bytes from position from of the stream, in at most two pieces when they wrap around the end of the ring
+void LogBuffer::write(uint32_t from, size_t count, Print& out) {
+
+  size_t start = from % LOG_BUFFER_SIZE;
+  size_t first = count < LOG_BUFFER_SIZE - start ? count : LOG_BUFFER_SIZE - start;
+  if (first > 0) {
+    out.write(reinterpret_cast<const uint8_t*>(data + start), first);
+  }
+  if (count > first) {
+    out.write(reinterpret_cast<const uint8_t*>(data), count - first);
+  }
+
+}
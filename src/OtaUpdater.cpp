@@ -0,0 +1,193 @@
+/*
+  OtaUpdater.cpp - Firmware update pulled over HTTP in upload mode, resumed after a dropped connection
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+*/
+
+#include "OtaUpdater.h"
+
+OtaUpdater otaUpdater;
+
+// manifest checks, nothing is downloaded or written when one of them fails
+bool OtaUpdater::start(const char* manifestUrl, uint32_t imageSize, const char* imageMd5, const char* board) {
+
+  if (active()) {
+    return false;
+  }
+  state = OTA_CONNECT;
+  error = OTA_OK;
+  size = imageSize;
+  offset = 0;
+  resumes = 0;
+  attempts = 0;
+  nextAttemptMillis = millis();
+  reportedState = OTA_IDLE;
+  reportedPercent = 0;
+  if (strncmp(manifestUrl, "http://", 7) != 0 || strlen(manifestUrl) >= OTA_URL_SIZE || strlen(imageMd5) != OTA_MD5_SIZE - 1) {
+    return fail(OTA_ERR_MANIFEST);
+  }
+  if (strcmp(board, Board::FIRMWARE_TARGET) != 0) {
+    return fail(OTA_ERR_BOARD);
+  }
+  if (imageSize < OTA_HEADER_SIZE || imageSize > ESP.getFreeSketchSpace()) {
+    return fail(OTA_ERR_SIZE);
+  }
+  strcpy(url, manifestUrl);
+  strcpy(md5, imageMd5);
+  return true;
+
+}
+
+bool OtaUpdater::active() {
+
+  return state == OTA_CONNECT || state == OTA_DOWNLOAD;
+
+}
+
+// one connection attempt or up to OTA_LOOP_BYTES written, call it from every loop() while active()
+void OtaUpdater::loop() {
+
+  if (state == OTA_CONNECT && millis() >= nextAttemptMillis) {
+    connect();
+  }
+  if (state == OTA_DOWNLOAD) {
+    download();
+  }
+
+}
+
+// GET from the first byte not written yet, a resumed transfer must get the rest of the same file
+void OtaUpdater::connect() {
+
+  if (attempts++ == OTA_MAX_ATTEMPTS) {
+    fail(OTA_ERR_HTTP);
+    return;
+  }
+  nextAttemptMillis = millis() + OTA_RETRY_MS;
+  http.end();
+  http.setTimeout(OTA_STALL_MS);
+  if (!http.begin(client, url)) {
+    fail(OTA_ERR_MANIFEST);
+    return;
+  }
+  if (offset > 0) {
+    char range[24];
+    snprintf(range, sizeof(range), "bytes=%lu-", static_cast<unsigned long>(offset));
+    http.addHeader("Range", range);
+  }
+  int code = http.GET();
+  if (code <= 0) {
+    return; // no connection, retried after OTA_RETRY_MS
+  }
+  // a server without Range support answers 200 and sends the image from the start
+  if (code != (offset > 0 ? HTTP_CODE_PARTIAL_CONTENT : HTTP_CODE_OK)) {
+    fail(OTA_ERR_HTTP);
+    return;
+  }
+  if (http.getSize() != static_cast<int>(size - offset)) {
+    fail(OTA_ERR_SIZE);
+    return;
+  }
+  if (offset > 0) {
+    resumes++;
+  }
+  lastByteMillis = millis();
+  state = OTA_DOWNLOAD;
+
+}
+
+// the update partition is opened only once the header of the image has been checked
+void OtaUpdater::download() {
+
+  WiFiClient* stream = http.getStreamPtr();
+  size_t written = 0;
+  while (written < OTA_LOOP_BYTES && offset < size) {
+    size_t available = stream->available();
+    if (available == 0 || (!updateStarted && available < OTA_HEADER_SIZE)) {
+      break;
+    }
+    size_t chunk = available < OTA_BUFFER_SIZE ? available : OTA_BUFFER_SIZE;
+    chunk = chunk < size - offset ? chunk : size - offset;
+    chunk = stream->read(buffer, chunk);
+    if (!updateStarted) {
+      if (!Board::otaImageValid(buffer)) {
+        fail(OTA_ERR_IMAGE);
+        return;
+      }
+      if (!Update.begin(size)) {
+        fail(OTA_ERR_SIZE);
+        return;
+      }
+      Update.setMD5(md5);
+      updateStarted = true;
+    }
+    if (Update.write(buffer, chunk) != chunk) {
+      fail(OTA_ERR_WRITE);
+      return;
+    }
+    offset += chunk;
+    written += chunk;
+    attempts = 0;
+    lastByteMillis = millis();
+  }
+  if (offset == size) {
+    http.end();
+    updateStarted = false;
+    if (!Update.end()) {
+      fail(OTA_ERR_VERIFY);
+      return;
+    }
+    state = OTA_DONE;
+  } else if (written == OTA_LOOP_BYTES) {
+    Board::notifyEvent(); // more bytes are waiting, don't idle before the next loop
+  } else if ((!http.connected() && stream->available() == 0) || millis() - lastByteMillis > OTA_STALL_MS) {
+    // the bytes written so far are kept, the next connection asks for the rest
+    state = OTA_CONNECT;
+  }
+
+}
+
+uint8_t OtaUpdater::percent() {
+
+  return size > 0 ? static_cast<uint64_t>(offset) * 100 / size : 0;
+
+}
+
+// every state change and every OTA_PROGRESS_STEP % of the download
+bool OtaUpdater::reportDue() {
+
+  uint8_t step = percent() / OTA_PROGRESS_STEP * OTA_PROGRESS_STEP;
+  if (state == reportedState && (state != OTA_DOWNLOAD || step == reportedPercent)) {
+    return false;
+  }
+  reportedState = state;
+  reportedPercent = step;
+  return true;
+
+}
+
+bool OtaUpdater::fail(OtaError reason) {
+
+  http.end();
+  if (updateStarted) {
+    Update.end(); // the image is incomplete, end() discards it
+    updateStarted = false;
+  }
+  error = reason;
+  state = OTA_ERROR;
+  return false;
+
+}
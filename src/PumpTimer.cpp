@@ -0,0 +1,172 @@
+/*
+  PumpTimer.cpp - Water pump run time driven by a hardware timer
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+*/
+
+#include "PumpTimer.h"
+
+PumpTimer pumpTimer;
+
+void PumpTimer::begin() {
+
+#if defined(ESP8266)
+  timer1_attachInterrupt(onTimer);
+#else
+  esp_timer_create_args_t args = {};
+  args.callback = [](void*) { onTimer(); };
+  args.dispatch_method = ESP_TIMER_TASK; // highest priority task, loop() and the Wi-Fi stack can't delay it
+  args.name = "pump";
+  esp_timer_create(&args, &timer);
+#endif
+
+}
+
+// turn on a single pump, the timer turns it off after the given milliseconds
+void PumpTimer::start(uint8_t pin, unsigned long millis) {
+
+  PumpRun run = {pin, 0, millis};
+  start(&run, 1);
+
+}
+
+// run a watering plan, runs starting at 0 are turned on before returning
+void PumpTimer::start(const PumpRun* plan, uint8_t planCount) {
+
+  stop();
+  count = planCount > PUMP_TIMER_CHANNELS ? PUMP_TIMER_CHANNELS : planCount;
+  for (uint8_t i = 0; i < count; i++) {
+    runs[i] = plan[i];
+    // the runs that end after PUMP_TIMER_MAX_MILLIS are cut there
+    if (runs[i].startMillis >= PUMP_TIMER_MAX_MILLIS) {
+      runs[i].durationMillis = 0;
+    } else if (runs[i].durationMillis > PUMP_TIMER_MAX_MILLIS - runs[i].startMillis) {
+      runs[i].durationMillis = PUMP_TIMER_MAX_MILLIS - runs[i].startMillis;
+    }
+    state[i] = runs[i].durationMillis > 0 ? RUN_PENDING : RUN_DONE;
+    onAtMicros[i] = 0;
+    offAtMicros[i] = 0;
+  }
+  active = true;
+  startAtMicros = micros();
+#if defined(ESP8266)
+  timer1_enable(TIM_DIV256, TIM_EDGE, TIM_SINGLE);
+#endif
+  dispatch();
+
+}
+
+// turn off every pump before its time, low battery or shutdown
+void PumpTimer::stop() {
+
+#if defined(ESP8266)
+  timer1_disable();
+#else
+  if (timer != nullptr) {
+    esp_timer_stop(timer);
+  }
+#endif
+  for (uint8_t i = 0; i < count; i++) {
+    digitalWrite(runs[i].pin, LOW); // PHISICALLY TURN OFF THE WATER PUMP
+    if (state[i] == RUN_ON) {
+      offAtMicros[i] = micros();
+    }
+    state[i] = RUN_DONE;
+  }
+  active = false;
+
+}
+
+bool PumpTimer::running() {
+
+  return active;
+
+}
+
+// time every pump of the last plan has actually been on, up to now for the ones that are still running
+unsigned long PumpTimer::onMillis() {
+
+  unsigned long total = 0;
+  for (uint8_t i = 0; i < count; i++) {
+    total += onMillis(i);
+  }
+  return total;
+
+}
+
+unsigned long PumpTimer::onMillis(uint8_t channel) {
+
+  if (channel >= count || onAtMicros[channel] == 0) {
+    return 0;
+  }
+  return ((state[channel] == RUN_ON ? micros() : offAtMicros[channel]) - onAtMicros[channel]) / 1000;
+
+}
+
+// run time needed to deliver the given millilitres with a calibrated flow rate
+unsigned long PumpTimer::doseMillis(uint16_t ml, uint16_t flowMlPerMinute) {
+
+  return (unsigned long) ml * 60000 / flowMlPerMinute;
+
+}
+
+void IRAM_ATTR PumpTimer::onTimer() {
+
+  pumpTimer.dispatch();
+
+}
+
+// switch every run that is due, then arm the timer for the next event
+void IRAM_ATTR PumpTimer::dispatch() {
+
+  unsigned long now = micros();
+  unsigned long elapsed = now - startAtMicros;
+  unsigned long next = 0;
+  for (uint8_t i = 0; i < count; i++) {
+    unsigned long onAt = runs[i].startMillis * 1000;
+    unsigned long offAt = onAt + runs[i].durationMillis * 1000;
+    if (state[i] == RUN_PENDING && elapsed >= onAt) {
+      digitalWrite(runs[i].pin, HIGH); // PHISICALLY TURN ON THE PUMP!!!
+      onAtMicros[i] = now;
+      state[i] = RUN_ON;
+    }
+    if (state[i] == RUN_ON && elapsed >= offAt) {
+      digitalWrite(runs[i].pin, LOW);
+      offAtMicros[i] = now;
+      state[i] = RUN_DONE;
+    }
+    unsigned long wait = state[i] == RUN_PENDING ? onAt - elapsed : (state[i] == RUN_ON ? offAt - elapsed : 0);
+    if (wait > 0 && (next == 0 || wait < next)) {
+      next = wait;
+    }
+  }
+  if (next == 0) {
+    active = false;
+    Board::notifyEvent(); // the watering is over, don't wait for the next poll
+#if defined(ESP8266)
+    timer1_disable();
+#endif
+    return;
+  }
+#if defined(ESP8266)
+  // rounded up, the timer never fires before the event, a wait longer than the counter fires early and it is armed again
+  uint64_t ticks = ((uint64_t) next * 5 + 15) / 16;
+  timer1_write(ticks > PUMP_TIMER_MAX_TICKS ? PUMP_TIMER_MAX_TICKS : ticks);
+#else
+  esp_timer_start_once(timer, next);
+#endif
+
+}
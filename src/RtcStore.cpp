@@ -0,0 +1,72 @@
+/*
+  RtcStore.cpp - State that survives deep sleep
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+*/
+
+#include "RtcStore.h"
+#if defined(ARDUINO_ARCH_ESP32)
+#include <esp_attr.h>
+#endif
+
+RtcStore rtcStore;
+
+#if defined(ARDUINO_ARCH_ESP32)
+RTC_DATA_ATTR static RtcData rtcMemory;
+#endif
+
+// load data from RTC memory, returns false if RTC memory has been lost and data has been reinitialized
+bool RtcStore::load() {
+
+#if defined(ESP8266)
+  ESP.rtcUserMemoryRead(0, reinterpret_cast<uint32_t*>(&data), sizeof(data));
+#else
+  memcpy(&data, &rtcMemory, sizeof(data));
+#endif
+  bool valid = data.magic == RTC_MAGIC && data.crc == checksum();
+  if (!valid) {
+    memset(&data, 0, sizeof(data));
+    data.magic = RTC_MAGIC;
+  }
+  data.wakeCount++;
+  return valid;
+
+}
+
+// save data to RTC memory, call it right before deep sleep
+void RtcStore::save() {
+
+  data.crc = checksum();
+#if defined(ESP8266)
+  ESP.rtcUserMemoryWrite(0, reinterpret_cast<uint32_t*>(&data), sizeof(data));
+#else
+  memcpy(&rtcMemory, &data, sizeof(data));
+#endif
+
+}
+
+// FNV-1a on everything that follows the crc field
+uint32_t RtcStore::checksum() {
+
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&data) + offsetof(RtcData, wakeCount);
+  size_t length = sizeof(data) - offsetof(RtcData, wakeCount);
+  uint32_t hash = 2166136261UL;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ bytes[i]) * 16777619UL;
+  }
+  return hash;
+
+}
@@ -0,0 +1,88 @@
+/*
+  SocEstimator.cpp - State of charge of the battery and charge left for the watering
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+*/
+
+#include "SocEstimator.h"
+
+SocEstimator socEstimator;
+
+// 25°C, C/20 discharge of an NMC 18650, the resting voltage settles on these values a few minutes after the load
+const OcvPoint OCV_CURVE[] = {
+  {3270, 0}, {3610, 50}, {3690, 100}, {3710, 150}, {3730, 200}, {3750, 250}, {3770, 300},
+  {3790, 350}, {3800, 400}, {3820, 450}, {3840, 500}, {3850, 550}, {3870, 600}, {3910, 650},
+  {3950, 700}, {3980, 750}, {4020, 800}, {4080, 850}, {4110, 900}, {4150, 950}, {4200, 1000}
+};
+const uint8_t OCV_POINTS = sizeof(OCV_CURVE) / sizeof(OCV_CURVE[0]);
+// a sag that needs more than this is a bad reading, a loose wire or a dying cell, it is not learned
+const uint32_t MAX_LEARNED_MILLIOHM = 1000;
+
+// state of charge in ‰ of a resting voltage, linear between the points of the curve
+uint16_t SocEstimator::permille(int restingMv) {
+
+  if (restingMv <= OCV_CURVE[0].mv) {
+    return 0;
+  }
+  for (uint8_t i = 1; i < OCV_POINTS; i++) {
+    const OcvPoint &low = OCV_CURVE[i - 1];
+    const OcvPoint &high = OCV_CURVE[i];
+    if (restingMv < high.mv) {
+      return low.permille + (uint32_t) (restingMv - low.mv) * (high.permille - low.permille) / (high.mv - low.mv);
+    }
+  }
+  return 1000;
+
+}
+
+// internal resistance in use, the default one until a pump run has been measured
+uint16_t SocEstimator::milliohm(uint16_t learnedMilliohm) {
+
+  return learnedMilliohm == 0 ? BATTERY_DEFAULT_MILLIOHM : learnedMilliohm;
+
+}
+
+// sag of one pump run drawing loadMa, the resistance moves a quarter of the way towards the measured one
+void SocEstimator::learn(uint16_t& learnedMilliohm, int restingMv, int loadMv, uint32_t loadMa) {
+
+  if (loadMv <= 0 || loadMv >= restingMv || loadMa == 0) {
+    return;
+  }
+  uint32_t measured = (uint32_t) (restingMv - loadMv) * 1000 / loadMa;
+  if (measured > MAX_LEARNED_MILLIOHM) {
+    return;
+  }
+  learnedMilliohm = learnedMilliohm == 0 ? measured : (3 * learnedMilliohm + measured) / 4;
+
+}
+
+// charge in mA * ms the cell can give to a load of loadMa before the resting voltage reaches the water pump cutoff
+// or the voltage under load reaches the ESP cutoff, whichever comes first
+uint64_t SocEstimator::availableMaMillis(int restingMv, uint32_t loadMa, uint16_t learnedMilliohm) {
+
+  uint16_t floor = permille(Board::ESP_CUTOFF_MV + loadMa * milliohm(learnedMilliohm) / 1000);
+  uint16_t reserve = permille(Board::WATER_PUMP_CUTOFF_MV);
+  if (reserve > floor) {
+    floor = reserve;
+  }
+  uint16_t now = permille(restingMv);
+  if (now <= floor) {
+    return 0;
+  }
+  // 1mAh is 3600000 mA * ms, the state of charge is in ‰ of the capacity
+  return (uint64_t) (now - floor) * BATTERY_CAPACITY_MAH * 3600;
+
+}
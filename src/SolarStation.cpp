@@ -38,55 +38,236 @@
 
 /********************************** START SETUP*****************************************/
 void setup() {
-#if defined(ARDUINO_ARCH_ESP32)
-  rgbLedWrite(LED_BUILTIN, 0, 0, 0);
-#endif
+  // reset cause first, every path below depends on it
+  resetCause = Board::resetCause();
+  Board::ledOff();
   // if fastDisconnectionManagement we need to execute the callback immediately,
   // example: power off a watering system can't wait MAX_RECONNECT attemps
   fastDisconnectionManagement = true;
-#if CONFIG_IDF_TARGET_ESP32C3 || CONFIG_IDF_TARGET_ESP32S2 || CONFIG_IDF_TARGET_ESP32S3
-  Serial.setTxTimeoutMs(0);
-#endif
-  Serial.begin(SERIAL_RATE);
+  Board::beginSerial();
+  Board::beginPowerSave();
 
-  pinMode(WATER_PUMP_PIN, OUTPUT); // setup water pump pin
-  digitalWrite(WATER_PUMP_PIN, LOW); // turn off the pump just in case
-
-#if defined(ESP8266)
-  pinMode(OLED_RESET, OUTPUT);  // setup built in ESP led
-  digitalWrite(OLED_RESET, HIGH); // turn off the ESP led
-#else
-  pinMode(ANALOG_IN_PIN, INPUT); //It is necessary to declare the input pin
-#endif
-#if defined(ARDUINO_ARCH_ESP32)
-  rgbLedWrite(LED_BUILTIN, 0, 0, 0);
-#endif
+  // setup the pump and valve pins, turn them off just in case
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+    pinMode(ZONE_TABLE[zone].pin, OUTPUT);
+    digitalWrite(ZONE_TABLE[zone].pin, LOW);
+  }
+  pumpTimer.begin();
+
+  Board::beginLed(); // turn off the ESP led
+  // Sample the battery before the radio draws current from it
+  batterySampler.begin(ANALOG_IN_PIN);
+  batterySampler.sampleResting();
+  bool rtcValid = rtcStore.load();
+  // the ESP8266 reports a press of the button during deep sleep as a timer wake, without a timer it can only be the button.
+  // The mark is consumed here, a later timer wake is a timer wake again.
+  if (resetCause == RESET_TIMER && rtcValid && rtcStore.data.buttonOnlySleep) {
+    resetCause = RESET_BUTTON;
+  }
+  rtcStore.data.buttonOnlySleep = false;
+  handshakeSeq = rtcStore.data.wakeCount << 8; // ACKs from a previous wake never match a message of this wake
+  // a chip that restarts on a nearly empty cell browns out again as soon as the radio is powered up
+  if (isBrownOut()) {
+    brownOutWake();
+  }
+  pushBatteryTrend(rtcValid && isTimerWake() && rtcStore.data.trendSleepMinutes > 0);
+  // Most of the routine wakes only store the battery sample in RTC memory, the radio stays off
+  if (rtcValid && isSampleOnlyWake()) {
+    sampleOnlyWake();
+  }
+  if (resetCause == RESET_TIMER) {
+    bootPath = BOOT_TELEMETRY;
+  } else if (resetCause == RESET_BUTTON) {
+    buttonWake();
+  }
+  rtcStore.data.lastBatteryMv = batterySampler.restingMv;
+  buildDeviceId();
+  // stations powered on together don't reach HA in the same second, the radio is still off
+  if (bootPath == BOOT_FULL) {
+    bootJitterMillis = bootJitter();
+    delay(bootJitterMillis);
+  }
+  // Associate with the access point cached in RTC memory, static IP, no scan, no DHCP
+  unsigned long wifiStartMillis = millis();
+  energyAccountant.enter(ENERGY_WIFI);
+  wifiFastConnect = rtcValid && fastWifiConnect();
   // Bootsrap setup() with Wifi and MQTT functions
   bootstrapManager.bootstrapSetup(manageDisconnections, manageHardwareButton, callback);
+  wifiAssociationMillis = millis() - wifiStartMillis;
+  energyAccountant.enter(ENERGY_MQTT);
+  cacheWifiAccessPoint();
+
+  Board::ledOff();
+  // Routine timer wake, use the cached config optimistically. HA pushes a new config only if it has changed.
+  // Upload mode is never restored from cache, the microcontroller would stay awake on a stale config.
+  if (rtcValid && rtcStore.data.configValid && !rtcStore.data.config.uploadMode && isTimerWake()) {
+    mqttConfig = rtcStore.data.config;
+    configFromCache = true;
+    applyMQTTConfig();
+  }
+}
+
+/********************************** WAKE REASON *****************************************/
+bool isTimerWake() {
+
+  return resetCause == RESET_TIMER;
+
+}
+
+// A timer wake that HA dates well before the end of the sleep is a press of the button during the sleep.
+// The deep sleep timer of the ESP8266 runs on an RC oscillator, a wake a few percent early is still the timer.
+bool isEarlyWake(uint32_t haSeconds) {
+
+  uint32_t tolerance = rtcStore.data.sleepSeconds / 8 + EARLY_WAKE_MIN_SECONDS;
+  return isTimerWake() && rtcStore.data.clockValid && haSeconds + tolerance < localTime();
+
+}
+
+// someone is in front of the station, stay awake for OTA without waiting for HA
+void buttonWake() {
+
+  resetCause = RESET_BUTTON;
+  bootPath = BOOT_INTERACTIVE;
+  interactiveSession = true;
+  uploadMode = true;
+  nowMillisSendStatus = millis();
+
+}
+
+// the ESP8266 doesn't report brown-outs, a power on below ESP_CUTOFF is handled the same way.
+// A button press below ESP_CUTOFF too, an interactive session would keep the radio on for an hour on an empty cell.
+bool isBrownOut() {
+
+  return resetCause == RESET_BROWNOUT
+    || ((resetCause == RESET_POWER_ON || resetCause == RESET_CRASH || resetCause == RESET_BUTTON) && batterySampler.restingMv < ESP_CUTOFF);
+
+}
+
+// the radio is never turned on, the count is reported by the next STATE delivered to HA
+void brownOutWake() {
+
+  bootPath = BOOT_BROWNOUT;
+  if (rtcStore.data.brownOuts < UINT8_MAX) {
+    rtcStore.data.brownOuts++;
+  }
+  rtcStore.data.lastBatteryMv = batterySampler.restingMv;
+  espSleepTime = BROWNOUT_SLEEP_MINUTES * 60e6;
+  recordHistory();
+  advanceClock(espSleepTime);
+  Board::radioOff();
+  accountEnergy(espSleepTime);
+  rtcStore.save();
+  Board::deepSleep(espSleepTime);
+
+}
+
+/********************************** SAMPLE ONLY WAKE *****************************************/
+// radio-free wake on the cached config, telemetry is sent in batch every batchWakes wakes or as soon as a cutoff is crossed
+bool isSampleOnlyWake() {
+
+  const MQTTConfig &config = rtcStore.data.config;
+  if (!isTimerWake() || !rtcStore.data.configValid || config.uploadMode || config.pumpActive || config.batchWakes <= 1) {
+    return false;
+  }
+  if (rtcStore.data.wakesSinceFlush + 1 >= config.batchWakes || rtcStore.data.historyCount >= BATTERY_HISTORY_SIZE) {
+    return false;
+  }
+  int mv = batterySampler.restingMv;
+  int lastMv = rtcStore.data.lastBatteryMv;
+  if (mv < ESP_CUTOFF || ((mv < WATER_PUMP_CUTOFF) != (lastMv < WATER_PUMP_CUTOFF))) {
+    return false;
+  }
+  return true;
+
+}
+
+void sampleOnlyWake() {
+
+  bootPath = BOOT_SAMPLE;
+  pushBatteryHistory(batterySampler.restingMv);
+  recordHistory();
+  rtcStore.data.lastBatteryMv = batterySampler.restingMv;
+  rtcStore.data.wakesSinceFlush++;
+  // the sleep of the cached config, the clock and the energy are advanced by it
+  mqttConfig = rtcStore.data.config;
+  applyMQTTConfig();
+  advanceClock(espSleepTime);
+  Board::radioOff();
+  accountEnergy(espSleepTime);
+  rtcStore.save();
+  Board::deepSleep(espSleepTime);
+
+}
+
+void pushBatteryHistory(uint16_t mv) {
+
+  rtcStore.data.batteryHistory[rtcStore.data.historyHead] = mv;
+  rtcStore.data.historyHead = (rtcStore.data.historyHead + 1) % BATTERY_HISTORY_SIZE;
+  if (rtcStore.data.historyCount < BATTERY_HISTORY_SIZE) {
+    rtcStore.data.historyCount++;
+  }
+
+}
+
+// the oldest samples have been delivered to HA, the newer ones wait for the next STATE
+void clearBatteryHistory(uint8_t count) {
+
+  rtcStore.data.historyCount = count < rtcStore.data.historyCount ? rtcStore.data.historyCount - count : 0;
+  rtcStore.data.wakesSinceFlush = 0;
+
+}
+
+/********************************** FAST WIFI CONNECT *****************************************/
+bool fastWifiConnect() {
+
+  if (!rtcStore.data.wifiValid) {
+    return false;
+  }
+  IPAddress ip, gateway, subnet;
+  ip.fromString(MICROCONTROLLER_IP);
+  gateway.fromString(GATEWAY_IP);
+  subnet.fromString(SUBNET_IP);
+  WiFi.persistent(false); // don't wear the flash writing the same credentials on every wake
+  WiFi.mode(WIFI_STA);
+  WiFi.config(ip, gateway, subnet);
+  WiFi.begin(WIFI_SSID, WIFI_PWD, rtcStore.data.wifiChannel, rtcStore.data.wifiBssid, true);
+  unsigned long startMillis = millis();
+  while (WiFi.status() != WL_CONNECTED) {
+    if (millis() - startMillis > FAST_WIFI_CONNECT_TIMEOUT) {
+      // access point moved to another channel or replaced, forget it and let bootstrapSetup() scan
+      LOG_WARN("Fast Wi-Fi connect failed, falling back to full scan");
+      rtcStore.data.wifiValid = false;
+      WiFi.disconnect();
+      return false;
+    }
+    delay(DELAY_10);
+  }
+  return true;
+
+}
+
+// save the access point of this association, next wake skips the scan
+void cacheWifiAccessPoint() {
+
+  if (WiFi.status() == WL_CONNECTED) {
+    memcpy(rtcStore.data.wifiBssid, WiFi.BSSID(), sizeof(rtcStore.data.wifiBssid));
+    rtcStore.data.wifiChannel = WiFi.channel();
+    rtcStore.data.wifiValid = true;
+  }
 
-#if CONFIG_IDF_TARGET_ESP32C3 || CONFIG_IDF_TARGET_ESP32S2 || CONFIG_IDF_TARGET_ESP32S3
-  // Use 12 bit width (analog reading up to 4095), with DB_11 attenuation (up to 3.1V) on ADC1_CHANNEL_1 (GPIO 2)
-  // https://docs.espressif.com/projects/esp-idf/en/v4.4/esp32s3/api-reference/peripherals/adc.html
-  // NOTE those lines where commented in the migration from Arduino Core 2 to Core 3
-  // adc1_config_width(ADC_WIDTH_BIT_12);
-  // adc1_config_channel_atten(ADC1_CHANNEL_1, ADC_ATTEN_DB_12);
-#endif
-  readAnalogBatteryLevel();
-#if defined(ARDUINO_ARCH_ESP32)
-  rgbLedWrite(LED_BUILTIN, 0, 0, 0);
-#endif
 }
 
 /********************************** MANAGE WIFI AND MQTT DISCONNECTION *****************************************/
 void manageDisconnections() {
 
-  // Shut down water pump on small disconnections
-  if (wifiReconnectAttemp > 10 || mqttReconnectAttemp > 10) {
-      digitalWrite(WATER_PUMP_PIN, LOW);      
+  // Wi-Fi or broker down, don't stay awake for MAX_RECONNECT attemps, water on the local schedule and back off
+  if ((wifiReconnectAttemp > 0 || mqttReconnectAttemp > 0) && millis() > awakeBudget()) {
+      offlineWake();
   }
-  // Shut down ESP on MAX_RECONNECT attemp
-  if (wifiReconnectAttemp > MAX_RECONNECT || mqttReconnectAttemp > MAX_RECONNECT) {
-      espDeepSleep(false, true);
+  if (wifiReconnectAttemp > 0) {
+    energyAccountant.enter(ENERGY_WIFI);
+  } else if (mqttReconnectAttemp > 0) {
+    energyAccountant.enter(ENERGY_MQTT);
   }
 
 }
@@ -94,13 +275,72 @@ void manageDisconnections() {
 /********************************** MQTT SUBSCRIPTIONS *****************************************/
 void manageQueueSubscription() {
 
-  bootstrapManager.subscribe(SOLAR_STATION_UPLOADMODE_TOPIC);      
-  bootstrapManager.subscribe(SOLAR_STATION_WATERPUMP_ACTIVE_TOPIC);      
-  bootstrapManager.subscribe(SOLAR_STATION_MQTT_CONFIG, 1);      
-  bootstrapManager.subscribe(SOLAR_STATION_MQTT_ACK);
+  energyAccountant.enter(ENERGY_ACK_WAIT);
+  bootstrapManager.subscribe(stationTopic(SOLAR_STATION_UPLOADMODE_TOPIC));      
+  bootstrapManager.subscribe(stationTopic(SOLAR_STATION_WATERPUMP_ACTIVE_TOPIC));      
+  bootstrapManager.subscribe(stationTopic(SOLAR_STATION_MQTT_CONFIG), 1);      
+  bootstrapManager.subscribe(stationTopic(SOLAR_STATION_MQTT_ACK));
+  bootstrapManager.subscribe(stationTopic(SOLAR_STATION_LOG_TOPIC));
+  bootstrapManager.subscribe(stationTopic(SOLAR_STATION_HISTORY_TOPIC));
+  bootstrapManager.subscribe(stationTopic(SOLAR_STATION_OTA_TOPIC));
       
 }
 
+/********************************** MQTT TOPICS *****************************************/
+// ID of this station in its topics, the same firmware can be flashed on every station of a fleet
+void buildDeviceId() {
+
+#ifdef DEVICE_ID
+  snprintf(deviceId, sizeof(deviceId), "%s", DEVICE_ID);
+#else
+  uint8_t mac[6];
+  WiFi.macAddress(mac);
+  snprintf(deviceId, sizeof(deviceId), "%.25s_%02x%02x%02x", WIFI_DEVICE_NAME, mac[3], mac[4], mac[5]);
+#endif
+  // MQTT wildcards and level separators can't be part of a topic level
+  for (char* c = deviceId; *c != '\0'; c++) {
+    *c = (*c == '/' || *c == '+' || *c == '#' || *c == ' ') ? '_' : tolower(*c);
+  }
+
+}
+
+// FNV-1a of the station ID, the same station always waits the same time and two stations rarely do
+unsigned long bootJitter() {
+
+  uint32_t hash = 2166136261UL;
+  for (const char* c = deviceId; *c != '\0'; c++) {
+    hash = (hash ^ static_cast<uint8_t>(*c)) * 16777619UL;
+  }
+  return hash % (BOOT_JITTER_MS + 1);
+
+}
+
+// topic with the ID of this station in place of "+", valid until the next call
+const char* stationTopic(const char* topic) {
+
+  const char* wildcard = strchr(topic, '+');
+  snprintf(topicBuffer, sizeof(topicBuffer), "%.*s%s%s", static_cast<int>(wildcard - topic), topic, deviceId, wildcard + 1);
+  return topicBuffer;
+
+}
+
+// mqttId() of the topic with "+" in place of the ID, 0 if the topic belongs to another station
+uint32_t topicId(const char* topic) {
+
+  const char* id = strchr(topic, '/');
+  size_t idLength = strlen(deviceId);
+  if (id == nullptr || strncmp(id + 1, deviceId, idLength) != 0 || id[idLength + 1] != '/') {
+    return 0;
+  }
+  uint32_t hash = 2166136261UL;
+  for (const char* c = topic; c <= id; c++) {
+    hash = (hash ^ static_cast<uint8_t>(*c)) * 16777619UL;
+  }
+  hash = (hash ^ static_cast<uint8_t>('+')) * 16777619UL;
+  return mqttId(id + idLength + 1, hash);
+
+}
+
 /********************************** MANAGE HARDWARE BUTTON *****************************************/
 void manageHardwareButton() {
 
@@ -111,138 +351,324 @@ void manageHardwareButton() {
 /********************************** START CALLBACK *****************************************/
 void callback(char* topic, byte* payload, unsigned int length) {
 
-  JsonDocument json = bootstrapManager.parseQueueMsg(topic, payload, length);
+  // the MQTT client reads one message per poll, more messages may be waiting, poll again without idling
+  Board::notifyEvent();
+  // messages for another station sharing the broker are dropped before parsing them
+  uint32_t id = topicId(topic);
+  if (id == 0) {
+    return;
+  }
+  mqttJson.clear();
+  jsonArena.reset();
+  const char* value;
+  DeserializationError error = deserializeJson(mqttJson, payload, length);
+  if (error) {
+    // a JSON that doesn't fit the arena or is truncated would read as an all zero config, it's dropped, HA sends it again
+    if (id == mqttId(SOLAR_STATION_MQTT_CONFIG) || id == mqttId(SOLAR_STATION_HISTORY_TOPIC) || id == mqttId(SOLAR_STATION_OTA_TOPIC)) {
+      LOG_WARN("MQTT MESSAGE DROPPED, TOPIC=%s ERROR=%s", topic, error.c_str());
+      return;
+    }
+    // not a JSON, the whole payload is the value
+    size_t valueLength = length < sizeof(plainPayload) - 1 ? length : sizeof(plainPayload) - 1;
+    memcpy(plainPayload, payload, valueLength);
+    plainPayload[valueLength] = '\0';
+    value = plainPayload;
+  } else {
+    value = mqttJson[VALUE] | "";
+  }
 
-  if(strcmp(topic, SOLAR_STATION_MQTT_CONFIG) == 0) {
-    processMQTTConfig(json);
-  } else if(strcmp(topic, SOLAR_STATION_MQTT_ACK) == 0) {
-    processAckTopic(json);
-  } else if(strcmp(topic, SOLAR_STATION_UPLOADMODE_TOPIC) == 0) {
-    processUploadModeJson(json);
-  } 
+  switch (id) {
+    case mqttId(SOLAR_STATION_MQTT_CONFIG):
+      processMQTTConfig(mqttJson.as<JsonVariantConst>());
+      break;
+    case mqttId(SOLAR_STATION_MQTT_ACK):
+      processAckTopic(mqttId(value), mqttJson.as<JsonVariantConst>());
+      break;
+    case mqttId(SOLAR_STATION_UPLOADMODE_TOPIC):
+      processUploadMode(value);
+      break;
+    case mqttId(SOLAR_STATION_LOG_TOPIC):
+      // the station is awake long enough to be asked only in upload mode
+      if (uploadMode) {
+        sendLog();
+      }
+      break;
+    case mqttId(SOLAR_STATION_HISTORY_TOPIC):
+      if (uploadMode) {
+        processHistoryRequest(mqttJson.as<JsonVariantConst>());
+      }
+      break;
+    case mqttId(SOLAR_STATION_OTA_TOPIC):
+      if (uploadMode) {
+        processOtaRequest(mqttJson.as<JsonVariantConst>());
+      }
+      break;
+    default: break;
+  }
 
 }
 
 /********************************** START PROCESS JSON *****************************************/
-bool processMQTTConfig(JsonDocument json) {
+// the largest CONFIG HA sends, every value is a string as long as the RTC config keeps or a number up to 8 chars
+const size_t CONFIG_KEY_CHARS = sizeof("time" "config_tag" "upload_mode" "pump_active" "zones" "seconds" "ml" "esp_sleep_time_minutes"
+    "batch_wakes" "sleep_min_minutes" "sleep_max_minutes" "water_defer_hours" "water_time" "pump_seconds" "pump_ml") - 1;
+const size_t CONFIG_VALUE_CHARS = sizeof(MQTTConfig::time) - 1 + sizeof(MQTTConfig::tag) - 1 + (8 + MAX_WATER_ZONES * 2) * 8;
+static_assert(jsonArenaBytes(13 * 2 + MAX_WATER_ZONES * 5, 15 + 10 + MAX_WATER_ZONES * 2, CONFIG_KEY_CHARS + CONFIG_VALUE_CHARS) <= JSON_ARENA_SIZE,
+              "JSON_ARENA_SIZE is too small for the largest CONFIG");
+
+// HA sends every value as a string, ArduinoJson converts numeric strings when asked for a number
+bool processMQTTConfig(JsonVariantConst json) {
+
+  MQTTConfig config = {};
+  snprintf(config.time, sizeof(config.time), "%s", json["time"] | "");
+  snprintf(config.tag, sizeof(config.tag), "%s", json["config_tag"] | "");
+
+  config.uploadMode = strcmp(json["upload_mode"] | "", on_CMD.c_str()) == 0;
+  config.pumpActive = strcmp(json["pump_active"] | "", on_CMD.c_str()) == 0;
+  // one object per zone in table order, the old HA package sends pump_seconds and pump_ml for the first zone only
+  JsonArrayConst zones = json["zones"];
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+    long seconds, ml;
+    if (!zones.isNull()) {
+      seconds = zones[zone]["seconds"].as<long>();
+      ml = zones[zone]["ml"].as<long>();
+    } else if (zone == 0) {
+      seconds = json["pump_seconds"].as<long>();
+      ml = json["pump_ml"].as<long>();
+    } else {
+      seconds = ZONE_TABLE[zone].seconds;
+      ml = 0;
+    }
+    config.zones[zone].seconds = seconds > 65535 ? 65535 : (seconds < 0 ? 0 : seconds);
+    config.zones[zone].ml = ml > 65535 ? 65535 : (ml < 0 ? 0 : ml);
+  }
+  config.espSleepTimeMinutes = json["esp_sleep_time_minutes"].as<float>();
+  long batchWakes = json["batch_wakes"].as<long>();
+  config.batchWakes = batchWakes > 255 ? 255 : (batchWakes < 0 ? 0 : batchWakes);
+  // sleep bounds and watering deferral are optional, an old HA package doesn't send them and nothing adapts
+  long sleepMin = json["sleep_min_minutes"].as<long>();
+  long sleepMax = json["sleep_max_minutes"].as<long>();
+  long deferHours = json["water_defer_hours"].as<long>();
+  config.sleepMinMinutes = sleepMin > 60 ? 60 : (sleepMin < 0 ? 0 : sleepMin);
+  config.sleepMaxMinutes = sleepMax > 60 ? 60 : (sleepMax < 0 ? 0 : sleepMax);
+  config.waterDeferHours = deferHours > 255 ? 255 : (deferHours < 0 ? 0 : deferHours);
+  // HA doesn't ask to water anymore, a watering postponed by the battery is forgotten
+  if (!config.pumpActive) {
+    rtcStore.data.deferredSince = 0;
+  }
+  unsigned int waterHour, waterMinute;
+  if (sscanf(json["water_time"] | "", "%u:%u", &waterHour, &waterMinute) == 2 && waterHour < 24 && waterMinute < 60) {
+    config.waterMinute = waterHour * 60 + waterMinute;
+  } else {
+    config.waterMinute = NO_WATERING_SCHEDULE;
+  }
+  syncClock(config.time);
+
+  // messages sent optimistically with a cached config that HA has just replaced must be sent again
+  if (configFromCache && strcmp(config.tag, mqttConfig.tag) != 0) {
+    resetHandshake();
+  }
+  mqttConfig = config;
+  configFromCache = false;
+  configConfirmed = true;
+  applyMQTTConfig();
+
+  // cache the config for the next routine wake, without a config_tag (old HA package) HA can't tell when it changes
+  rtcStore.data.configValid = strlen(config.tag) > 0;
+  rtcStore.data.config = config;
+  return true;
+
+}
 
-  timedate = helper.getValue(json["time"]);
+void applyMQTTConfig() {
 
-  String uploadModeStr = json["upload_mode"];
-  uploadMode = uploadModeStr == on_CMD;
+  timedate = mqttConfig.time;
+
+  uploadMode = mqttConfig.uploadMode || interactiveSession;
   if (uploadMode) {
     nowMillisSendStatus = millis(); // reset the counter, first ten seconds the blu led will be on
   }
 
-  String waterPumpActiveStr = json["pump_active"];
-  waterPumpActive = waterPumpActiveStr == on_CMD;
+  waterPumpActive = mqttConfig.pumpActive;
 
-  // reconnection can cause mqttConfig to be reprocessed. don't reinitialize number of attemps
-  if (!dataMQTTReceived) {
-    if (waterPumpActive) {
-      number_of_attemps = number_of_attemps - 6;
-    } else {
-      number_of_attemps = number_of_attemps - 4;
-    }
-  }
-  
-  String pumpSecondsStr = json["pump_seconds"];
-  waterPumpSecondsOn = pumpSecondsStr.toDouble() * 1000;
+  waterPumpSecondsOn = planWatering();
 
-  String espSleepTimeMinutesStr = json["esp_sleep_time_minutes"];
-  
   // if sleepTime is 1 sleep 1 second, if it's 61 sleep forever, sleep N minutes otherwise
-  if ((espSleepTimeMinutesStr.toDouble() >= 1)) {
-    espSleepTime = (espSleepTimeMinutesStr.toDouble() * 60 * 1000000);
+  if ((mqttConfig.espSleepTimeMinutes >= 1)) {
+    espSleepTime = (mqttConfig.espSleepTimeMinutes * 60 * 1000000);
   } else {
     espSleepTime = (1e6);
   }
-  if ((espSleepTimeMinutesStr.toDouble() >= 61)) {
+  if ((mqttConfig.espSleepTimeMinutes >= 61)) {
     espSleepTime = 0; // 0 means sleep forever
+  } else if ((mqttConfig.espSleepTimeMinutes >= 1)) {
+    espSleepTime = adaptSleepMinutes(mqttConfig.espSleepTimeMinutes) * 60 * 1000000;
   }
 
   // dataMQTTReceived enables sketch processing, we do our things only after MQTT config has been received
   dataMQTTReceived = true;
 
-  // Reset the millis used for water pump activity
-  nowMillisWaterPumpStatus = millis();
   // Reset the millis used for send status activity
   nowMillisSendStatus = millis();
   // Reset the millis used for force deep sleep after 15 minutes
   nowMillisForceDeepSleepStatus = millis();
-  // Reset the millis used for MQTT QoS1
-  onStateNowMillis = millis();
-  offStateNowMillis = millis();
-  waterPumpPowerStateOnNowMillis = millis();
-  waterPumpPowerStateOffNowMillis = millis();
-  sensorStateNowMillis = millis();
-  waterPumpActiveStateOffNowMillis = millis();
-
-  // if battery analog level is below 3700 (3.7V) the microcontroller can continue to wake up and sleep but it can't turn on the water pump
-  int batteryVoltage = readAnalogBatteryLevel();
-  waterPumpCutOff = (batteryVoltage < WATER_PUMP_CUTOFF);
-  // if battery analog level is below 3500 (3.5V) hard cut off
-  espCutOff = (batteryVoltage < ESP_CUTOFF);
-  return true;
+
+  // if battery is below WATER_PUMP_CUTOFF the microcontroller can continue to wake up and sleep but it can't turn on the water pump,
+  // the same happens when the battery model leaves too little charge for the watering
+  waterPumpCutOff = (batterySampler.restingMv < WATER_PUMP_CUTOFF) || wateringPercent == 0;
+  // if battery is below ESP_CUTOFF hard cut off
+  espCutOff = (batterySampler.restingMv < ESP_CUTOFF);
 
 }
 
 // ACK Automation for custom implementation of QoS1 in pubsubclient that doesn't support QoS1 for publish if not for subscribe
-bool processAckTopic(JsonDocument json) {
-
-    String ackMsg = json[VALUE];
-
-    if (ackMsg == "sendOnState") {
-      onStateAckReceived = true;
-    } else if (ackMsg == "sendOffState") {
-      offStateAckReceived = true;
-    } else if (ackMsg == "sendWaterPumpPowerStateOff") {
-      waterPumpPowerStateOffAckReceived = true;
-    } else if (ackMsg == "sendWaterPumpPowerStateOn") {
-      waterPumpPowerStateOnAckReceived = true;
-      waterPumpPower = true;
-      // This runs until the pump is off if the batt voltage is greater than 3.6V
-      digitalWrite(WATER_PUMP_PIN, HIGH); // PHISICALLY TURN ON THE PUMP!!!
-      // Turning on water pump, resetting the millis counter used to turn it off
-      nowMillisWaterPumpStatus = millis();
-    } else if (ackMsg == "sendSensorState") {
-      sensorStateAckReceived = true;
-    } else if (ackMsg == "sendWaterPumpActiveStateOff") {
-      waterPumpActiveStateOffAckReceived = true;
+// ACKs can arrive in any order, an ACK without seq (plain text or old HA package) is matched by name only.
+// HA echoes seq 0 for the STATE sent without one, it must not ack a sequenced STATE still waiting
+bool processAckTopic(uint32_t ackId, JsonVariantConst json) {
+
+    bool sequenced = !json["seq"].isNull();
+    uint16_t seq = json["seq"].as<uint16_t>();
+
+    for (uint8_t msg = 0; msg < MSG_COUNT; msg++) {
+      HandshakeSlot &slot = handshake[msg];
+      if (ackId == HANDSHAKE_ACK_IDS[msg] && slot.queued && !slot.acked && (!sequenced || seq == slot.seq)) {
+        slot.acked = true;
+        if (msg == MSG_ON_STATE) {
+          // HA confirms the cached config when it has not changed, it does not send a new config in that case
+          if (json["config_changed"].is<bool>() && !json["config_changed"].as<bool>() && dataMQTTReceived) {
+            configConfirmed = true;
+          }
+          rtcStore.data.connectionFailures = 0; // HA is reachable again, back to the configured sleep time
+          const char* ackTime = json["time"];
+          if (ackTime != nullptr) {
+            timedate = ackTime;
+            syncClock(ackTime);
+          }
+        }
+        // a late ACK of the message queued again by resetHandshake() would water a second time
+        if (msg == MSG_PUMP_POWER_ON && !pumpTimer.running() && pumpTimer.onMillis() == 0) {
+          waterPumpPower = true;
+          // the timer runs every zone of the plan, whatever loop() is doing
+          pumpTimer.start(wateringPlan, ZONE_COUNT);
+          nowMillisBatteryLoad = millis();
+          wateringMillis = waterPumpSecondsOn;
+        }
+      }
     }
     
     return true;
 
 }
 
-bool processUploadModeJson(JsonDocument json) {
+bool processUploadMode(const char* value) {
 
-    uploadMode = (helper.isOnOff(json) == ON_CMD);
-    Serial.println();
-    Serial.print("UPLOAD_MODE= "); Serial.println(uploadMode);    
-    Serial.println();
+    uploadMode = strcmp(value, ON_CMD.c_str()) == 0;
+    interactiveSession = interactiveSession && uploadMode;
+    LOG_INFO("UPLOAD_MODE= %d", uploadMode);
     return true;
 
 }
 
-/********************************** SEND STATE *****************************************/
-void sendSensorState() {
+/********************************** MQTT HANDSHAKE *****************************************/
+// queue a message that needs an ACK, queueing an already queued message does nothing
+void queueMessage(HandshakeMsg msg) {
+
+  HandshakeSlot &slot = handshake[msg];
+  if (!slot.queued) {
+    slot.queued = true;
+    slot.sent = false;
+    slot.acked = false;
+    slot.seq = ++handshakeSeq;
+    // seq 0 is the STATE sent without a seq
+    if (slot.seq == 0) {
+      slot.seq = ++handshakeSeq;
+    }
+    handshakeOrder[handshakeQueued++] = msg;
+  }
 
-  if(millis() > sensorStateNowMillis + DELAY_1000){
-    sensorStateNowMillis = millis();
-    number_of_attemps++;
-    sendSensorStateNotTimed();
+}
+
+// forget every message but the ON state, used when the plan for this wake changes
+void resetHandshake() {
+
+  enterWakeState(WAKE_CONFIG);
+  handshakeQueued = 0;
+  for (uint8_t msg = 0; msg < MSG_COUNT; msg++) {
+    if (msg != MSG_ON_STATE) {
+      handshake[msg] = HandshakeSlot();
+    } else if (handshake[msg].queued) {
+      handshakeOrder[handshakeQueued++] = MSG_ON_STATE;
+    }
   }
 
 }
-void sendSensorStateNotTimed() {  
+
+bool isAcked(HandshakeMsg msg) {
+
+  return handshake[msg].queued && handshake[msg].acked;
+
+}
+
+bool isHandshakeComplete() {
+
+  for (uint8_t i = 0; i < handshakeQueued; i++) {
+    if (!handshake[handshakeOrder[i]].acked) {
+      return false;
+    }
+  }
+  return true;
+
+}
+
+// send every queued message that is not acked yet back to back, up to handshakeWindow messages in flight.
+// A message that has not been acked after a second is retransmitted, ACKed ones are never sent again.
+void flushHandshake() {
+
+  uint8_t inFlight = 0;
+  for (uint8_t i = 0; i < handshakeQueued && inFlight < handshakeWindow; i++) {
+    HandshakeMsg msg = handshakeOrder[i];
+    HandshakeSlot &slot = handshake[msg];
+    if (slot.acked) {
+      continue;
+    }
+    inFlight++;
+    if (!slot.sent || millis() > slot.sentMillis + WAKE_STATES[wakeState].retryMillis) {
+      if (slot.sent) {
+        number_of_attemps++;
+      }
+      slot.sent = true;
+      slot.sentMillis = millis();
+      sendHandshakeMessage(msg);
+    }
+  }
+
+}
+
+void sendHandshakeMessage(HandshakeMsg msg) {
+
+  unsigned long sendStartMicros = micros();
+  switch (msg) {
+    case MSG_ON_STATE: sendOnOffState(ON_CMD, handshake[msg].seq); break;
+    case MSG_SENSOR_STATE: sendSensorStateNotTimed(handshake[msg].seq); break;
+    case MSG_PUMP_POWER_ON: sendWaterPumpPowerStateOn(); break;
+    case MSG_PUMP_POWER_OFF: sendWaterPumpPowerStateOff(); break;
+    case MSG_PUMP_ACTIVE_OFF: sendWaterPumpActiveStateOff(); break;
+    case MSG_OFF_STATE: sendOnOffState(OFF_CMD, handshake[msg].seq); break;
+    default: break;
+  }
+  healthProfiler.addSend(micros() - sendStartMicros);
+
+}
+
+/********************************** SEND STATE *****************************************/
+void sendSensorStateNotTimed(uint16_t seq) {  
 
   JsonObject root = bootstrapManager.getJsonObject();
 
-  // read analog battery level 
-  int batteryLevelAnalog = readAnalogBatteryLevel();
+  // resting battery voltage sampled on boot, no ADC reads here
+  int batteryMv = batterySampler.restingMv;
 
-  // if the analog value is below 3500 (3.5V) execute an hard cutoff
+  // if the battery is below ESP_CUTOFF execute an hard cutoff
   if (espCutOff) {
     hardCutOff = true;
     root["HARD_CUT_OFF"] = true;
@@ -255,65 +681,207 @@ void sendSensorStateNotTimed() {
     root["WATER_PUMP_CUT_OFF"] = false;
   }
   if (batteryLevelOnboot == -1) {
-    root["battery_level_on_boot"] = batteryLevelAnalog;
-    batteryLevelOnboot = batteryLevelAnalog;
+    root["battery_level_on_boot"] = batteryMv;
+    batteryLevelOnboot = batteryMv;
+  }
+  root["battery"] = batteryMv;
+  if (batterySampler.loadMv > 0) {
+    root["battery_load"] = batterySampler.loadMv;
+  }
+  // state of charge in %, see SocEstimator.h
+  root["soc"] = socEstimator.permille(batteryMv) / 10.0;
+  if (rtcStore.data.batteryMilliohm > 0) {
+    root["battery_mohm"] = rtcStore.data.batteryMilliohm;
   }
-  root["battery"] = batteryLevelAnalog;
   root["frequency"] = ESP.getCpuFreqMHz();  
+  root["wifi_ms"] = wifiAssociationMillis;
+  root["wifi_fast_connect"] = wifiFastConnect;
+  root["wake_reason"] = RESET_CAUSE_NAMES[resetCause];
+  root["boot_path"] = BOOT_PATH_NAMES[bootPath];
+  if (seq != 0) {
+    root["seq"] = seq;
+    // waterings done while HA was unreachable
+    if (rtcStore.data.offlineCount > 0) {
+      JsonArray waterings = root["offline_watering"].to<JsonArray>();
+      for (uint8_t i = 0; i < rtcStore.data.offlineCount; i++) {
+        JsonObject watering = waterings.add<JsonObject>();
+        watering["time"] = rtcStore.data.offline[i].time;
+        watering["pump_seconds"] = rtcStore.data.offline[i].pumpSeconds;
+        watering["battery"] = rtcStore.data.offline[i].batteryMv;
+      }
+    }
+    // charge used by the previous wake and by the station since the last power loss
+    const EnergyStats &stats = rtcStore.data.energy;
+    if (stats.awakeMs > 0) {
+      JsonObject energy = root["energy"].to<JsonObject>();
+      energy["awake_ms"] = stats.awakeMs;
+      energy["wifi_ms"] = stats.wifiMs;
+      energy["mqtt_ms"] = stats.mqttMs;
+      energy["ack_wait_ms"] = stats.ackWaitMs;
+      energy["pump_ms"] = stats.pumpMs;
+      energy["wake_mah"] = stats.wakeMicroAh / 1000.0;
+      energy["total_mah"] = (stats.awakeMicroAh + stats.sleepMicroAh) / 1000.0;
+      energy["sleep_mah"] = stats.sleepMicroAh / 1000.0;
+    }
+    // adaptive sleep, the sleep chosen for this wake before any connection back-off
+    root["sleep_s"] = static_cast<unsigned long>(espSleepTime / 1e6);
+    if (batteryTrendValid) {
+      root["trend_mv_h"] = batteryTrendMvPerHour;
+    }
+    if (wateringDeferred) {
+      root["watering_deferred"] = true;
+    }
+    if (wateringPercent < 100) {
+      root["watering_pct"] = wateringPercent;
+    }
+    if (rtcStore.data.brownOuts > 0) {
+      root["brown_outs"] = rtcStore.data.brownOuts;
+    }
+  }
+  // PubSubClient drops a packet larger than its buffer, a STATE that doesn't fit would never be acked
+  size_t budget = stateBudget(stationTopic(SOLAR_STATION_STATE_TOPIC));
+  // runtime health of this wake, loop and send times in ms, heap and stack in bytes
+  if (healthProfiler.reportDue()) {
+    healthProfiler.sampleWatermarks();
+    JsonObject health = root["health"].to<JsonObject>();
+    JsonArray loopHistogram = health["loop_ms"].to<JsonArray>();
+    for (uint8_t i = 0; i < LOOP_HISTOGRAM_SIZE; i++) {
+      loopHistogram.add(healthProfiler.loopHistogram[i]);
+    }
+    health["loop_max"] = healthProfiler.loopMaxMs();
+    health["bootstrap_max"] = healthProfiler.bootstrapMaxMs();
+    health["sends"] = healthProfiler.sendCount;
+    health["send_avg"] = healthProfiler.sendAvgMs();
+    health["send_max"] = healthProfiler.sendMaxMs();
+    health["heap"] = healthProfiler.freeHeap;
+    health["heap_min"] = healthProfiler.minFreeHeap;
+    health["heap_block"] = healthProfiler.largestFreeBlock;
+    health["stack_free"] = healthProfiler.stackFree;
+    if (measureJson(root) > budget) {
+      root.remove("health");
+      healthProfiler.postpone();
+    }
+  }
+  // battery samples of the radio-free wakes, oldest first, one every esp_sleep_time_minutes, the ones that don't fit wait
+  if (seq != 0 && rtcStore.data.historyCount > 0) {
+    JsonArray history = root["battery_history"].to<JsonArray>();
+    size_t length = measureJson(root);
+    uint8_t sent = 0;
+    for (; sent < rtcStore.data.historyCount; sent++) {
+      uint16_t mv = rtcStore.data.batteryHistory[(rtcStore.data.historyHead + BATTERY_HISTORY_SIZE - rtcStore.data.historyCount + sent) % BATTERY_HISTORY_SIZE];
+      length += snprintf(nullptr, 0, "%u", mv) + (sent > 0 ? 1 : 0);
+      if (length > budget) {
+        break;
+      }
+      history.add(mv);
+    }
+    if (sent == 0) {
+      root.remove("battery_history");
+    }
+    // a retransmission can carry more samples, HA may have acked the one with less
+    stateHistorySent = sent < stateHistorySent ? sent : stateHistorySent;
+  }
   
-  bootstrapManager.sendState(SOLAR_STATION_STATE_TOPIC, root, VERSION); 
+#ifdef TELEMETRY_MSGPACK
+  // fields added by bootstrapManager.sendState(), the bridge forwards the STATE the way the library sends it
+  root["Whoami"] = deviceName;
+  root["IP"] = microcontrollerIP;
+  root["MAC"] = WiFi.macAddress();
+  root["ver"] = VERSION;
+  root["time"] = timedate;
+  long rssi = WiFi.RSSI();
+  root["wifi"] = rssi <= -100 ? 0 : (rssi >= -50 ? 100 : 2 * (rssi + 100));
+  publishTelemetry(stationTopic(SOLAR_STATION_STATE_TOPIC), root);
+#else
+  bootstrapManager.sendState(stationTopic(SOLAR_STATION_STATE_TOPIC), root, VERSION); 
+#endif
 
   delay(DELAY_10);
 
-  // hardCutOff but only if uploadMode is false
-  if (hardCutOff && !uploadMode) {
-    espDeepSleep(true, true);
-  }
-
 }
 
-void sendSensorStateAfterSeconds(int delay) {
+// payload bytes left by the MQTT buffer to a STATE built in the JSON object, the fields added when it is sent are
+// counted with their longest values, MessagePack is never longer than JSON
+size_t stateBudget(const char* topic) {
 
-  if(millis() > nowMillisSendStatus + delay){
-    nowMillisSendStatus = millis();
-    sendSensorStateNotTimed();
-  }
+  size_t fields = sizeof(",\"Whoami\":\"\",\"IP\":\"\",\"MAC\":\"00:00:00:00:00:00\",\"ver\":\"\",\"time\":\"\",\"wifi\":100") - 1
+      + deviceName.length() + microcontrollerIP.length() + strlen(VERSION) + timedate.length();
+  size_t overhead = MQTT_MAX_HEADER_SIZE + 2 + strlen(topic) + fields;
+#ifdef TELEMETRY_MSGPACK
+  overhead += sizeof(TELEMETRY_MSGPACK_SUFFIX) - 1;
+#endif
+  return overhead < MQTT_MAX_PACKET_SIZE ? MQTT_MAX_PACKET_SIZE - overhead : 0;
 
 }
 
-void sendOnState() {    
+// JSON through the library, MessagePack on the "/mp" topic straight through the MQTT client with TELEMETRY_MSGPACK.
+// Booleans and small numbers take one byte, keys and strings are the same, STATE and POWER are a quarter smaller.
+void publishTelemetry(const char* topic, JsonObject root) {
 
-  if(millis() > onStateNowMillis + DELAY_1000){
-    sendOnOffState(ON_CMD, onStateNowMillis);     
-  }
+#ifdef TELEMETRY_MSGPACK
+  size_t length = serializeMsgPack(root, telemetryBuffer, sizeof(telemetryBuffer));
+  char msgpackTopic[sizeof(topicBuffer) + sizeof(TELEMETRY_MSGPACK_SUFFIX)];
+  snprintf(msgpackTopic, sizeof(msgpackTopic), "%s%s", topic, TELEMETRY_MSGPACK_SUFFIX);
+  mqttClient.publish(msgpackTopic, telemetryBuffer, length, false);
+#else
+  bootstrapManager.publish(topic, root, false);
+#endif
 
 }
 
-void sendOffState() {
+void sendSensorStateAfterSeconds(int delay) {
 
-  if(millis() > offStateNowMillis + DELAY_1000){
-    sendOnOffState(OFF_CMD, offStateNowMillis);
+  if(millis() > nowMillisSendStatus + delay){
+    nowMillisSendStatus = millis();
+    unsigned long sendStartMicros = micros();
+    sendSensorStateNotTimed();
+    healthProfiler.addSend(micros() - sendStartMicros);
   }
-  
+
 }
 
-void sendOnOffState(String cmd, unsigned long stateMillis) {
+void sendOnOffState(String cmd, uint16_t seq) {
   
-  number_of_attemps++;
-  Serial.println("SENDING STATE"); Serial.println(cmd);
+  LOG_DEBUG("SENDING STATE %s", cmd.c_str());
 
   JsonObject root = bootstrapManager.getJsonObject();
 
   root["state"] = cmd;
+  root["seq"] = seq;
+  root["config_tag"] = mqttConfig.tag;
   if (cmd == OFF_CMD) {
-    offStateNowMillis = millis();
     root["number_of_attemps"] = number_of_attemps;
+    if (pumpTimer.onMillis() > 0) {
+      // run time measured by the pump timer, the dose delivered with volume dosing
+      root["pump_on_ms"] = pumpTimer.onMillis();
+      unsigned long deliveredMl = 0;
+      for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+        if (mqttConfig.zones[zone].ml > 0) {
+          deliveredMl += pumpTimer.onMillis(zone) * ZONE_TABLE[zone].flowMlPerMinute / 60000;
+        }
+      }
+      if (deliveredMl > 0) {
+        root["pump_ml"] = deliveredMl;
+      }
+      if (ZONE_COUNT > 1) {
+        JsonArray zonesOnMillis = root["zones_on_ms"].to<JsonArray>();
+        for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+          zonesOnMillis.add(pumpTimer.onMillis(zone));
+        }
+      }
+    }
+    // milliseconds spent in every state of this wake, the time spent so far in the sleep state included
+    JsonObject timing = root["timing"].to<JsonObject>();
+    for (uint8_t state = 0; state < WAKE_STATE_COUNT; state++) {
+      if (wakeStateVisits[state] > 0) {
+        timing[WAKE_STATES[state].name] = wakeStateDwell((WakeState) state);
+      }
+    }
   } else {
-    onStateNowMillis = millis();
     root["number_of_attemps"] = 0;
   }
 
-  bootstrapManager.publish(SOLAR_STATION_POWER_TOPIC, root, false);
+  publishTelemetry(stationTopic(SOLAR_STATION_POWER_TOPIC), root);
 
   delay(DELAY_10);
 
@@ -321,50 +889,50 @@ void sendOnOffState(String cmd, unsigned long stateMillis) {
 
 void sendWaterPumpPowerStateOff() {
 
-  if(millis() > waterPumpPowerStateOffNowMillis + DELAY_1000){
-    waterPumpPowerStateOffNowMillis = millis();
-    number_of_attemps++;
-    Serial.println(); 
-    Serial.print("SENDING WATER PUMP POWER STATE OFF");
-    bootstrapManager.publish(SOLAR_STATION_WATERPUMP_POWER_TOPIC, helper.string2char(OFF_CMD), false);
-    delay(DELAY_10);
-  }
+  LOG_DEBUG("SENDING WATER PUMP POWER STATE OFF");
+  bootstrapManager.publish(stationTopic(SOLAR_STATION_WATERPUMP_POWER_TOPIC), helper.string2char(OFF_CMD), false);
+  delay(DELAY_10);
 
 }
 
 void sendWaterPumpPowerStateOn() {
 
-  if(millis() > waterPumpPowerStateOnNowMillis + DELAY_1000){
-    waterPumpPowerStateOnNowMillis = millis();
-    number_of_attemps++;
-    Serial.println(); 
-    Serial.print("SENDING WATER PUMP POWER STATE ON"); 
-    bootstrapManager.publish(SOLAR_STATION_WATERPUMP_POWER_TOPIC, helper.string2char(ON_CMD), false);
-    delay(DELAY_10);
-  }
+  LOG_DEBUG("SENDING WATER PUMP POWER STATE ON");
+  bootstrapManager.publish(stationTopic(SOLAR_STATION_WATERPUMP_POWER_TOPIC), helper.string2char(ON_CMD), false);
+  delay(DELAY_10);
 
 }
 
 void sendWaterPumpActiveStateOff() {
 
-  if(millis() > waterPumpActiveStateOffNowMillis + DELAY_1000){
-    waterPumpActiveStateOffNowMillis = millis();
-    number_of_attemps++;
-    Serial.println(); 
-    Serial.println("SENDING WATER PUMP ACTIVE STATE OFF"); 
-    bootstrapManager.publish(SOLAR_STATION_WATERPUMP_ACTIVE_STAT_TOPIC, helper.string2char(OFF_CMD), false);
-    delay(DELAY_10);
-  }
+  LOG_DEBUG("SENDING WATER PUMP ACTIVE STATE OFF");
+  bootstrapManager.publish(stationTopic(SOLAR_STATION_WATERPUMP_ACTIVE_STAT_TOPIC), helper.string2char(OFF_CMD), false);
+  delay(DELAY_10);
+
+}
+
+// lines kept in the log ring buffer, oldest first, streamed to the MQTT client without a copy
+void sendLog() {
+
+  mqttClient.beginPublish(stationTopic(SOLAR_STATION_LOG_STAT_TOPIC), logBuffer.length(), false);
+  logBuffer.printTo(mqttClient);
+  mqttClient.endPublish();
 
 }
 
 /********************************** WATER PUMP MANAGEMENT (non blocking delay) *****************************************/
 void turnOffWaterPumpAfterSeconds() {
 
-  if(millis() > nowMillisWaterPumpStatus + waterPumpSecondsOn){
-    nowMillisWaterPumpStatus = millis();
+  // the pump timer turns off the pump, here the battery is sampled under load once per second
+  // and the pump is stopped early if it sags below the ESP cutoff
+  if (pumpTimer.running() && millis() > nowMillisBatteryLoad + DELAY_1000) {
+    nowMillisBatteryLoad = millis();
+    if (batterySampler.sampleLoad() < ESP_CUTOFF) {
+      pumpTimer.stop();
+    }
+  }
+  if (!pumpTimer.running()) {
     waterPumpPower = false;
-    digitalWrite(WATER_PUMP_PIN, LOW); // PHISICALLY TURN OFF THE WATER PUMP
   }
 
 }
@@ -373,12 +941,12 @@ void turnOffWaterPumpAfterSeconds() {
 // Note: to achieve timed deepSleep you need to connect D0 with RST pin
 void espDeepSleep(bool sendState, bool hardCutOff) {
 
-  // if sendState is required, shutdown the microcontroller after the offStateAckReceived only
-  if (sendState && !offStateAckReceived) {
-    sendOffState();
-  }
-  if (sendState && offStateAckReceived) {
-    espDeepSleep(hardCutOff); 
+  // if sendState is required, shutdown the microcontroller once every queued message, OFF state included, has been acked
+  if (sendState) {
+    queueMessage(MSG_OFF_STATE);
+    if (isHandshakeComplete() && configConfirmed) {
+      espDeepSleep(hardCutOff);
+    }
   }
   // if sendState is not required, MQTT or Wifi not available for example, shutdown microcontroller
   if (!sendState) {
@@ -388,103 +956,719 @@ void espDeepSleep(bool sendState, bool hardCutOff) {
 }
 void espDeepSleep(bool hardCutOff) {
   dataMQTTReceived = false;
+  // battery history and offline waterings have been delivered to HA
+  if (isAcked(MSG_SENSOR_STATE)) {
+    clearBatteryHistory(stateHistorySent);
+    rtcStore.data.offlineCount = 0;
+    rtcStore.data.brownOuts = 0;
+  }
   delay(DELAY_1000);
-#if CONFIG_IDF_TARGET_ESP32S3
-#endif
+  // the UART FIFO is empty after the delay, the lines that don't fit in it are lost with the RAM
+  logBuffer.drain(Serial, Serial.availableForWrite());
+  recordHistory();
+  // the sag of this watering, if any, corrects the internal resistance of the battery model
+  socEstimator.learn(rtcStore.data.batteryMilliohm, batterySampler.restingMv, batterySampler.loadMv, wateringPeakMa);
+  advanceClock(hardCutOff ? 0 : espSleepTime);
+  accountEnergy(hardCutOff ? 0 : espSleepTime);
+  rtcStore.save();
   // if hardCutOff sleep forever or until capacitive button is pressed
-    if (hardCutOff || espSleepTime == 0) {
-#if defined(ESP8266)
-    ESP.deepSleep(0);
-#else
-      esp_deep_sleep_start();
-#endif
-  } else {
-    ESP.deepSleep(espSleepTime);
+  Board::deepSleep(hardCutOff ? 0 : espSleepTime);
+
+}
+
+// charge of this wake and of the sleep that follows it, totals are kept in RTC memory
+void accountEnergy(uint64_t sleepMicros) {
+
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+    energyAccountant.addPump(pumpTimer.onMillis(zone), ZONE_TABLE[zone].currentMa);
   }
+  energyAccountant.close(rtcStore.data.energy, sleepMicros);
 
 }
 // force deepSleep after 15 minutes
 void forceDeepSleep() {
 
+  // HA or the broker did not complete the wake within the connection budget, water on the local schedule and back off
+  if (!uploadMode && millis() > awakeBudget()) {
+    offlineWake();
+  }
   if(millis() > nowMillisForceDeepSleepStatus + FORCE_DEEP_SLEEP_TIME){
     nowMillisForceDeepSleepStatus = millis();
-    digitalWrite(WATER_PUMP_PIN, LOW);
-    espDeepSleep(false, true);
+    pumpTimer.stop();
+    // a session opened with the button goes back to the usual schedule, nobody would press it again
+    espDeepSleep(false, !interactiveSession);
+  }
+
+}
+
+/********************************** WAKE CYCLE STATE MACHINE *****************************************/
+void enterWakeState(WakeState next) {
+
+  wakeStateDwellMillis[wakeState] += millis() - wakeStateEnteredMillis;
+  wakeState = next;
+  wakeStateEnteredMillis = millis();
+  if (wakeStateVisits[next] < UINT8_MAX) {
+    wakeStateVisits[next]++;
   }
 
 }
 
-/********************************** BATTERY LEVEL *****************************************/
-// read analog battery level from A0 pin (voltage divider required on that PIN because ESP can read up to 3.3V and the battery goes up to 4.2V)
-int readAnalogBatteryLevel() {
+// time spent in a state so far, current state included
+unsigned long wakeStateDwell(WakeState state) {
 
-  return analogRead(ANALOG_IN_PIN);
+  return wakeStateDwellMillis[state] + (state == wakeState ? millis() - wakeStateEnteredMillis : 0);
+
+}
+
+// Send status on startup and wait for MQTT config, this is subscribed with QoS1 so MQTT server will retry until received
+void requestConfig() {
+
+  queueMessage(MSG_ON_STATE);
+  if (isAcked(MSG_ON_STATE) && !configConfirmed && millis() > handshake[MSG_ON_STATE].sentMillis + WAKE_STATES[wakeState].retryMillis) {
+    // ON state acked but config lost, send ON state again to ask for a new config
+    handshake[MSG_ON_STATE].acked = false;
+  }
+
+}
+
+WakeState wakeBoot() {
+
+  return WAKE_CONFIG;
+
+}
+
+// MQTT config received (MQTT Config sent via HA in QoS1) or cached config in use, job start
+WakeState wakeConfig() {
+
+  if (!dataMQTTReceived || !(isAcked(MSG_ON_STATE) || configFromCache)) {
+    return WAKE_CONFIG;
+  }
+  if (uploadMode) {
+    return WAKE_UPLOAD;
+  }
+  // HA asks to water but the station already did it today while HA was unreachable, just turn off the switch in HA
+  if (waterPumpActive && wateredOfflineToday()) {
+    queueMessage(MSG_PUMP_ACTIVE_OFF);
+    return WAKE_REPORT;
+  }
+  // if battery is below WATER_PUMP_CUTOFF the microcontroller can continue to wake up and sleep but it can't turn on the water pump
+  if (waterPumpActive && !waterPumpCutOff) {
+    // HA keeps the switch on, the next wakes try again until the battery is better or the watering can't wait anymore
+    wateringDeferred = deferWatering();
+    return wateringDeferred ? WAKE_REPORT : WAKE_PUMP_START;
+  }
+  return WAKE_REPORT;
+
+}
+
+WakeState wakeUpload() {
+
+  pumpTimer.stop();
+  if (!uploadMode) {
+    return WAKE_CONFIG;
+  }
+  sendSensorStateAfterSeconds(TENSECONDSPERIOD); // this sendState does not wait for an ack
+  if (historyLog.querying()) {
+    sendHistoryChunk();
+  }
+  if (otaUpdater.active()) {
+    otaUpdater.loop();
+  }
+  if (otaUpdater.reportDue()) {
+    sendOtaProgress();
+  }
+  return WAKE_UPLOAD;
+
+}
+
+// Water pump was not active, send state and sleep until next
+WakeState wakeReport() {
+
+  pumpTimer.stop();
+  queueMessage(MSG_PUMP_POWER_OFF);
+  queueMessage(MSG_SENSOR_STATE);
+  return WAKE_SLEEP;
+
+}
+
+// Water pump active, sensor state and pump state are sent together, the pump is turned on when its ACK is received.
+// The pump never starts on a cached config, HA has to confirm it first.
+WakeState wakePumpStart() {
+
+  if (uploadMode) {
+    return WAKE_UPLOAD;
+  }
+  if (configConfirmed) {
+    queueMessage(MSG_SENSOR_STATE);
+    queueMessage(MSG_PUMP_POWER_ON);
+  }
+  return isAcked(MSG_PUMP_POWER_ON) ? WAKE_PUMP_RUN : WAKE_PUMP_START;
+
+}
+
+WakeState wakePumpRun() {
+
+  if (waterPumpPower && !uploadMode) {
+    turnOffWaterPumpAfterSeconds(); // Pump is turned off by the pump timer, no matter for ACK from the MQTT server
+    // continue to send state every seconds when the pump is turned on
+    sendSensorStateAfterSeconds(DELAY_1000); // this sendState does not wait for an ack
+    return WAKE_PUMP_RUN;
+  }
+  // Update the MQTT server with off state of the pump, then the microcontroller is finally sleeping
+  pumpTimer.stop();
+  waterPumpPower = false;
+  recordWatering(false, pumpTimer.onMillis());
+  queueMessage(MSG_PUMP_POWER_OFF);
+  queueMessage(MSG_PUMP_ACTIVE_OFF);
+  return uploadMode ? WAKE_UPLOAD : WAKE_SLEEP;
+
+}
+
+WakeState wakeSleep() {
+
+  if (uploadMode) {
+    return WAKE_UPLOAD;
+  }
+  espDeepSleep(true, hardCutOff);
+  return WAKE_SLEEP;
+
+}
+
+/********************************** WATERING ZONES *****************************************/
+// run time of a zone with the config in use, 0 if the zone is not watered
+unsigned long zoneMillis(uint8_t zone) {
+
+  const ZoneConfig &config = mqttConfig.zones[zone];
+  if (config.ml > 0) {
+    return PumpTimer::doseMillis(config.ml, ZONE_TABLE[zone].flowMlPerMinute);
+  }
+  return config.seconds * 1000UL;
+
+}
+
+// true if the zone can run in [start, start + duration) together with the zones already planned,
+// a zone that alone needs more than the supply can run only when nothing else is running
+bool supplyAllows(uint8_t zone, unsigned long start, unsigned long duration) {
+
+  for (uint8_t other = 0; other < zone; other++) {
+    // the load only grows when a run starts, checking the start of the interval and every start inside it is enough
+    const PumpRun &check = wateringPlan[other];
+    unsigned long at = check.startMillis > start ? check.startMillis : start;
+    if (check.durationMillis == 0 || at >= start + duration || at >= check.startMillis + check.durationMillis) {
+      continue;
+    }
+    unsigned long loadMa = ZONE_TABLE[zone].currentMa;
+    for (uint8_t running = 0; running < zone; running++) {
+      const PumpRun &run = wateringPlan[running];
+      if (run.durationMillis > 0 && run.startMillis <= at && at < run.startMillis + run.durationMillis) {
+        loadMa += ZONE_TABLE[running].currentMa;
+      }
+    }
+    if (loadMa > PUMP_SUPPLY_MA) {
+      return false;
+    }
+  }
+  return true;
+
+}
+
+// zones start in table order, as soon as the supply allows it, returns the duration of the whole watering
+unsigned long planWatering() {
+
+  unsigned long wateringEnd = 0;
+  unsigned long previousStart = 0;
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+    PumpRun &run = wateringPlan[zone];
+    run.pin = ZONE_TABLE[zone].pin;
+    run.startMillis = previousStart;
+    run.durationMillis = batterySampler.restingMv < ZONE_TABLE[zone].minBatteryMv ? 0 : zoneMillis(zone);
+    if (run.durationMillis == 0) {
+      continue;
+    }
+    // wait for the next zone that ends until there is enough current for this one
+    while (!supplyAllows(zone, run.startMillis, run.durationMillis)) {
+      unsigned long nextEnd = 0;
+      for (uint8_t other = 0; other < zone; other++) {
+        unsigned long end = wateringPlan[other].startMillis + wateringPlan[other].durationMillis;
+        if (wateringPlan[other].durationMillis > 0 && end > run.startMillis && (nextEnd == 0 || end < nextEnd)) {
+          nextEnd = end;
+        }
+      }
+      run.startMillis = nextEnd;
+    }
+    if (run.startMillis + run.durationMillis > WATERING_MAX_MILLIS) {
+      run.durationMillis = run.startMillis < WATERING_MAX_MILLIS ? WATERING_MAX_MILLIS - run.startMillis : 0;
+    }
+    previousStart = run.startMillis;
+    if (run.startMillis + run.durationMillis > wateringEnd) {
+      wateringEnd = run.startMillis + run.durationMillis;
+    }
+  }
+  return fitWatering(wateringEnd);
+
+}
+
+// charge of the plan against the charge the battery can give at its peak current, when it doesn't fit every run
+// is shortened by the same ratio so the zones keep their order, a watering too short to be useful is skipped
+unsigned long fitWatering(unsigned long wateringEnd) {
+
+  wateringPercent = 100;
+  wateringPeakMa = 0;
+  if (wateringEnd == 0) {
+    return 0;
+  }
+  uint64_t planMaMillis = (uint64_t) wateringEnd * ENERGY_ACK_WAIT_MA;
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+    const PumpRun &run = wateringPlan[zone];
+    if (run.durationMillis == 0) {
+      continue;
+    }
+    planMaMillis += (uint64_t) run.durationMillis * zoneBatteryMa(zone);
+    // the load only grows when a run starts, the start of every run is enough to find the peak
+    uint32_t loadMa = ENERGY_ACK_WAIT_MA;
+    for (uint8_t other = 0; other < ZONE_COUNT; other++) {
+      const PumpRun &check = wateringPlan[other];
+      if (check.durationMillis > 0 && check.startMillis <= run.startMillis && run.startMillis < check.startMillis + check.durationMillis) {
+        loadMa += zoneBatteryMa(other);
+      }
+    }
+    if (loadMa > wateringPeakMa) {
+      wateringPeakMa = loadMa;
+    }
+  }
+  uint64_t availableMaMillis = socEstimator.availableMaMillis(batterySampler.restingMv, wateringPeakMa, rtcStore.data.batteryMilliohm);
+  if (planMaMillis <= availableMaMillis) {
+    return wateringEnd;
+  }
+  wateringPercent = availableMaMillis * 100 / planMaMillis;
+  wateringEnd = wateringEnd * availableMaMillis / planMaMillis;
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+    PumpRun &run = wateringPlan[zone];
+    run.startMillis = run.startMillis * availableMaMillis / planMaMillis;
+    run.durationMillis = wateringEnd < SOC_MIN_WATERING_MILLIS ? 0 : run.durationMillis * availableMaMillis / planMaMillis;
+  }
+  if (wateringEnd < SOC_MIN_WATERING_MILLIS) {
+    LOG_WARN("BATTERY TOO LOW FOR THE WATERING");
+    wateringPercent = 0;
+    return 0;
+  }
+  LOG_WARN("WATERING SHORTENED BY THE BATTERY, PERCENT=%u", wateringPercent);
+  return wateringEnd;
+
+}
+
+// current drawn from the battery by one zone through the step up module
+uint32_t zoneBatteryMa(uint8_t zone) {
+
+  return (uint32_t) ZONE_TABLE[zone].currentMa * PUMP_STEP_UP_PERMILLE / 1000;
+
+}
+
+bool hasWatering(const MQTTConfig &config) {
+
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+    if (config.zones[zone].seconds > 0 || config.zones[zone].ml > 0) {
+      return true;
+    }
+  }
+  return false;
+
+}
+
+/********************************** LOCAL CLOCK AND OFFLINE WATERING *****************************************/
+// HA sends its local time as "2026-10-17 21:30:00.123456+02:00", the offset is ignored, the schedule is local too
+bool parseHaTime(const char* haTime, uint32_t &seconds) {
+
+  int year, month, day, hour, minute, second;
+  if (haTime == nullptr || sscanf(haTime, "%d-%d-%d %d:%d:%d", &year, &month, &day, &hour, &minute, &second) != 6 || year < 1970) {
+    return false;
+  }
+  // days since 1970-01-01 of a proleptic gregorian date
+  year -= month <= 2;
+  int era = year / 400;
+  int yearOfEra = year - era * 400;
+  int dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  int dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+  uint32_t days = era * 146097 + dayOfEra - 719468;
+  seconds = days * SECONDS_PER_DAY + hour * 3600 + minute * 60 + second;
+  return true;
+
+}
+
+void syncClock(const char* haTime) {
+
+  uint32_t seconds;
+  if (parseHaTime(haTime, seconds)) {
+    // below ESP_CUTOFF the wake goes on as a timer wake and reports the hard cutoff, no interactive session
+    if (isEarlyWake(seconds) && batterySampler.restingMv >= ESP_CUTOFF) {
+      LOG_INFO("WOKEN UP BY THE BUTTON %lu SECONDS EARLY", static_cast<unsigned long>(localTime() - seconds));
+      buttonWake();
+    }
+    rtcStore.data.clockAtBoot = seconds - millis() / 1000;
+    rtcStore.data.clockValid = true;
+  }
+
+}
+
+uint32_t localTime() {
+
+  return rtcStore.data.clockAtBoot + millis() / 1000;
+
+}
+
+// the next wake starts after this wake and the deep sleep, 0 means sleep forever and the time is lost
+void advanceClock(uint64_t sleepMicros) {
+
+  rtcStore.data.sleepSeconds = sleepMicros / 1000000;
+  rtcStore.data.buttonOnlySleep = sleepMicros == 0;
+  if (sleepMicros == 0) {
+    rtcStore.data.clockValid = false;
+  } else {
+    rtcStore.data.clockAtBoot = localTime() + sleepMicros / 1000000;
+  }
+  // minutes between the battery sample of this wake and the one of the next wake
+  rtcStore.data.trendSleepMinutes = sleepMicros == 0 ? 0 : (sleepMicros / 1000000 + millis() / 1000 + 30) / 60;
+
+}
+
+bool isWateringDue() {
+
+  const MQTTConfig &config = rtcStore.data.config;
+  if (!rtcStore.data.clockValid || !rtcStore.data.configValid || config.waterMinute == NO_WATERING_SCHEDULE || !hasWatering(config)) {
+    return false;
+  }
+  uint32_t now = localTime();
+  return now / SECONDS_PER_DAY != rtcStore.data.lastWateringDay && (now % SECONDS_PER_DAY) / 60 >= config.waterMinute;
+
+}
+
+bool wateredOfflineToday() {
+
+  return rtcStore.data.clockValid && rtcStore.data.offlineCount > 0
+    && rtcStore.data.offline[rtcStore.data.offlineCount - 1].time / SECONDS_PER_DAY == localTime() / SECONDS_PER_DAY;
+
+}
+
+void recordWatering(bool offline, unsigned long pumpMillis) {
+
+  if (!rtcStore.data.clockValid) {
+    return;
+  }
+  rtcStore.data.lastWateringDay = localTime() / SECONDS_PER_DAY;
+  rtcStore.data.deferredSince = 0;
+  if (offline) {
+    // queue is full when HA has been unreachable for days, the oldest watering is dropped
+    if (rtcStore.data.offlineCount == OFFLINE_WATERING_SIZE) {
+      memmove(rtcStore.data.offline, rtcStore.data.offline + 1, sizeof(OfflineWatering) * (OFFLINE_WATERING_SIZE - 1));
+      rtcStore.data.offlineCount--;
+    }
+    OfflineWatering &watering = rtcStore.data.offline[rtcStore.data.offlineCount++];
+    watering.time = localTime();
+    watering.pumpSeconds = pumpMillis / 1000;
+    watering.batteryMv = batterySampler.loadMv > 0 ? batterySampler.loadMv : batterySampler.restingMv;
+  }
+
+}
+
+// HA or the broker are unreachable, water if the local schedule says so and sleep, it never returns
+void offlineWake() {
+
+  pumpTimer.stop();
+  if (waterPumpPower) {
+    // watering started by HA and cut by the connection budget, it counts as the watering of the day
+    waterPumpPower = false;
+    recordWatering(false, pumpTimer.onMillis());
+  }
+  if (rtcStore.data.configValid) {
+    mqttConfig = rtcStore.data.config;
+    applyMQTTConfig();
+  }
+  if (isWateringDue() && !waterPumpCutOff && !espCutOff && !deferWatering()) {
+    LOG_WARN("HA UNREACHABLE, WATERING ON LOCAL SCHEDULE");
+    WiFi.mode(WIFI_OFF); // nothing left to say to HA on this wake, the result is reported on the next one
+    energyAccountant.enter(ENERGY_AWAKE);
+    waterPumpPower = true;
+    pumpTimer.start(wateringPlan, ZONE_COUNT);
+    nowMillisBatteryLoad = millis();
+    while (waterPumpPower) {
+      turnOffWaterPumpAfterSeconds();
+      delay(DELAY_10);
+    }
+    recordWatering(true, pumpTimer.onMillis());
+  }
+  backOff();
+  espDeepSleep(false, espCutOff);
+
+}
+
+// connection budget of this wake, the watering started by HA is added to it
+unsigned long awakeBudget() {
+
+  return CONNECTION_BUDGET + bootJitterMillis + wateringMillis;
+
+}
+
+// every wake that can't reach HA doubles the sleep time, the ON ack resets it
+void backOff() {
+
+  if (rtcStore.data.connectionFailures < BACKOFF_MAX_SHIFT) {
+    rtcStore.data.connectionFailures++;
+  }
+  espSleepTime *= 1UL << rtcStore.data.connectionFailures;
+  if (espSleepTime > BACKOFF_MAX_MINUTES * 60e6) {
+    espSleepTime = BACKOFF_MAX_MINUTES * 60e6;
+  }
+  LOG_WARN("CONNECTION BUDGET EXHAUSTED, SLEEPING SECONDS=%lu", static_cast<unsigned long>(espSleepTime / 1e6));
+
+}
+
+/********************************** ADAPTIVE SLEEP *****************************************/
+// resting battery voltage of this wake, a wake that doesn't follow a timed deep sleep starts a new trend
+void pushBatteryTrend(bool continues) {
+
+  RtcData &data = rtcStore.data;
+  if (!continues) {
+    data.trendCount = 0;
+  }
+  if (data.trendCount == BATTERY_TREND_SIZE) {
+    memmove(data.trend, data.trend + 1, sizeof(BatteryTrendSample) * (BATTERY_TREND_SIZE - 1));
+    data.trendCount--;
+  }
+  BatteryTrendSample &sample = data.trend[data.trendCount];
+  sample.mv = batterySampler.restingMv;
+  sample.minutes = data.trendCount > 0 ? data.trendSleepMinutes : 0;
+  data.trendCount++;
+  batteryTrendValid = batteryTrend(batteryTrendMvPerHour);
+
+}
+
+// least squares slope of the trend samples in mV per hour, false until the window is long enough
+bool batteryTrend(int &mvPerHour) {
+
+  const RtcData &data = rtcStore.data;
+  if (data.trendCount < TREND_MIN_SAMPLES) {
+    return false;
+  }
+  float sumX = 0, sumY = 0, sumXX = 0, sumXY = 0;
+  uint32_t minutes = 0;
+  for (uint8_t i = 0; i < data.trendCount; i++) {
+    if (i > 0) {
+      minutes += data.trend[i].minutes;
+    }
+    sumX += minutes;
+    sumY += data.trend[i].mv;
+    sumXX += (float) minutes * minutes;
+    sumXY += (float) minutes * data.trend[i].mv;
+  }
+  float denominator = data.trendCount * sumXX - sumX * sumX;
+  if (minutes < TREND_MIN_MINUTES || denominator <= 0) {
+    return false;
+  }
+  mvPerHour = lroundf((data.trendCount * sumXY - sumX * sumY) / denominator * 60);
+  return true;
+
+}
+
+// sleep of this wake within the bounds sent by HA, minutes is esp_sleep_time_minutes
+float adaptSleepMinutes(float minutes) {
+
+  float shortest = mqttConfig.sleepMinMinutes > 0 && mqttConfig.sleepMinMinutes < minutes ? mqttConfig.sleepMinMinutes : minutes;
+  float longest = mqttConfig.sleepMaxMinutes > minutes ? mqttConfig.sleepMaxMinutes : minutes;
+  int mv = batterySampler.restingMv;
+  bool charging = batteryTrendValid && batteryTrendMvPerHour >= TREND_CHARGING_MV_PER_HOUR;
+  bool draining = batteryTrendValid && batteryTrendMvPerHour < 0;
+  // energy is free, report often
+  if (mv >= BATTERY_FULL_MV || charging) {
+    return shortest;
+  }
+  // the water pump cutoff is near at the current discharge rate
+  if (draining && mv - WATER_PUMP_CUTOFF < -batteryTrendMvPerHour * TREND_HORIZON_HOURS) {
+    return longest;
+  }
+  // close to the cutoff and not recovering, the closer the longer
+  int margin = WATER_PUMP_CUTOFF + SLEEP_ADAPT_MARGIN_MV - mv;
+  if (margin > 0 && !(batteryTrendValid && batteryTrendMvPerHour > 0)) {
+    if (margin > SLEEP_ADAPT_MARGIN_MV) {
+      margin = SLEEP_ADAPT_MARGIN_MV;
+    }
+    return minutes + (longest - minutes) * margin / SLEEP_ADAPT_MARGIN_MV;
+  }
+  // steady battery, nothing new to report
+  if (batteryTrendValid && abs(batteryTrendMvPerHour) < TREND_STEADY_MV_PER_HOUR) {
+    return (minutes + longest) / 2;
+  }
+  return minutes;
+
+}
+
+// postpone a watering that HA or the local schedule asks for until the battery is full or charging,
+// at most water_defer_hours after the first request, then it waters no matter what (above the cutoff)
+bool deferWatering() {
+
+  if (mqttConfig.waterDeferHours == 0 || !rtcStore.data.clockValid) {
+    return false;
+  }
+  uint32_t now = localTime();
+  if (rtcStore.data.deferredSince == 0) {
+    rtcStore.data.deferredSince = now;
+  }
+  if (now - rtcStore.data.deferredSince >= mqttConfig.waterDeferHours * 3600UL) {
+    return false;
+  }
+  bool charging = batteryTrendValid && batteryTrendMvPerHour >= TREND_CHARGING_MV_PER_HOUR;
+  return batterySampler.restingMv < WATER_PUMP_CUTOFF + SLEEP_ADAPT_MARGIN_MV && !charging;
+
+}
+
+/********************************** HISTORY LOG *****************************************/
+// outcome of this wake, call it before advanceClock(), the record keeps the time the wake started
+void recordHistory() {
+
+  RtcData &data = rtcStore.data;
+  if (!data.clockValid) {
+    return;
+  }
+  // full only after brown-out wakes, they don't write the flash, the oldest wake is dropped
+  if (data.pendingRecordCount == HISTORY_PENDING_SIZE) {
+    memmove(data.pendingRecords, data.pendingRecords + 1, sizeof(HistoryRecord) * (HISTORY_PENDING_SIZE - 1));
+    data.pendingRecordCount--;
+  }
+  HistoryRecord &record = data.pendingRecords[data.pendingRecordCount++];
+  record.time = data.clockAtBoot;
+  record.batteryMv = batterySampler.restingMv;
+  record.batteryMinMv = batterySampler.loadMv > 0 && batterySampler.loadMv < batterySampler.restingMv ? batterySampler.loadMv : batterySampler.restingMv;
+  record.batteryMaxMv = batterySampler.restingMv;
+  record.pumpSeconds = (pumpTimer.onMillis() + 500) / 1000;
+  record.wakes = 1;
+  record.failedWakes = bootPath == BOOT_BROWNOUT || (bootPath != BOOT_SAMPLE && !configConfirmed) ? 1 : 0;
+  // a nearly empty cell may not last until the end of a flash write
+  if (data.pendingRecordCount == HISTORY_PENDING_SIZE && bootPath != BOOT_BROWNOUT) {
+    flushHistory();
+  }
+
+}
+
+void flushHistory() {
+
+  if (rtcStore.data.pendingRecordCount > 0 && historyLog.begin()) {
+    historyLog.append(rtcStore.data.pendingRecords, rtcStore.data.pendingRecordCount);
+    rtcStore.data.pendingRecordCount = 0;
+  }
+
+}
+
+// {"from":"2026-10-01 00:00:00","to":"2026-10-17 00:00:00"} in HA local time, a missing bound is open
+void processHistoryRequest(JsonVariantConst json) {
+
+  uint32_t from = 0;
+  uint32_t to = UINT32_MAX;
+  parseHaTime(json["from"] | "", from);
+  parseHaTime(json["to"] | "", to);
+  flushHistory();
+  if (historyLog.begin()) {
+    historyLog.startQuery(from, to);
+    historyChunkSeq = 0;
+  }
+
+}
+
+// One chunk per loop, MQTT keeps being polled between two chunks. Every record is
+// [time, battery, battery_min, battery_max, pump_seconds, wakes, failed_wakes], res is the length of the records.
+void sendHistoryChunk() {
+
+  HistoryTier tier;
+  uint8_t count = historyLog.nextChunk(historyChunk, tier);
+  JsonObject root = bootstrapManager.getJsonObject();
+  root["chunk"] = historyChunkSeq++;
+  root["res"] = HISTORY_TIER_NAMES[tier];
+  root["last"] = !historyLog.querying();
+  JsonArray records = root["records"].to<JsonArray>();
+  for (uint8_t i = 0; i < count; i++) {
+    JsonArray record = records.add<JsonArray>();
+    record.add(historyChunk[i].time);
+    record.add(historyChunk[i].batteryMv);
+    record.add(historyChunk[i].batteryMinMv);
+    record.add(historyChunk[i].batteryMaxMv);
+    record.add(historyChunk[i].pumpSeconds);
+    record.add(historyChunk[i].wakes);
+    record.add(historyChunk[i].failedWakes);
+  }
+  bootstrapManager.publish(stationTopic(SOLAR_STATION_HISTORY_STAT_TOPIC), root, false);
+  // don't idle before the next chunk
+  if (historyLog.querying()) {
+    Board::notifyEvent();
+  }
+
+}
+
+/********************************** OTA UPDATE *****************************************/
+// {"url":"http://192.168.1.3:8266/firmware.bin.gz","size":312456,"md5":"...","board":"solarstation_esp8266"}
+// sent by tools/ota_server.py, a manifest received while an update runs is ignored
+void processOtaRequest(JsonVariantConst json) {
+
+  LOG_INFO("OTA REQUEST SIZE=%lu", static_cast<unsigned long>(json["size"] | 0UL));
+  otaUpdater.start(json["url"] | "", json["size"] | 0UL, json["md5"] | "", json["board"] | "");
+
+}
+
+// state changes and download progress, the station restarts on the new firmware once "done" is out
+void sendOtaProgress() {
+
+  JsonObject root = bootstrapManager.getJsonObject();
+  root["state"] = OTA_STATE_NAMES[otaUpdater.state];
+  root["offset"] = otaUpdater.offset;
+  root["size"] = otaUpdater.size;
+  root["pct"] = otaUpdater.percent();
+  root["resumes"] = otaUpdater.resumes;
+  if (otaUpdater.state == OTA_ERROR) {
+    root["error"] = OTA_ERROR_NAMES[otaUpdater.error];
+    LOG_WARN("OTA FAILED ERROR=%s", OTA_ERROR_NAMES[otaUpdater.error]);
+  }
+  bootstrapManager.publish(stationTopic(SOLAR_STATION_OTA_STAT_TOPIC), root, false);
+  if (otaUpdater.state == OTA_DONE) {
+    LOG_INFO("OTA DONE, RESTARTING");
+    // on the ESP8266 saving now would erase the command that makes eboot copy the new image, the RTC data is lost instead
+    if (Board::OTA_KEEPS_RTC) {
+      rtcStore.save();
+    }
+    delay(DELAY_1000);
+    ESP.restart();
+  }
 
 }
 
 /********************************** START MAIN LOOP *****************************************/
 void loop() {  
   
+  unsigned long loopStartMicros = micros();
   // Bootsrap loop() with Wifi, MQTT and OTA functions
   bootstrapManager.bootstrapLoop(manageDisconnections, manageQueueSubscription, manageHardwareButton);
+  healthProfiler.addBootstrap(micros() - loopStartMicros);
 
-  // Send status on startup and wait for MQTT config, this is subscribed with QoS1 so MQTT server will retry until received
-  if (!onStateAckReceived || !dataMQTTReceived) {
-    sendOnState();
-  }
- 
-  // MQTT config received, job start (MQTT Config sent via HA in QoS1)
-  if (dataMQTTReceived && onStateAckReceived) {
-    if (uploadMode) {
-      digitalWrite(WATER_PUMP_PIN, LOW);
-      sendSensorStateAfterSeconds(TENSECONDSPERIOD); // this sendState does not wait for an ack    
-    } else {
-      // if battery analog level is below 816 (3.3V) the microcontroller can continue to wake up and sleep but it can't turn on the water pump
-      if (waterPumpActive && !waterPumpCutOff) {      
-        // Water pump active, if the pump was off, send sensor state and pump state for the first time              
-        if (!sensorStateAckReceived) {
-          sendSensorState();
-        } else {
-          if (!waterPumpPowerStateOnAckReceived) {            
-            sendWaterPumpPowerStateOn();                                             
-          } else {
-            if (waterPumpPower) {
-              turnOffWaterPumpAfterSeconds(); // Pump is turned off as soon as the delay is reached, no matter for ACK from the MQTT server
-              // continue to send state every seconds when the pump is turned on
-              sendSensorStateAfterSeconds(DELAY_1000); // this sendState does not wait for an ack    
-            } else {
-              if (!waterPumpPowerStateOffAckReceived) {
-                sendWaterPumpPowerStateOff(); // Update the MQTT server with off state of the pump when it is possible
-              } else {
-                if (!waterPumpActiveStateOffAckReceived) {
-                  sendWaterPumpActiveStateOff();
-                } else {
-                  espDeepSleep(true, false);
-                  // Pump is turned off, microcontroller is finally sleeping
-                }
-              }                            
-            }          
-          }                          
-        }         
-      } else {
-        // Water pump was not active, send state and sleep until next
-        digitalWrite(WATER_PUMP_PIN, LOW);
-        if (!waterPumpPowerStateOffAckReceived) {
-          sendWaterPumpPowerStateOff();
-        } else {
-          if (!sensorStateAckReceived) {
-            sendSensorState();
-          } else {
-            espDeepSleep(true, false);
-          }          
-        }        
-      }
+  requestConfig();
+
+  // run the current state, states that complete immediately are chained in the same loop
+  for (uint8_t transitions = 0; transitions < WAKE_STATE_COUNT; transitions++) {
+    WakeState next = WAKE_STATES[wakeState].run();
+    if (next == wakeState) {
+      break;
     }
+    enterWakeState(next);
   }
 
-  // Force deepSleep after 15 minutes of activity, no matter what's happening, some errors occured probably.
+  // send or retransmit every message that is waiting for an ACK
+  flushHandshake();
+
+  // Force deepSleep when the connection budget runs out, after 1 hour of activity in upload mode
   forceDeepSleep();
 
-  delay(DELAY_10);
+  // log lines go to the UART only as far as its FIFO has room
+  logBuffer.drain(Serial, Serial.availableForWrite());
+
+  healthProfiler.addLoop(micros() - loopStartMicros);
+  healthProfiler.sampleHeap();
+
+  // idle until the next MQTT poll, a message or the end of the watering wakes the loop at once
+  Board::waitForEvent(Board::IDLE_POLL_MS);
   
-}
\ No newline at end of file
+}
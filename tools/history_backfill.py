@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+"""
+  history_backfill.py - Fetch the on-device history of a Solar Station as CSV
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+
+  NOTE: the station answers only while upload_mode is on, turn it on or press the button first.
+  The range is in HA local time, records come back oldest first in chunks on stat/<id>/HISTORY.
+  pip install paho-mqtt
+"""
+
+import argparse
+import csv
+import json
+import logging
+import sys
+import threading
+
+import paho.mqtt.client as mqtt
+
+FIELDS = ["time", "battery", "battery_min", "battery_max", "pump_seconds", "wakes", "failed_wakes"]
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Fetch the on-device history of a Solar Station as CSV")
+    parser.add_argument("--host", default="localhost")
+    parser.add_argument("--port", type=int, default=1883)
+    parser.add_argument("--username")
+    parser.add_argument("--password")
+    parser.add_argument("--station", required=True, help="ID of the station in its topics")
+    parser.add_argument("--from", dest="start", help="HA local time, 2026-10-01 00:00:00")
+    parser.add_argument("--to", dest="end", help="HA local time, 2026-10-17 00:00:00")
+    parser.add_argument("--timeout", type=float, default=60, help="seconds to wait for the last chunk")
+    args = parser.parse_args()
+    logging.basicConfig(level=logging.INFO, format="%(asctime)s %(message)s")
+
+    request = {key: value for key, value in (("from", args.start), ("to", args.end)) if value}
+    done = threading.Event()
+    writer = csv.writer(sys.stdout)
+    writer.writerow(["res"] + FIELDS)
+    expected = [0]
+
+    def on_connect(client, userdata, *rest):
+        client.subscribe("stat/%s/HISTORY" % args.station)
+        client.publish("cmnd/%s/HISTORY" % args.station, json.dumps(request), qos=0, retain=False)
+
+    def on_message(client, userdata, message):
+        chunk = json.loads(message.payload)
+        # QoS 0, a lost chunk leaves a hole, ask again from the time of the last record written
+        if chunk["chunk"] != expected[0]:
+            logging.warning("chunks %d to %d lost", expected[0], chunk["chunk"] - 1)
+        expected[0] = chunk["chunk"] + 1
+        for record in chunk["records"]:
+            writer.writerow([chunk["res"]] + record)
+        if chunk["last"]:
+            done.set()
+
+    # paho-mqtt 2.x asks for the callback API version, 1.x doesn't know it
+    if hasattr(mqtt, "CallbackAPIVersion"):
+        client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2, client_id="solarstation_history_backfill")
+    else:
+        client = mqtt.Client(client_id="solarstation_history_backfill")
+    if args.username:
+        client.username_pw_set(args.username, args.password)
+    client.on_connect = on_connect
+    client.on_message = on_message
+    client.connect(args.host, args.port)
+    client.loop_start()
+    complete = done.wait(args.timeout)
+    client.loop_stop()
+    if not complete:
+        logging.warning("no last chunk after %s seconds, is upload_mode on?", args.timeout)
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,186 @@
+#!/usr/bin/env python3
+"""
+  ota_server.py - Firmware server and MQTT trigger for the Solar Station OTA in upload mode
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+
+  NOTE: serves the image over HTTP with Range support, publishes its manifest on cmnd/<id>/OTA
+  and prints the progress the station reports on stat/<id>/OTA. The station pulls the image and
+  resumes a dropped transfer from the last byte it wrote. Images for solarstation_esp8266 are
+  sent compressed with gzip -9, eboot inflates them. For solarstation the factory image of
+  esp32_create_factory_bin_post.py works too, the app is taken out of it.
+  Put the station in upload mode first: pip install paho-mqtt
+"""
+
+import argparse
+import gzip
+import hashlib
+import http.server
+import json
+import logging
+import socket
+import struct
+import threading
+import time
+
+import paho.mqtt.client as mqtt
+
+BOARDS = {"solarstation_esp8266": None, "solarstation": 9}  # ESP32 chip ID of the image header, ESP32-S3 is 9
+COMPRESSED_BOARDS = {"solarstation_esp8266"}
+PARTITION_TABLE_OFFSET = 0x8000
+PARTITION_MAGIC = b"\xaa\x50"
+
+
+def app_image(data):
+    """the first app partition of a factory image, the image itself otherwise"""
+    table = data[PARTITION_TABLE_OFFSET:PARTITION_TABLE_OFFSET + 0xC00]
+    if len(data) <= PARTITION_TABLE_OFFSET or not table.startswith(PARTITION_MAGIC):
+        return data
+    for entry in range(0, len(table), 32):
+        magic, kind, _, offset, _ = struct.unpack_from("<2sBBII", table, entry)
+        if magic != PARTITION_MAGIC:
+            break
+        if kind == 0:
+            return data[offset:]
+    raise SystemExit("factory image without an app partition")
+
+
+def build_image(path, board):
+    with open(path, "rb") as firmware:
+        data = app_image(firmware.read())
+    if data[:1] != b"\xe9":
+        raise SystemExit("%s is not an ESP image" % path)
+    chip = BOARDS[board]
+    if chip is not None and struct.unpack_from("<H", data, 12)[0] != chip:
+        raise SystemExit("%s is not an image for %s" % (path, board))
+    if board in COMPRESSED_BOARDS:
+        data = gzip.compress(data, compresslevel=9, mtime=0)
+    return data
+
+
+class ImageHandler(http.server.BaseHTTPRequestHandler):
+    image = b""
+    path_name = "/firmware.bin"
+    bytes_per_second = 0
+    drop_every = 0
+
+    def do_GET(self):
+        if self.path != self.path_name:
+            self.send_error(404)
+            return
+        start = 0
+        ranged = self.headers.get("Range", "")
+        if ranged.startswith("bytes=") and ranged.endswith("-"):
+            start = int(ranged[6:-1])
+            if start >= len(self.image):
+                self.send_error(416)
+                return
+        self.send_response(206 if ranged else 200)
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("Content-Length", str(len(self.image) - start))
+        if ranged:
+            self.send_header("Content-Range", "bytes %d-%d/%d" % (start, len(self.image) - 1, len(self.image)))
+        self.end_headers()
+        self.send_image(start)
+
+    def send_image(self, start):
+        sent = 0
+        for offset in range(start, len(self.image), 1024):
+            chunk = self.image[offset:offset + 1024]
+            try:
+                self.wfile.write(chunk)
+            except (BrokenPipeError, ConnectionResetError):
+                return
+            sent += len(chunk)
+            # --drop-every closes the connection to exercise the resume on the station
+            if self.drop_every and sent >= self.drop_every and offset + len(chunk) < len(self.image):
+                logging.info("dropping the connection at byte %d", offset + len(chunk))
+                return
+            if self.bytes_per_second:
+                time.sleep(len(chunk) / self.bytes_per_second)
+
+    def log_message(self, fmt, *args):
+        logging.info("%s %s", self.address_string(), fmt % args)
+
+
+def local_address(broker):
+    with socket.socket(socket.AF_INET, socket.SOCK_DGRAM) as probe:
+        probe.connect((broker, 1883))
+        return probe.getsockname()[0]
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Update a Solar Station in upload mode over HTTP")
+    parser.add_argument("firmware", help=".pio/build/<env>/firmware.bin or the factory image of the solarstation env")
+    parser.add_argument("--id", default="solarstation", help="ID of the station in its MQTT topics")
+    parser.add_argument("--board", default="solarstation_esp8266", choices=sorted(BOARDS), help="PlatformIO environment of the image")
+    parser.add_argument("--host", default="localhost", help="MQTT broker")
+    parser.add_argument("--port", type=int, default=1883)
+    parser.add_argument("--username")
+    parser.add_argument("--password")
+    parser.add_argument("--http-host", help="address of this computer seen by the station, guessed from the route to the broker")
+    parser.add_argument("--http-port", type=int, default=8266)
+    parser.add_argument("--kbps", type=float, default=0, help="throttle the download, KB/s")
+    parser.add_argument("--drop-every", type=int, default=0, help="close the connection every N bytes, tests the resume")
+    args = parser.parse_args()
+    logging.basicConfig(level=logging.INFO, format="%(asctime)s %(message)s")
+
+    image = build_image(args.firmware, args.board)
+    ImageHandler.image = image
+    ImageHandler.path_name = "/firmware.bin.gz" if args.board in COMPRESSED_BOARDS else "/firmware.bin"
+    ImageHandler.bytes_per_second = args.kbps * 1024
+    ImageHandler.drop_every = args.drop_every
+    server = http.server.ThreadingHTTPServer(("", args.http_port), ImageHandler)
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+
+    http_host = args.http_host or local_address(args.host)
+    manifest = {
+        "url": "http://%s:%d%s" % (http_host, args.http_port, ImageHandler.path_name),
+        "size": len(image),
+        "md5": hashlib.md5(image).hexdigest(),
+        "board": args.board,
+    }
+    logging.info("serving %s", json.dumps(manifest))
+    done = threading.Event()
+
+    def on_connect(client, userdata, *rest):
+        client.subscribe("stat/%s/OTA" % args.id)
+        client.publish("cmnd/%s/OTA" % args.id, json.dumps(manifest, separators=(",", ":")), qos=1, retain=False)
+
+    def on_message(client, userdata, message):
+        report = json.loads(message.payload)
+        logging.info("%s %d%% resumes=%d %s", report.get("state"), report.get("pct", 0), report.get("resumes", 0), report.get("error", ""))
+        if report.get("state") in ("done", "error"):
+            done.set()
+
+    # paho-mqtt 2.x asks for the callback API version, 1.x doesn't know it
+    if hasattr(mqtt, "CallbackAPIVersion"):
+        client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2, client_id="solarstation_ota_server")
+    else:
+        client = mqtt.Client(client_id="solarstation_ota_server")
+    if args.username:
+        client.username_pw_set(args.username, args.password)
+    client.on_connect = on_connect
+    client.on_message = on_message
+    client.connect(args.host, args.port)
+    client.loop_start()
+    done.wait()
+    client.loop_stop()
+    server.shutdown()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,76 @@
+#!/usr/bin/env python3
+"""
+  telemetry_bridge.py - MessagePack to JSON bridge for the Solar Station telemetry
+
+ Copyright © 2020 - 2024  Davide Perini
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  You should have received a copy of the MIT License along with this program.
+  If not, see <https://opensource.org/licenses/MIT/>.
+
+  NOTE: stations built with TELEMETRY_MSGPACK publish STATE and POWER as MessagePack on
+  tele/<id>/STATE/mp and stat/<id>/POWER/mp, this bridge republishes them as JSON on
+  tele/<id>/STATE and stat/<id>/POWER, Home Assistant and its packages don't change.
+  Run it next to the broker: pip install paho-mqtt msgpack
+"""
+
+import argparse
+import json
+import logging
+
+import msgpack
+import paho.mqtt.client as mqtt
+
+MSGPACK_SUFFIX = "/mp"
+TOPICS = ["tele/+/STATE" + MSGPACK_SUFFIX, "stat/+/POWER" + MSGPACK_SUFFIX]
+
+
+def on_connect(client, userdata, *args):
+    for topic in TOPICS:
+        client.subscribe(topic)
+    logging.info("bridging %s", ", ".join(TOPICS))
+
+
+def on_message(client, userdata, message):
+    try:
+        payload = msgpack.unpackb(message.payload, raw=False)
+    except (ValueError, msgpack.UnpackException) as error:
+        logging.warning("%s: %s", message.topic, error)
+        return
+    # same compact form of the JSON sent by the firmware, the ACK automation reads the seq back from it
+    client.publish(message.topic[:-len(MSGPACK_SUFFIX)], json.dumps(payload, separators=(",", ":")), qos=0, retain=False)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Republish the Solar Station MessagePack telemetry as JSON")
+    parser.add_argument("--host", default="localhost")
+    parser.add_argument("--port", type=int, default=1883)
+    parser.add_argument("--username")
+    parser.add_argument("--password")
+    args = parser.parse_args()
+    logging.basicConfig(level=logging.INFO, format="%(asctime)s %(message)s")
+
+    # paho-mqtt 2.x asks for the callback API version, 1.x doesn't know it
+    if hasattr(mqtt, "CallbackAPIVersion"):
+        client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2, client_id="solarstation_telemetry_bridge")
+    else:
+        client = mqtt.Client(client_id="solarstation_telemetry_bridge")
+    if args.username:
+        client.username_pw_set(args.username, args.password)
+    client.on_connect = on_connect
+    client.on_message = on_message
+    client.connect(args.host, args.port)
+    client.loop_forever()
+
+
+if __name__ == "__main__":
+    main()